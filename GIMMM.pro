@@ -19,6 +19,20 @@ SOURCES += main.cpp \
     exponentialbackoff.cpp \
     messagemanager.cpp \
     dbconnection.cpp \
+    retryscheduler.cpp \
+    timingwheel.cpp \
+    timerservice.cpp \
+    fcmdispatcher.cpp \
+    stanzascanner.cpp \
+    fcmenvelope.cpp \
+    stanzaencoder.cpp \
+    tlssessioncache.cpp \
+    keepalivetracker.cpp \
+    congestionwindow.cpp \
+    tokenbucket.cpp \
+    recipientratelimiter.cpp \
+    dedupindex.cpp \
+    fcmproject.cpp \
     sqlite/sqlite3.c \
     unittests/gimmmtest.cpp
 
@@ -42,6 +56,21 @@ HEADERS += \
     exponentialbackoff.h \
     messagemanager.h \
     dbconnection.h \
+    retryscheduler.h \
+    timingwheel.h \
+    timerservice.h \
+    fcmdispatcher.h \
+    spscqueue.h \
+    stanzascanner.h \
+    fcmenvelope.h \
+    stanzaencoder.h \
+    tlssessioncache.h \
+    keepalivetracker.h \
+    congestionwindow.h \
+    tokenbucket.h \
+    recipientratelimiter.h \
+    dedupindex.h \
+    fcmproject.h \
     sqlite/sqlite3.h \
     unittests/gimmmtest.h
 
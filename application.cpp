@@ -4,9 +4,9 @@
 #include "balsession.h"
 
 #include <QByteArray>
-#include <QTimer>
 #include <QDataStream>
 #include <QCoreApplication>
+#include <QDateTime>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QSettings>
@@ -27,12 +27,152 @@ int Application::sigintFd[2];
 int Application::sigtermFd[2];
 
 
+/*!
+ * \brief read_retry_policy
+ * \param ini
+ * \param prefix e.g 'RETRY_SECTION/downstream_'
+ * \param default_max_attempts
+ * \return
+ */
+static RetryPolicy read_retry_policy(
+        const QSettings& ini,
+        const QString& prefix,
+        int default_max_attempts)
+{
+    RetryPolicy policy;
+    policy.baseMsec    = ini.value(prefix + "base_msec", (qint64)policy.baseMsec).toLongLong();
+    policy.capMsec     = ini.value(prefix + "cap_msec", (qint64)policy.capMsec).toLongLong();
+    policy.maxAttempts = ini.value(prefix + "max_attempts", default_max_attempts).toInt();
+
+    std::string jitter = ini.value(prefix + "jitter", "equal").toString().toStdString();
+    try
+    {
+        policy.jitter = RetryPolicy::jitterFromString(jitter);
+    }
+    catch (std::exception& err)
+    {
+        std::cout << "ERROR: Invalid config parameter '" << prefix.toStdString()
+                  << "jitter'. Valid values are none|full|equal. Exiting..." << std::endl;
+        exit(0);
+    }
+
+    if (policy.baseMsec <= 0 || policy.capMsec < policy.baseMsec)
+    {
+        std::cout << "ERROR: Invalid config parameter '" << prefix.toStdString()
+                  << "base_msec/cap_msec'. Exiting..." << std::endl;
+        exit(0);
+    }
+    return policy;
+}
+
+
+/*!
+ * \brief read_fcm_project
+ * Credentials, pool and send rate of one project. Whatever 'prefix' leaves
+ * out is taken from 'defaults' i.e the FCM_SECTION project.
+ * \param ini
+ * \param prefix   e.g 'FCM_PROJECT_news/'
+ * \param defaults null when reading FCM_SECTION itself.
+ * \param project
+ * \param now
+ */
+static void read_fcm_project(
+        const QSettings& ini,
+        const QString& prefix,
+        const FcmProject* defaults,
+        FcmProject& project,
+        std::int64_t now)
+{
+    std::string section = prefix.toStdString();
+    QString server_id  = ini.value(prefix + "server_id", "NULL").toString();
+    if ( server_id == "NULL")
+    {
+        std::cout << "ERROR: Missing config parameter '" << section << "server_id'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setServerId(server_id);
+
+    QString server_key = ini.value(prefix + "server_key", "NULL").toString();
+    if ( server_key == "NULL")
+    {
+        std::cout << "ERROR: Missing config parameter '" << section << "server_key'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setServerKey(server_key);
+
+    int port_no = ini.value(prefix + "port_no", defaults ? defaults->getPortNo() : 0).toInt();
+    if (port_no == 0)
+    {
+        std::cout << "ERROR: Missing config parameter '" << section << "port_no'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setPortNo(port_no);
+
+    QString host = ini.value(prefix + "host_address",
+                             defaults ? defaults->getHostAddress() : QString("NULL")).toString();
+    if ( host == "NULL")
+    {
+        std::cout << "ERROR: Missing config parameter '" << section << "host_address'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setHostAddress(host);
+
+    int pool_size = ini.value(prefix + "pool_size", defaults ? defaults->getPoolSize() : 1).toInt();
+    if (pool_size < 1)
+    {
+        std::cout << "ERROR: Invalid config parameter '" << section << "pool_size'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setPoolSize(pool_size);
+
+    int standby_count = ini.value(prefix + "standby_count",
+                                  defaults ? defaults->getStandbyCount() : DEFAULT_FCM_STANDBY_COUNT).toInt();
+    if (standby_count < 0)
+    {
+        std::cout << "ERROR: Invalid config parameter '" << section << "standby_count'. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setStandbyCount(standby_count);
+
+    double send_rate  = ini.value(prefix + "send_rate_per_sec",
+                                  defaults ? defaults->getSendRatePerSec() : 0).toDouble();
+    double send_burst = ini.value(prefix + "send_burst",
+                                  defaults ? defaults->getSendBurst() : DEFAULT_SEND_BURST).toDouble();
+    if (send_rate < 0 || send_burst < 1)
+    {
+        std::cout << "ERROR: Invalid config parameters '" << section << "send_rate_per_sec' "
+                  << "and '" << section << "send_burst'. Need rate >= 0 (0 = unlimited) "
+                  << "and burst >= 1. Exiting..." << std::endl;
+        exit(0);
+    }
+    project.setSendRate(send_rate, send_burst, now);
+}
+
+
 /*!
  * \brief Application::Application
  */
 Application::Application()
     :__fcmConnCount(0),
-     __fcmMsgManager(std::string("fcm"))
+     __fcmStatsInterval(DEFAULT_FCM_STATS_INTERVAL),
+     __fcmStatsTimer(INVALID_TIMER_HANDLE),
+     __fcmOutputHighWatermark(DEFAULT_OUTPUT_HIGH_WATERMARK),
+     __fcmOutputLowWatermark(DEFAULT_OUTPUT_LOW_WATERMARK),
+     __fcmTlsProtocol(QSsl::TlsV1_2OrLater),
+     __fcmShutdownTimeout(DEFAULT_SHUTDOWN_TIMEOUT),
+     __fcmKeepaliveMode(KeepaliveMode::XMPP_PING),
+     __fcmPingInterval(DEFAULT_PING_INTERVAL),
+     __fcmIdleTimeout(DEFAULT_IDLE_TIMEOUT),
+     __shutdownInProgress(false),
+     __shutdownTimer(INVALID_TIMER_HANDLE),
+     __fcmBatchOpen(false),
+     __retryTimer(INVALID_TIMER_HANDLE),
+     __retryTimerDue(-1),
+     __retryBatchSize(0),
+     __downstreamAckTimeout(DEFAULT_ACK_TIMEOUT),
+     __upstreamAckTimeout(DEFAULT_ACK_TIMEOUT),
+     __ackCheckInterval(DEFAULT_ACK_CHECK_INTERVAL),
+     __ackCheckTimer(INVALID_TIMER_HANDLE)
 {
     start();
 }
@@ -57,10 +197,15 @@ void Application::start()
     setupTcpServer();
 
     // load pending messages
-    std::cout << "Loading downstream pending messages..." << std::endl;
-    __dbConn.loadPendingMessages(__fcmMsgManager);
-    std::cout << "Loaded[" << __fcmMsgManager.getMessages().size()
-              <<  "] pending downstream messages.\n" << std::endl;
+    for (auto&& i: __fcmProjects)
+    {
+        MessageManager& msgmanager = i.second->getMessageManager();
+        std::cout << "Loading downstream pending messages for project["
+                  << i.first << "]..." << std::endl;
+        __dbConn.loadPendingMessages(msgmanager);
+        std::cout << "Loaded[" << msgmanager.getMessages().size()
+                  <<  "] pending downstream messages.\n" << std::endl;
+    }
     for ( auto &&i : __balSessionMap)
     {
         MessageManager& msgmanager = i.second->getMessageManager();
@@ -71,26 +216,100 @@ void Application::start()
               <<  "] pending downstream messages.\n" << std::endl;
     }
 
-    //connect to fcm.
-    FcmConnectionPtr_t fcmConn = createFcmHandle();
+    if (__upstreamDedup.getCapacity() > 0)
+    {
+        RecentIds_t ids;
+        __dbConn.loadRecentUpstreamIds(__upstreamDedup.getWindow() / 1000,
+                                       __upstreamDedup.getCapacity(), ids);
+        std::int64_t now = __timerService.now();
+        for (auto&& i: ids)
+            __upstreamDedup.insert(DedupIndex::upstreamKey(i.project, i.from, i.messageId),
+                                   now - i.ageSec * 1000);
+        std::cout << "Loaded[" << __upstreamDedup.size()
+                  << "] recent upstream message ids for duplicate detection.\n" << std::endl;
+    }
+
+    scheduleAckTimeoutCheck();
+    scheduleFcmStatsDump();
+
+    //connect to fcm. The first 'pool_size' sessions up of each project
+    //carry traffic, the rest wait as standbys.
+    for (auto&& i: __fcmProjects)
+    {
+        const FcmProjectPtr_t& project = i.second;
+        for (int n = 0; n < project->getPoolSize() + project->getStandbyCount(); n++)
+            openFcmConnection(project);
+    }
+}
+
+
+/*!
+ * \brief Application::openFcmConnection
+ * Adds a new connection to the pool of 'project' and starts connecting it to
+ * FCM. It takes traffic once its session is established.
+ * \param project
+ * \return
+ */
+FcmConnectionPtr_t Application::openFcmConnection(const FcmProjectPtr_t& project)
+{
+    FcmConnectionPtr_t fcmConn = createFcmHandle(project);
     setupFcmHandle(fcmConn);
-    fcmConn->connectToFcm(__fcmServerId, __fcmServerKey, __fcmHostAddress, __fcmPortNo);
+    quint16 port = project->getPortNo();
+    // the connection lives on its own thread.
+    QMetaObject::invokeMethod(fcmConn.get(), "connectToFcm", Qt::QueuedConnection,
+                              Q_ARG(QString, project->getServerId()),
+                              Q_ARG(QString, project->getServerKey()),
+                              Q_ARG(QString, project->getHostAddress()),
+                              Q_ARG(quint16, port));
+    return fcmConn;
 }
 
 
 /*!
  * \brief Application::createFcmHandle
+ * \param project
  * \return
  */
-FcmConnectionPtr_t Application::createFcmHandle()
+FcmConnectionPtr_t Application::createFcmHandle(const FcmProjectPtr_t& project)
 {
     int i = getNextFcmConnectionId();
-    FcmConnectionPtr_t fcmConn(new FcmConnection(i));
+    FcmConnectionPtr_t fcmConn = FcmConnection::create(i);
+    fcmConn->setOutputWatermarks(__fcmOutputHighWatermark, __fcmOutputLowWatermark);
+    fcmConn->setTlsPolicy(__fcmTlsProtocol, __fcmTlsCaCertificates, __fcmTlsSessionCache);
+    fcmConn->setKeepalive(__fcmKeepaliveMode, __fcmPingInterval, __fcmIdleTimeout);
     __fcmConnectionsMap.emplace(i, fcmConn);
+    __fcmConnectionProjects.emplace(i, project);
+    project->getDispatcher().addLink(i);
     return fcmConn;
 }
 
 
+/*!
+ * \brief Application::findFcmProject
+ * \param id fcm connection id.
+ * \return the project connection 'id' belongs to or a null ptr if it's gone.
+ */
+FcmProjectPtr_t Application::findFcmProject(int id)
+{
+    auto it = __fcmConnectionProjects.find(id);
+    if (it != __fcmConnectionProjects.end())
+        return it->second;
+    FcmProjectPtr_t nullproject;
+    return nullproject;
+}
+
+
+/*!
+ * \brief Application::findFcmProject
+ * \param name 'project' field of a BAL message, empty for the default one.
+ * \return the project or a null ptr if none is configured under 'name'.
+ */
+FcmProjectPtr_t Application::findFcmProject(const std::string& name)
+{
+    return routeFcmProject(__fcmProjects, __fcmDefaultProject, name);
+}
+
+
 /*!
  * \brief Application::readConfigFile
  */
@@ -114,35 +333,179 @@ void Application::readConfigFile()
 
     QSettings ini(filename, QSettings::IniFormat);
 
-    // FCM SECTION
-    __fcmServerId  = ini.value("FCM_SECTION/server_id", "NULL").toString();
-    if ( __fcmServerId == "NULL")
+    // FCM SECTION; the default project.
+    std::string default_project = ini.value("FCM_SECTION/project", DEFAULT_FCM_PROJECT).toString().toStdString();
+    __fcmDefaultProject = std::make_shared<FcmProject>(default_project, DEFAULT_FCM_SESSION_ID);
+    read_fcm_project(ini, "FCM_SECTION/", nullptr, *__fcmDefaultProject, __timerService.now());
+    __fcmProjects.emplace(default_project, __fcmDefaultProject);
+
+    // every other project served by this process has its own section.
+    // Its downstream rows are queued under 'fcm.<name>'.
+    QStringList projects = ini.value("FCM_SECTION/projects").toStringList();
+    for (auto&& i: projects)
+    {
+        QString name = i.trimmed();
+        if (name.isEmpty())
+            continue;
+        if (__fcmProjects.count(name.toStdString()))
+        {
+            std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/projects'. Project ["
+                      << name.toStdString() << "] is listed twice. Exiting..." << std::endl;
+            exit(0);
+        }
+        FcmProjectPtr_t project = std::make_shared<FcmProject>(
+                    name.toStdString(),
+                    std::string(DEFAULT_FCM_SESSION_ID) + "." + name.toStdString());
+        read_fcm_project(ini, "FCM_PROJECT_" + name + "/", __fcmDefaultProject.get(),
+                         *project, __timerService.now());
+        __fcmProjects.emplace(name.toStdString(), project);
+    }
+
+    std::string policy = ini.value("FCM_SECTION/dispatch_policy", "free_window").toString().toStdString();
+    DispatchPolicy dispatch_policy;
+    try
+    {
+        dispatch_policy = FcmDispatcher::policyFromString(policy);
+    }
+    catch (std::exception& err)
+    {
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/dispatch_policy'. "
+                  << "Valid values are free_window|ack_latency|token_hash. Exiting..." << std::endl;
+        exit(0);
+    }
+
+    bool congestion_control     = ini.value("FCM_SECTION/congestion_control", true).toBool();
+    std::int64_t max_window     = ini.value("FCM_SECTION/max_window",
+                                            (qint64)DEFAULT_MAX_WINDOW).toLongLong();
+    if (max_window < MIN_CONGESTION_WINDOW || max_window > MAX_PENDING_MESSAGES)
+    {
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/max_window'. "
+                  << "Need " << MIN_CONGESTION_WINDOW << " <= max_window <= "
+                  << MAX_PENDING_MESSAGES << ". Exiting..." << std::endl;
+        exit(0);
+    }
+    std::int64_t initial_window = ini.value("FCM_SECTION/initial_window",
+                                            (qint64)DEFAULT_INITIAL_WINDOW).toLongLong();
+    if (initial_window < MIN_CONGESTION_WINDOW || initial_window > max_window)
+    {
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/initial_window'. "
+                  << "Need " << MIN_CONGESTION_WINDOW << " <= initial_window <= "
+                  << max_window << ". Exiting..." << std::endl;
+        exit(0);
+    }
+
+    qint64 rate_limit_entries  = ini.value("FCM_SECTION/rate_limit_entries",
+                                           (qint64)DEFAULT_RATE_LIMIT_ENTRIES).toLongLong();
+    qint64 rate_limit_interval = ini.value("FCM_SECTION/rate_limit_interval_msec",
+                                           (qint64)DEFAULT_RATE_LIMIT_INTERVAL).toLongLong();
+    if (rate_limit_entries < 0 || rate_limit_interval <= 0 || rate_limit_interval > MAX_RATE_LIMIT_INTERVAL)
+    {
+        std::cout << "ERROR: Invalid config parameters 'FCM_SECTION/rate_limit_entries' "
+                  << "and 'FCM_SECTION/rate_limit_interval_msec'. Need entries >= 0 and "
+                  << "0 < interval <= " << MAX_RATE_LIMIT_INTERVAL << ". Exiting..." << std::endl;
+        exit(0);
+    }
+
+    // same dispatch and limits for every project, each with its own state.
+    for (auto&& i: __fcmProjects)
+    {
+        FcmProject& project = *i.second;
+        project.getDispatcher().setPolicy(dispatch_policy);
+        project.getDispatcher().setMaxWindow(max_window);
+        project.getDispatcher().setCongestionControl(congestion_control, initial_window);
+        project.getRateLimiter().setCapacity((std::size_t)rate_limit_entries);
+        project.getRateLimiter().setInitialInterval(rate_limit_interval);
+    }
+
+    qint64 dedup_entries    = ini.value("FCM_SECTION/upstream_dedup_entries",
+                                        (qint64)DEFAULT_DEDUP_ENTRIES).toLongLong();
+    qint64 dedup_window     = ini.value("FCM_SECTION/upstream_dedup_window_sec",
+                                        (qint64)DEFAULT_DEDUP_WINDOW).toLongLong();
+    if (dedup_entries < 0 || dedup_window <= 0)
+    {
+        std::cout << "ERROR: Invalid config parameters 'FCM_SECTION/upstream_dedup_entries' "
+                  << "and 'FCM_SECTION/upstream_dedup_window_sec'. Need entries >= 0 "
+                  << "and window > 0. Exiting..." << std::endl;
+        exit(0);
+    }
+    __upstreamDedup.setCapacity((std::size_t)dedup_entries);
+    __upstreamDedup.setWindow(dedup_window * 1000);
+
+    __fcmStatsInterval = ini.value("FCM_SECTION/stats_interval_msec",
+                                   (qint64)DEFAULT_FCM_STATS_INTERVAL).toLongLong();
+
+    __fcmOutputHighWatermark = ini.value("FCM_SECTION/output_high_watermark_bytes",
+                                         (qint64)DEFAULT_OUTPUT_HIGH_WATERMARK).toLongLong();
+    __fcmOutputLowWatermark  = ini.value("FCM_SECTION/output_low_watermark_bytes",
+                                         (qint64)DEFAULT_OUTPUT_LOW_WATERMARK).toLongLong();
+    if (__fcmOutputLowWatermark < 0 || __fcmOutputHighWatermark <= __fcmOutputLowWatermark)
     {
-        std::cout << "ERROR: Missing config parameter 'FCM_SECTION/server_id. Exiting." << std::endl;
+        std::cout << "ERROR: Invalid config parameters 'FCM_SECTION/output_high_watermark_bytes' "
+                  << "and 'FCM_SECTION/output_low_watermark_bytes'. "
+                  << "Need 0 <= low < high. Exiting..." << std::endl;
         exit(0);
     }
 
-    __fcmServerKey = ini.value("FCM_SECTION/server_key", "NULL").toString();
-    if ( __fcmServerKey == "NULL")
+    std::string tls = ini.value("FCM_SECTION/tls_protocol", DEFAULT_TLS_PROTOCOL).toString().toStdString();
+    try
     {
-        std::cout << "ERROR: Missing config parameter 'FCM_SECTION/server_key. Exiting..." << std::endl;
+        __fcmTlsProtocol = FcmConnection::tlsProtocolFromString(tls);
+    }
+    catch (std::exception& err)
+    {
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/tls_protocol'. "
+                  << "Valid values are tls1.2+|tls1.3. Exiting..." << std::endl;
         exit(0);
     }
 
-    __fcmPortNo = ini.value("FCM_SECTION/port_no", 0).toInt();
-    if (__fcmPortNo == 0)
+    if (ini.value("FCM_SECTION/tls_session_resumption", true).toBool())
+        __fcmTlsSessionCache = std::make_shared<TlsSessionCache>();
+
+    __fcmShutdownTimeout = ini.value("FCM_SECTION/shutdown_timeout_msec",
+                                     (qint64)DEFAULT_SHUTDOWN_TIMEOUT).toLongLong();
+    if (__fcmShutdownTimeout <= 0)
     {
-        std::cout << "ERROR: Missing config parameter 'FCM_SECTION/port_no. Exiting..." << std::endl;
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/shutdown_timeout_msec'. Exiting..." << std::endl;
         exit(0);
     }
 
-    __fcmHostAddress = ini.value("FCM_SECTION/host_address", "NULL").toString();
-    if ( __fcmHostAddress == "NULL")
+    std::string keepalive = ini.value("FCM_SECTION/keepalive_mode", "xmpp").toString().toStdString();
+    try
+    {
+        __fcmKeepaliveMode = KeepaliveTracker::modeFromString(keepalive);
+    }
+    catch (std::exception& err)
+    {
+        std::cout << "ERROR: Invalid config parameter 'FCM_SECTION/keepalive_mode'. "
+                  << "Valid values are whitespace|xmpp. Exiting..." << std::endl;
+        exit(0);
+    }
+    __fcmPingInterval = ini.value("FCM_SECTION/ping_interval_msec",
+                                  (qint64)DEFAULT_PING_INTERVAL).toLongLong();
+    __fcmIdleTimeout  = ini.value("FCM_SECTION/idle_timeout_msec",
+                                  (qint64)DEFAULT_IDLE_TIMEOUT).toLongLong();
+    // the idle timeout has to leave room for at least one ping to be answered.
+    if (__fcmPingInterval < 0 || __fcmIdleTimeout < 0 ||
+            (__fcmPingInterval > 0 && __fcmIdleTimeout > 0 && __fcmIdleTimeout <= __fcmPingInterval))
     {
-        std::cout << "ERROR: Missing config parameter 'FCM_SECTION/host_address. Exiting..." << std::endl;
+        std::cout << "ERROR: Invalid config parameters 'FCM_SECTION/ping_interval_msec' "
+                  << "and 'FCM_SECTION/idle_timeout_msec'. Need idle timeout > ping interval "
+                  << "(0 turns either off). Exiting..." << std::endl;
         exit(0);
     }
 
+    QString ca_file = ini.value("FCM_SECTION/tls_ca_file", "").toString();
+    if (!ca_file.isEmpty())
+    {
+        __fcmTlsCaCertificates = QSslCertificate::fromPath(ca_file);
+        if (__fcmTlsCaCertificates.isEmpty())
+        {
+            std::cout << "ERROR: No certificate found in 'FCM_SECTION/tls_ca_file'["
+                      << ca_file.toStdString() << "]. Exiting..." << std::endl;
+            exit(0);
+        }
+    }
+
     // SERVER SECTION
     __serverPortNo = ini.value("SERVER_SECTION/port_no", 0).toInt();
     if ( __serverPortNo == 0)
@@ -163,6 +526,25 @@ void Application::readConfigFile()
         exit(0);
     }
 
+    // RETRY SECTION (optional)
+    __downstreamRetryScheduler.setPolicy(
+                read_retry_policy(ini, "RETRY_SECTION/downstream_", MAX_DOWNSTREAM_UPLOAD_RETRY));
+    __upstreamRetryScheduler.setPolicy(
+                read_retry_policy(ini, "RETRY_SECTION/upstream_", MAX_UPSTREAM_UPLOAD_RETRY));
+    __retryBatchSize = ini.value("RETRY_SECTION/batch_size", 500).toUInt();
+    __downstreamAckTimeout = ini.value("RETRY_SECTION/downstream_ack_timeout_msec",
+                                       (qint64)DEFAULT_ACK_TIMEOUT).toLongLong();
+    __upstreamAckTimeout   = ini.value("RETRY_SECTION/upstream_ack_timeout_msec",
+                                       (qint64)DEFAULT_ACK_TIMEOUT).toLongLong();
+    __ackCheckInterval     = ini.value("RETRY_SECTION/ack_check_interval_msec",
+                                       (qint64)DEFAULT_ACK_CHECK_INTERVAL).toLongLong();
+    if (__downstreamAckTimeout <= 0 || __upstreamAckTimeout <= 0 || __ackCheckInterval <= 0)
+    {
+        std::cout << "ERROR: Invalid config parameter 'RETRY_SECTION/*_ack_timeout_msec' or "
+                  << "'RETRY_SECTION/ack_check_interval_msec'. Exiting..." << std::endl;
+        exit(0);
+    }
+
     // TODO support more than one.
     // BAL session SECTION
     QString balclient = ini.value("BAL_SECTION/session_id", "NULL").toString();
@@ -198,6 +580,68 @@ void Application::setupOsSignalCatcher()
 }
 
 
+/*!
+ * \brief Application::shutdown
+ * Closes every FCM connection in parallel, each on its own thread, and quits
+ * once all of them are closed. Every connection gives up on FCM after
+ * 'shutdown_timeout_msec', so this takes about that long at most however
+ * many connections are open. A second signal quits right away.
+ */
+void Application::shutdown()
+{
+    if (__shutdownInProgress)
+    {
+        std::cout << "Shutdown already in progress. Exiting now." << std::endl;
+        finishShutdown();
+        return;
+    }
+    __shutdownInProgress = true;
+    std::cout << "Shutting down [" << __fcmConnectionsMap.size()
+              << "] FCM connections..." << std::endl;
+
+    // nothing new goes out from here on.
+    for (auto&& it: __fcmConnectionProjects)
+        it.second->getDispatcher().setAuthenticated(it.first, false);
+
+    // stanzas parsed but not handled yet may still owe FCM an ack. The acks
+    // are queued on their connection ahead of the stream end.
+    std::vector<int> ids;
+    for (auto&& it: __fcmConnectionsMap)
+        ids.push_back(it.first);
+    for (int id: ids)
+        handleFcmEvents(id);
+
+    for (auto&& it: __fcmConnectionsMap)
+    {
+        __fcmShutdownPending.insert(it.first);
+        QMetaObject::invokeMethod(it.second.get(), "shutdown", Qt::QueuedConnection,
+                                  Q_ARG(qint64, __fcmShutdownTimeout));
+    }
+
+    // only matters if a connection thread stops responding.
+    __shutdownTimer = __timerService.schedule(__fcmShutdownTimeout + SHUTDOWN_GRACE_MSEC, [this]{
+        __shutdownTimer = INVALID_TIMER_HANDLE;
+        std::cout << "[" << __fcmShutdownPending.size()
+                  << "] FCM connections didn't shutdown in time." << std::endl;
+        finishShutdown();
+    });
+
+    if (__fcmShutdownPending.empty())
+        finishShutdown();
+}
+
+
+/*!
+ * \brief Application::finishShutdown
+ */
+void Application::finishShutdown()
+{
+    __timerService.cancel(__shutdownTimer);
+    std::cout << "GOODBYE!" << std::endl;
+    QCoreApplication::quit();
+}
+
+
 /*!
  * \brief Application::setupTcpServer
  */
@@ -232,19 +676,91 @@ void Application::setupFcmHandle(FcmConnectionPtr_t fcmConnPtr)
     connect(&fcmConn, SIGNAL(connectionShutdownCompleted(int)),         this, SLOT(handleFcmConnectionShutdownCompleted(int)));
     connect(&fcmConn, SIGNAL(connectionLost(int)),                      this, SLOT(handleFcmConnectionLost(int)));
     connect(&fcmConn, SIGNAL(connectionDrainingStarted(int)),           this, SLOT(handleFcmConnectionDrainingStarted(int)));
+    connect(&fcmConn, SIGNAL(connectionDrainingCompleted(int)),         this, SLOT(handleFcmConnectionDrainingCompleted(int)));
     connect(&fcmConn, SIGNAL(xmppHandshakeStarted(int)),                this, SLOT(handleFcmXmppHandshakeStarted(int)));
     connect(&fcmConn, SIGNAL(sessionEstablished(int)),                  this, SLOT(handleFcmSessionEstablished(int)));
     connect(&fcmConn, SIGNAL(streamClosed(int)),                        this, SLOT(handleFcmStreamClosed(int)));
     connect(&fcmConn, SIGNAL(heartbeatRecieved(int)),                   this, SLOT(handleFcmHeartbeatRecieved(int)));
     connect(&fcmConn, SIGNAL(connectionError(int, const QString&)),     this, SLOT(handleFcmConnectionError(int, const QString&)));
-    connect(&fcmConn, SIGNAL(newMessage(int, const QJsonDocument&)),    this, SLOT(handleFcmNewUpstreamMessage(int, const QJsonDocument&)));
-    connect(&fcmConn, SIGNAL(newAckMessage(int, const QJsonDocument&)), this, SLOT(handleFcmAckMessage(int, const QJsonDocument&)));
-    connect(&fcmConn, SIGNAL(newNackMessage(int, const QJsonDocument&)),this, SLOT(handleFcmNackMessage(int, const QJsonDocument&)));
-    connect(&fcmConn, SIGNAL(newReceiptMessage(int, const QJsonDocument&)),this, SLOT(handleFcmReceiptMessage(int, const QJsonDocument&)));
+    connect(&fcmConn, SIGNAL(eventsReady(int)),                         this, SLOT(handleFcmEvents(int)));
+    connect(&fcmConn, SIGNAL(outputBlocked(int)),                       this, SLOT(handleFcmOutputBlocked(int)));
+    connect(&fcmConn, SIGNAL(outputDrained(int)),                       this, SLOT(handleFcmOutputDrained(int)));
+    connect(&fcmConn, SIGNAL(sendFailed(int, const QString&)),          this, SLOT(handleFcmSendFailed(int, const QString&)));
+}
+
+
+/*!
+ * \brief Application::handleFcmEvents
+ * Drains the stanzas parsed by connection 'id' since the last wake up.
+ * \param id
+ */
+void Application::handleFcmEvents(int id)
+{
+    auto it = __fcmConnectionsMap.find(id);
+    if (it == __fcmConnectionsMap.end())
+        return;
+
+    std::vector<FcmEvent> events;
+    it->second->takeEvents(events);
 
+    // one db transaction (one fsync) per batch; upstream acks wait for it.
+    bool batched = true;
+    try
+    {
+        __dbConn.beginTransaction();
+    }
+    catch (std::exception& err)
+    {
+        PRINT_EXCEPTION_STRING(std::cout, err);
+        batched = false;
+    }
 
-    //setup queued connection to fcm connection handle for sending downstream message to FCM.
-    connect(this, SIGNAL(sendMessage(const QJsonDocument&)),&fcmConn, SLOT(handleSendMessage(const QJsonDocument&)));
+    // only the db writes happen inside the transaction; whatever the BAL or
+    // the in-memory queues see of the batch waits for it. See afterFcmCommit.
+    __fcmBatchOpen = batched;
+    for (auto&& event: events)
+    {
+        switch (event.envelope.type)
+        {
+            case FcmMessageType::UPSTREAM:
+                handleFcmNewUpstreamMessage(id, event.data);
+                break;
+            case FcmMessageType::ACK:
+                handleFcmAckMessage(id, event.envelope, event.data);
+                break;
+            case FcmMessageType::NACK:
+            {
+                // retry, window and limiter state go with the writes they
+                // make, so the whole nack is handled once the batch is stored.
+                FcmEnvelope nack = event.envelope;
+                afterFcmCommit([this, id, nack]{ handleFcmNackMessage(id, nack); });
+                break;
+            }
+            case FcmMessageType::RECEIPT:
+                handleFcmReceiptMessage(id, event.data);
+                break;
+            default:
+                break;
+        }
+    }
+    __fcmBatchOpen = false;
+
+    if (batched)
+    {
+        try
+        {
+            __dbConn.commitTransaction();
+        }
+        catch (std::exception& err)
+        {
+            PRINT_EXCEPTION_STRING(std::cout, err);
+            __dbConn.rollbackTransaction();
+            discardFcmAckMessages();
+            return;
+        }
+    }
+    flushFcmAckMessages();
+    runFcmBatchActions();
 }
 
 
@@ -312,10 +828,34 @@ void Application::handleFcmSessionEstablished(int id)
     std::cout << FCM_TAG_RX(id) << "Session authenticated sucessfully.." << std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------\n";
     std::cout << "-     SESSION WITH FCM ESTABLISHED SUCCESSFULLY        -" << std::endl;
-    std::cout << "-     SESSION ID: " << __fcmServerId.toStdString() <<"\n";
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
+    std::cout << "-     PROJECT: " << project->getName() << "\n";
+    std::cout << "-     SESSION ID: " << project->getServerId().toStdString() <<"\n";
     std::cout << "----------------------------------------------------------------------------------------------------" << std::endl;
+    auto it = __fcmConnectionsMap.find(id);
+    if (it != __fcmConnectionsMap.end())
+    {
+        const FcmConnectionStats& stats = it->second->getStats();
+        std::cout << FCM_TAG_RX(id) << "Handshake took [" << stats.lastHandshakeMsec
+                  << "] msec, tls [" << stats.lastTlsMsec << "] msec, "
+                  << FcmConnection::tlsProtocolName(stats.lastTlsProtocol)
+                  << (stats.lastTlsTicketOffered ? ", session ticket offered." : ", no session ticket.")
+                  << std::endl;
+    }
 
-    resendAllPendingDownstreamMessages();
+    FcmDispatcher& dispatcher = project->getDispatcher();
+    dispatcher.setAuthenticated(id, true);
+    dispatcher.setStandby(id, false);
+    // enough connections carry traffic already; keep this one warm.
+    if ((int)dispatcher.countActive() > project->getPoolSize())
+    {
+        dispatcher.setStandby(id, true);
+        std::cout << FCM_TAG_RX(id) << "Connection kept as standby." << std::endl;
+        return;
+    }
+    resendAllPendingDownstreamMessages(*project);
 }
 
 /*!
@@ -324,6 +864,149 @@ void Application::handleFcmSessionEstablished(int id)
 void Application::handleFcmConnectionLost(int id)
 {
     std::cout << FCM_TAG_RX(id) << "Disconnected to FCM server.\n" << std::endl;
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
+    std::vector<MessagePtr_t> lost;
+    releaseFcmConnection(*project, id, lost);
+    // the lost connection reconnects on its own and comes back as a standby.
+    promoteFcmStandby(*project);
+    requeueFcmMessages(*project, lost);
+}
+
+
+/*!
+ * \brief Application::scheduleFcmStatsDump
+ * 0 or less for 'FCM_SECTION/stats_interval_msec' turns the dump off.
+ */
+void Application::scheduleFcmStatsDump()
+{
+    if (__fcmStatsInterval <= 0)
+        return;
+
+    __timerService.cancel(__fcmStatsTimer);
+    __fcmStatsTimer = __timerService.schedule(__fcmStatsInterval, [this]{
+        __fcmStatsTimer = INVALID_TIMER_HANDLE;
+        printFcmStats();
+        scheduleFcmStatsDump();
+    });
+}
+
+
+/*!
+ * \brief Application::printFcmStats
+ */
+void Application::printFcmStats()
+{
+    std::cout << "FCM connection stats:" << std::endl;
+    for (auto&& i: __fcmConnectionsMap)
+    {
+        const FcmConnectionStats& stats = i.second->getStats();
+        FcmProjectPtr_t project = findFcmProject(i.first);
+        const FcmLink* link = project ? project->getDispatcher().findLink(i.first) : nullptr;
+        std::cout << "\t" << FCM_TAG_TX(i.first)
+                  << "project[" << (project ? project->getName() : "")
+                  << "], stanzas tx[" << stats.stanzasSent
+                  << "], rx[" << stats.stanzasReceived
+                  << "], bytes tx[" << stats.bytesSent
+                  << "], rx[" << stats.bytesReceived
+                  << "], pending output[" << stats.pendingOutput
+                  << "], peak pending output[" << stats.peakPendingOutput
+                  << "], blocked[" << stats.outputBlocked
+                  << "], handshakes[" << stats.handshakes
+                  << "], last handshake msec[" << stats.lastHandshakeMsec
+                  << "], last tls msec[" << stats.lastTlsMsec
+                  << "], tls tickets offered[" << stats.tlsTicketsOffered
+                  << "], pings[" << stats.pingsSent
+                  << "], max rx gap msec[" << stats.maxRxGapMsec
+                  << "], liveness timeouts[" << stats.livenessTimeouts
+                  << "], rx buffer[" << stats.rxBufferCapacity
+                  << "], peak rx buffered[" << stats.peakRxBuffered
+                  << "], in flight[" << (link ? link->inFlight : 0)
+                  << "], window[" << (link ? link->window : 0)
+                  << "], ack rtt msec[" << (link ? link->ackRttMsec : 0)
+                  << "], min ack rtt msec[" << (link ? link->congestion.getMinRtt() : 0)
+                  << "], throttled[" << (link ? link->throttled : 0)
+                  << "], window backoffs[" << (link ? link->congestion.getBackoffs() : 0)
+                  << "], usable[" << (link && link->usable())
+                  << "], standby[" << (link && link->standby) << "]" << std::endl;
+    }
+    for (auto&& i: __fcmProjects)
+    {
+        FcmProject& project = *i.second;
+        RecipientRateLimiter& limiter = project.getRateLimiter();
+        std::cout << "\tProject[" << i.first
+                  << "]: queued[" << project.getMessageManager().getMessages().size()
+                  << "], pending ack[" << project.getMessageManager().getPendingAckCount()
+                  << "], free slots[" << project.getDispatcher().getFreeSlots()
+                  << "]" << std::endl;
+        std::cout << "\t\tSend rate: per sec[" << project.getSendRatePerSec()
+                  << "], tokens[" << project.getSendRate().getTokens(__timerService.now())
+                  << "], waits[" << project.getSendRateWaits() << "]" << std::endl;
+        std::cout << "\t\tRecipient rate limits: limited[" << limiter.size()
+                  << "], rate exceeded nacks[" << limiter.getRateExceeded()
+                  << "], evicted[" << limiter.getEvictions() << "]" << std::endl;
+    }
+    std::cout << "\tUpstream dedup: ids[" << __upstreamDedup.size()
+              << "], duplicates[" << __upstreamDedup.getDuplicates()
+              << "], evicted[" << __upstreamDedup.getEvictions() << "]" << std::endl;
+    if (__fcmTlsSessionCache)
+    {
+        std::cout << "\tTLS session cache: stored[" << __fcmTlsSessionCache->getStores()
+                  << "], hits[" << __fcmTlsSessionCache->getHits()
+                  << "], misses[" << __fcmTlsSessionCache->getMisses() << "]" << std::endl;
+    }
+}
+
+
+/*!
+ * \brief Application::releaseFcmConnection
+ * Takes connection 'id' out of dispatch. Whatever was in flight on it won't
+ * be acked anymore; it gives its window slot back and is queued as NEW again.
+ * Messages in flight on the other connections are left alone.
+ * \param project the project 'id' belongs to.
+ * \param id
+ * \param lost the messages that were in flight on 'id', in sequence order.
+ */
+void Application::releaseFcmConnection(FcmProject& project, int id, std::vector<MessagePtr_t>& lost)
+{
+    FcmDispatcher& dispatcher = project.getDispatcher();
+    dispatcher.setAuthenticated(id, false);
+    dispatcher.setBlocked(id, false);
+    dispatcher.resetInFlight(id);
+
+    MessageManager& msgmanager = project.getMessageManager();
+    msgmanager.takeConnectionMessages(id, lost);
+    for (auto&& msg: lost)
+    {
+        // the db keeps PENDING_ACK; on a restart those are resent anyway.
+        if (msg->getState() == MessageState::PENDING_ACK)
+            msgmanager.reclaimPendingAck(msg);
+    }
+    if (!lost.empty())
+        std::cout << FCM_TAG_RX(id) << "Requeued [" << lost.size()
+                  << "] messages that were in flight." << std::endl;
+}
+
+
+/*!
+ * \brief Application::requeueFcmMessages
+ * Sends the in flight set of a lost connection on the remaining ones of its
+ * project, oldest first. What doesn't fit goes out as acks free up slots.
+ * \param project
+ * \param msgs
+ */
+void Application::requeueFcmMessages(FcmProject& project, std::vector<MessagePtr_t>& msgs)
+{
+    for (auto&& msg: msgs)
+    {
+        if (project.getDispatcher().getFreeSlots() == 0)
+            break;
+        // already sent again e.g by a promoted standby.
+        if (msg->getState() != MessageState::NEW)
+            continue;
+        dispatchDownstreamMessage(project, msg);
+    }
 }
 
 
@@ -342,6 +1025,9 @@ void Application::handleFcmConnectionShutdownStarted(int id)
 void Application::handleFcmConnectionShutdownCompleted(int id)
 {
     std::cout << FCM_TAG_RX(id) << "Connection to FCM shutdown successfully." << std::endl;
+    __fcmShutdownPending.erase(id);
+    if (__shutdownInProgress && __fcmShutdownPending.empty())
+        finishShutdown();
 }
 
 
@@ -352,16 +1038,157 @@ void Application::handleFcmConnectionShutdownCompleted(int id)
 void Application::handleFcmConnectionDrainingStarted(int id)
 {
     std::cout << FCM_TAG_RX(id) << "Connection draining started..." << std::endl;
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
 
-    // disconnect 'sendMessage()' connection to old fcm handle.
-    auto lastFcmHandleIter = __fcmConnectionsMap.rbegin();
-    FcmConnection& lastFcmHandle = *(lastFcmHandleIter->second);
-    disconnect(this, 0, &lastFcmHandle, 0);
+    // no new messages for the draining handle. It still acks the upstream
+    // messages that arrive on it until FCM closes it.
+    project->getDispatcher().setDraining(id, true);
+    promoteFcmStandby(*project);
 
-    std::cout << "Creating a new connection to FCM..." << std::endl;
-    FcmConnectionPtr_t fcmConn = createFcmHandle();
-    setupFcmHandle(fcmConn);
-    fcmConn->connectToFcm(__fcmServerId, __fcmServerKey, __fcmHostAddress, __fcmPortNo);
+    if (__shutdownInProgress)
+        return;
+
+    // replaces the draining one; it becomes the new standby (or takes
+    // traffic if there was no standby to promote).
+    std::cout << "Creating a new connection to FCM for project["
+              << project->getName() << "]..." << std::endl;
+    openFcmConnection(project);
+}
+
+
+/*!
+ * \brief Application::promoteFcmStandby
+ * Tops the active connections of 'project' back up to its 'pool_size' from
+ * its standbys. A standby is already authenticated so it takes traffic right
+ * away.
+ * \param project
+ */
+void Application::promoteFcmStandby(FcmProject& project)
+{
+    FcmDispatcher& dispatcher = project.getDispatcher();
+    bool promoted = false;
+    while ((int)dispatcher.countActive() < project.getPoolSize())
+    {
+        int id = dispatcher.findStandby();
+        if (id == NO_FCM_CONNECTION)
+        {
+            std::cout << "No standby FCM connection left to promote for project["
+                      << project.getName() << "]." << std::endl;
+            break;
+        }
+        dispatcher.setStandby(id, false);
+        std::cout << FCM_TAG_TX(id) << "Standby connection promoted." << std::endl;
+        promoted = true;
+    }
+
+    if (promoted)
+        resendAllPendingDownstreamMessages(project);
+}
+
+
+/*!
+ * \brief Application::handleFcmConnectionDrainingCompleted
+ * FCM closed the drained connection; drop it from the pool.
+ * \param id
+ */
+void Application::handleFcmConnectionDrainingCompleted(int id)
+{
+    std::cout << FCM_TAG_RX(id) << "Connection draining completed." << std::endl;
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
+    std::vector<MessagePtr_t> lost;
+    releaseFcmConnection(*project, id, lost);
+    project->getDispatcher().removeLink(id);
+    // not from inside the handle's own signal.
+    __timerService.schedule(0, [this, id]{
+        __fcmConnectionsMap.erase(id);
+        __fcmConnectionProjects.erase(id);
+    });
+    requeueFcmMessages(*project, lost);
+}
+
+
+/*!
+ * \brief Application::handleFcmOutputBlocked
+ * The socket of connection 'id' can't keep up; stop releasing messages to it.
+ * What is already in flight on it stays there.
+ * \param id
+ */
+void Application::handleFcmOutputBlocked(int id)
+{
+    std::cout << FCM_TAG_TX(id) << "Output above high watermark. Pausing connection." << std::endl;
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (project)
+        project->getDispatcher().setBlocked(id, true);
+}
+
+
+/*!
+ * \brief Application::handleFcmOutputDrained
+ * Only the slots of connection 'id' opened up, so at most that many queued
+ * messages are released; the rest of the queue is left alone.
+ * \param id
+ */
+void Application::handleFcmOutputDrained(int id)
+{
+    std::cout << FCM_TAG_TX(id) << "Output below low watermark. Resuming connection." << std::endl;
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
+    FcmDispatcher& dispatcher = project->getDispatcher();
+    dispatcher.setBlocked(id, false);
+    if (!dispatcher.isUsable(id))
+        return;
+
+    MessageManager& msgmanager = project->getMessageManager();
+    std::int64_t free_slots = dispatcher.findLink(id)->freeSlots();
+    for (std::int64_t i = 0; i < free_slots; i++)
+    {
+        std::uint64_t pending = msgmanager.getPendingAckCount();
+        sendNextPendingDownstreamMessage(*project);
+        // queue empty, or what is left has to wait.
+        if (msgmanager.getPendingAckCount() == pending)
+            break;
+    }
+}
+
+
+/*!
+ * \brief Application::handleFcmSendFailed
+ * Connection 'id' lost its session before it could write the downstream
+ * message 'message_id'. The message gives its slot back and is queued as NEW
+ * again instead of waiting for its ack timeout.
+ * \param id
+ * \param message_id
+ */
+void Application::handleFcmSendFailed(int id, const QString& message_id)
+{
+    FcmProjectPtr_t project = findFcmProject(id);
+    if (!project)
+        return;
+
+    try
+    {
+        MessageManager& msgmanager = project->getMessageManager();
+        MessagePtr_t msg = msgmanager.findMessageWithFcmMsgId(message_id.toStdString());
+        // requeued with its connection already, or sent again since.
+        if (msg->getState() != MessageState::PENDING_ACK || msg->getConnectionId() != id)
+            return;
+
+        std::cout << FCM_TAG_TX(id) << "Message with id[" << msg->getMessageIdentifier()
+                  << "] was not sent. Queueing it again." << std::endl;
+        msgmanager.reclaimPendingAck(msg);
+        releaseFcmSlot(*project, msg);
+        __dbConn.updateMsgState(*msg, MessageState::NEW);
+        dispatchDownstreamMessage(*project, msg);
+    }
+    catch (std::exception& err)
+    {
+        PRINT_EXCEPTION_STRING(std::cout, err);
+    }
 }
 
 
@@ -383,6 +1210,13 @@ void Application::handleFcmNewUpstreamMessage(
     std::cout << "-----------------------------------Start handleFcmNewUpstreamMessage-----------------------------------------" << std::endl;
     try
     {
+        FcmProjectPtr_t project = findFcmProject(id);
+        if (!project)
+        {
+            std::stringstream err;
+            err << "No project for fcm connection[" << id << "]";
+            THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+        }
         std::string from = client_msg.object().value(fcmfieldnames::FROM).toString().toStdString();
         std::string sessionid = client_msg.object().value(fcmfieldnames::CATEGORY).toString().toStdString();
         std::string fcm_mid = client_msg.object().value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
@@ -390,36 +1224,51 @@ void Application::handleFcmNewUpstreamMessage(
         std::cout << "Recieved 'upstream' message with msg id [" << fcm_mid<< "] from:" << from << std::endl;
         std::cout << "Target session id: " << sessionid  << std::endl;
 
-        SequenceId_t nextseqid = __dbConn.getNextSequenceId();
-
-        // create gimmm message.
-        QJsonDocument gimmm_msg;
-        QJsonObject root;
-        root[gimmmfieldnames::SEQUENCE_ID] = (qint64)nextseqid;
-        root[gimmmfieldnames::MESSAGE_TYPE] = "UPSTREAM",
-        root[gimmmfieldnames::SESSION_ID]   =  sessionid.c_str();
-        root[gimmmfieldnames::FCM_DATA] = client_msg.object();
-        gimmm_msg.setObject(root);
-        PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
-
-        Message* msgp = new Message( nextseqid,
-                                     MessageType::UPSTREAM,
-                                     fcm_mid,
-                                     "",
-                                     "fcm",
-                                     sessionid,
-                                     pmsg);
-
-        MessagePtr_t msgptr(msgp);
-
-        std::cout << "New Message created:" << std::endl;
-        std::cout << *msgptr << std::endl;
-
-        __dbConn.saveMsg(*msgptr);
-        // Save successfull, send ack back to FCM.
-        sendFcmAckMessage(client_msg);
-        // Lets forward msg to the bal message.
-        forwardMsgToBalsession(sessionid, msgptr);
+        // a redelivery; it was saved and forwarded the first time around.
+        std::string dedup_key = DedupIndex::upstreamKey(project->getMessageManager().getSessionId(),
+                                                        from, fcm_mid);
+        if (__upstreamDedup.isDuplicate(dedup_key, __timerService.now()))
+        {
+            std::cout << "Duplicate 'upstream' message with msg id [" << fcm_mid
+                      << "]. Acking it again." << std::endl;
+            queueFcmAckMessage(id, client_msg);
+        }
+        else
+        {
+            SequenceId_t nextseqid = __dbConn.getNextSequenceId();
+
+            // create gimmm message.
+            QJsonDocument gimmm_msg;
+            QJsonObject root;
+            root[gimmmfieldnames::SEQUENCE_ID] = (qint64)nextseqid;
+            root[gimmmfieldnames::MESSAGE_TYPE] = "UPSTREAM",
+            root[gimmmfieldnames::SESSION_ID]   =  sessionid.c_str();
+            root[gimmmfieldnames::PROJECT]      = project->getName().c_str();
+            root[gimmmfieldnames::FCM_DATA] = client_msg.object();
+            gimmm_msg.setObject(root);
+            PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
+
+            Message* msgp = new Message( nextseqid,
+                                         MessageType::UPSTREAM,
+                                         fcm_mid,
+                                         "",
+                                         project->getMessageManager().getSessionId(),
+                                         sessionid,
+                                         pmsg);
+
+            MessagePtr_t msgptr(msgp);
+
+            std::cout << "New Message created:" << std::endl;
+            std::cout << *msgptr << std::endl;
+
+            __dbConn.saveMsg(*msgptr);
+            __upstreamDedup.insert(dedup_key, __timerService.now());
+            __fcmAckBatchIds.push_back(dedup_key);
+            // Save successfull, ack back to FCM on the connection it came in on.
+            queueFcmAckMessage(id, client_msg);
+            // Lets forward msg to the bal message.
+            afterFcmCommit([this, sessionid, msgptr]{ forwardMsgToBalsession(sessionid, msgptr); });
+        }
     }
     catch (std::exception& err)
     {
@@ -439,26 +1288,31 @@ void Application::handleFcmNewUpstreamMessage(
  *        it to our 'target' until the 'ttl' hasn't expired.If for some reason, the message
  *        couldn't be deivered e.g the device was offline, upon reconnect it will recieve a
  *        '<TODO>' message from FCM. The device should then do a full sync with the BAL.
- * \param ack_msg
+ * \param ack_msg   routing fields of 'json'.
+ * \param json      the ack as FCM sent it; forwarded to the BAL unchanged.
  */
-void Application::handleFcmAckMessage(int id, const QJsonDocument& ack_msg)
+void Application::handleFcmAckMessage(int id, const FcmEnvelope& ack_msg, const QJsonDocument& json)
 {
     std::cout << "-----------------------------------Start handleFcmAckMessage -----------------------------------------" << std::endl;
-    PRINT_JSON_DOC_RAW(std::cout, ack_msg);
 
-    std::string mid = ack_msg.object().value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
+    const std::string& mid = ack_msg.messageId;
     std::cout << FCM_TAG_RX(id) << "Received downstream 'ack' from FCM for message id:" << mid << std::endl;
 
     try
     {
-        MessagePtr_t msg = __fcmMsgManager.findMessageWithFcmMsgId(mid);
+        FcmProjectPtr_t project = findFcmProject(id);
+        if (!project)
+        {
+            std::stringstream err;
+            err << "No project for fcm connection[" << id << "]";
+            THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+        }
+        MessageManager& msgmanager = project->getMessageManager();
+        MessagePtr_t msg = msgmanager.findMessageWithFcmMsgId(mid);
         SessionId_t sessid = msg->getSourceSessionId();
+        std::int64_t rtt = __timerService.now() - msg->getSentAt();
 
         __dbConn.updateMsgState(*msg, MessageState::DELIVERED);
-        __fcmMsgManager.removeMessageWithFcmMsgId(mid);
-
-        // a slot just opened up, lets send another msg from the 'pending msg queue' to fcm
-        sendNextPendingDownstreamMessage(__fcmMsgManager);
 
         //fwd to BAL
         std::cout << "Forwarding downstream Ack msg to sessionid:" << sessid << std::endl;
@@ -470,23 +1324,35 @@ void Application::handleFcmAckMessage(int id, const QJsonDocument& ack_msg)
         root[gimmmfieldnames::SEQUENCE_ID]  = (qint64)newseqid;
         root[gimmmfieldnames::MESSAGE_TYPE] = "DOWNSTREAM_ACK",
         root[gimmmfieldnames::SESSION_ID]   = sessid.c_str();
-        root[gimmmfieldnames::FCM_DATA]     = ack_msg.object();
+        root[gimmmfieldnames::PROJECT]      = project->getName().c_str();
+        root[gimmmfieldnames::FCM_DATA]     = json.object();
         gimmm_msg.setObject(root);
 
         PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
 
-        std::string fcm_mid = ack_msg.object().value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
         MessagePtr_t balack( new Message(
                                   newseqid,
                                   MessageType::DOWNSTREAM_ACK,
-                                  fcm_mid,
+                                  mid,
                                   "",
-                                  "fcm",
+                                  msgmanager.getSessionId(),
                                   sessid,
                                   pmsg));
 
         __dbConn.saveMsg(*balack);
-        forwardMsgToBalsession(sessid, balack);
+
+        // the message stays pending until the DELIVERED state is stored.
+        FcmProject* p = project.get();
+        afterFcmCommit([this, p, msg, mid, rtt, sessid, balack]
+        {
+            releaseFcmSlot(*p, msg, rtt);
+            p->getRateLimiter().onDelivered(msg->getTo());
+            p->getMessageManager().removeMessageWithFcmMsgId(mid);
+
+            // a slot just opened up, lets send another msg from the 'pending msg queue' to fcm
+            sendNextPendingDownstreamMessage(*p);
+            forwardMsgToBalsession(sessid, balack);
+        });
     }
     catch (std::exception& err)
     {
@@ -504,37 +1370,59 @@ void Application::handleFcmAckMessage(int id, const QJsonDocument& ack_msg)
  * \brief Application::handleNackMessage
  * \param nack_msg
  */
-void Application::handleFcmNackMessage(int id, const QJsonDocument& nack_msg)
+void Application::handleFcmNackMessage(int id, const FcmEnvelope& nack_msg)
 {
     std::cout << "-----------------------------------Start Handle Nack Message----------------------------------------" << std::endl;
-    PRINT_JSON_DOC_RAW(std::cout, nack_msg);
 
-    std::string msg_id = nack_msg.object().value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
-    std::string error  = nack_msg.object().value(fcmfieldnames::ERROR).toString().toStdString();
-    std::string error_desc = nack_msg.object().value(fcmfieldnames::ERROR_DESC).toString().toStdString();
+    const std::string& msg_id     = nack_msg.messageId;
+    const std::string& error      = nack_msg.error;
+    const std::string& error_desc = nack_msg.errorDescription;
     std::cout << FCM_TAG_RX(id) << "Received 'nack' for message id:"<< msg_id
               << ", error:" << error
               << ", error description:" << error_desc << std::endl;
 
     try
     {
-        MessagePtr_t origmsg = __fcmMsgManager.findMessageWithFcmMsgId(msg_id);
+        FcmProjectPtr_t project = findFcmProject(id);
+        if (!project)
+        {
+            std::stringstream err;
+            err << "No project for fcm connection[" << id << "]";
+            THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+        }
+        MessagePtr_t origmsg = project->getMessageManager().findMessageWithFcmMsgId(msg_id);
+        std::int64_t rtt = __timerService.now() - origmsg->getSentAt();
+        // the *_RATE_EXCEEDED ones are about one device/topic, not the connection.
+        if ( error == "SERVICE_UNAVAILABLE" ||
+             error == "INTERNAL_SERVER_ERROR")
+        {
+            project->getDispatcher().onThrottled(origmsg->getConnectionId());
+            // no rtt sample; it would grow the window that was just cut.
+            rtt = -1;
+        }
+        else if ( error == "DEVICE_MESSAGE_RATE_EXCEEDED" ||
+                  error == "TOPICS_MESSAGE_RATE_EXCEEDED")
+        {
+            // the retry and whatever else is queued for it wait for the limit.
+            project->getRateLimiter().onRateExceeded(origmsg->getTo(), __timerService.now());
+        }
+        releaseFcmSlot(*project, origmsg, rtt);
         if ( error == "SERVICE_UNAVAILABLE" ||
              error == "INTERNAL_SERVER_ERROR" ||
              error == "DEVICE_MESSAGE_RATE_EXCEEDED" ||
              error == "TOPICS_MESSAGE_RATE_EXCEEDED" ||
              error == "CONNECTION_DRAINING")
          {
-            retryDownstreamWithExponentialBackoff(origmsg);
+            retryDownstreamWithExponentialBackoff(*project, origmsg);
          }else
          {
             __dbConn.updateMsgState(*origmsg, MessageState::DELIVERY_FAILED);
-            __fcmMsgManager.removeMessageWithFcmMsgId(msg_id);
+            project->getMessageManager().removeMessageWithFcmMsgId(msg_id);
             // new slot opened.send another pending message.
-            sendNextPendingDownstreamMessage(__fcmMsgManager);
+            sendNextPendingDownstreamMessage(*project);
 
             // notify bal of delivery failure
-            notifyDownstreamUploadFailure(origmsg);
+            notifyDownstreamUploadFailure(*project, origmsg, error + ": " + error_desc);
          }
     }
     catch(std::exception& err)
@@ -569,6 +1457,13 @@ void Application::handleFcmReceiptMessage(int id, const QJsonDocument& recpt_msg
 
     try
     {
+        FcmProjectPtr_t project = findFcmProject(id);
+        if (!project)
+        {
+            std::stringstream err;
+            err << "No project for fcm connection[" << id << "]";
+            THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+        }
         SequenceId_t nextseqid = __dbConn.getNextSequenceId();
 
         // create gimmm message.
@@ -577,6 +1472,7 @@ void Application::handleFcmReceiptMessage(int id, const QJsonDocument& recpt_msg
         root[gimmmfieldnames::SEQUENCE_ID] = (qint64)nextseqid;
         root[gimmmfieldnames::MESSAGE_TYPE] = "DOWNSTREAM_RECEIPT",
         root[gimmmfieldnames::SESSION_ID]   =  sessionid.c_str();
+        root[gimmmfieldnames::PROJECT]      = project->getName().c_str();
         root[gimmmfieldnames::FCM_DATA] = recpt_msg.object();
         gimmm_msg.setObject(root);
         PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
@@ -585,7 +1481,7 @@ void Application::handleFcmReceiptMessage(int id, const QJsonDocument& recpt_msg
         msgptr->setSequenceId(nextseqid);
         msgptr->setType(MessageType::DOWNSTREAM_RECEIPT);
         msgptr->setFcmMessageId(fcm_mid);
-        msgptr->setSourceSessionId("fcm");
+        msgptr->setSourceSessionId(project->getMessageManager().getSessionId());
         msgptr->setTargetSessionId(sessionid);
         msgptr->setPayload(pmsg);
         msgptr->setState(MessageState::NEW);
@@ -594,7 +1490,7 @@ void Application::handleFcmReceiptMessage(int id, const QJsonDocument& recpt_msg
         std::cout << *msgptr << std::endl;
 
         __dbConn.saveMsg(*msgptr);
-        forwardMsgToBalsession(sessionid, msgptr);
+        afterFcmCommit([this, sessionid, msgptr]{ forwardMsgToBalsession(sessionid, msgptr); });
     }
     catch (std::exception& err)
     {
@@ -611,16 +1507,31 @@ void Application::handleFcmReceiptMessage(int id, const QJsonDocument& recpt_msg
 
 /*!
  * \brief Application::sendNextPendingDownstreamMessage
- * \param msgmanager
+ * \param project
  */
-void Application::sendNextPendingDownstreamMessage(const MessageManager& msgmanager)
+void Application::sendNextPendingDownstreamMessage(FcmProject& project)
 {
+    MessageManager& msgmanager = project.getMessageManager();
     MessagePtr_t nextmsg = msgmanager.getNext();
+    // expired ones don't get the slot, nor do held ones.
+    while ( nextmsg)
+    {
+        if (nextmsg->isExpired(QDateTime::currentMSecsSinceEpoch()))
+        {
+            dropExpiredDownstreamMessages(project, std::vector<MessagePtr_t>(1, nextmsg));
+        }
+        else
+        {
+            std::cout << "Sending next downstream message with id["
+                      << nextmsg->getMessageIdentifier() << "] from pending queue." << std::endl;
+            dispatchDownstreamMessage(project, nextmsg);
+            if (!nextmsg->getHeld())
+                break;
+        }
+        nextmsg = msgmanager.getNext();
+    }
     if ( nextmsg)
     {
-        std::cout << "Sending next downstream message with id["
-                  << nextmsg->getMessageIdentifier() << "] from pending queue." << std::endl;
-        uploadToFcm(nextmsg);
         // print warning as necessary.
         if (msgmanager.isMessagePending())
         {
@@ -636,19 +1547,14 @@ void Application::sendNextPendingDownstreamMessage(const MessageManager& msgmana
  * \brief Application::sendNextPendingUpstreamMessage
  * \param msgmanager
  */
-void Application::sendNextPendingUpstreamMessage(const MessageManager& msgmanager)
+void Application::sendNextPendingUpstreamMessage(MessageManager& msgmanager)
 {
     MessagePtr_t nextmsg = msgmanager.getNext();
     if ( nextmsg)
     {
         std::cout << "Sending upstream message with id ["
                   << nextmsg->getMessageIdentifier() << "] from pending queue." << std::endl;
-        const QJsonDocument& jdoc = *(nextmsg->getPayload());
-
-        SessionId_t sessid = nextmsg->getTargetSessionId();
-        BALSessionPtr_t sess = findBalSession(sessid);
-
-        sess->writeMessage(jdoc);
+        dispatchUpstreamMessage(msgmanager, nextmsg);
 
         // print warning as necessary.
         if (msgmanager.isMessagePending())
@@ -694,16 +1600,30 @@ void Application::forwardMsgToBalsession(
 
     MessageManager& msgmanager = findBalMessageManager(session_id);
     msgmanager.addMessage(msg->getSequenceId(), msg);
+    dispatchUpstreamMessage(msgmanager, msg);
+}
+
+
+/*!
+ * \brief Application::dispatchUpstreamMessage
+ * Forwards 'msg' to its BAL session if the session window allows it. Otherwise
+ * it stays queued and goes out when a slot opens up.
+ * \param msgmanager
+ * \param msg
+ */
+void Application::dispatchUpstreamMessage(
+        MessageManager& msgmanager,
+        const MessagePtr_t& msg)
+{
     int rcode = msgmanager.canSendMessage(msg);
     switch (rcode)
     {
         case 0:
         {
             __dbConn.updateMsgState(*msg, MessageState::PENDING_ACK);
-            msg->setState(MessageState::PENDING_ACK);
-            msgmanager.incrementPendingAckCount();
+            msgmanager.markPendingAck(msg, __timerService.now() + __upstreamAckTimeout);
 
-            forwardMsg(session_id, msg);
+            forwardMsg(msg->getTargetSessionId(), msg);
             break;
         }
         case 1:
@@ -718,6 +1638,12 @@ void Application::forwardMsgToBalsession(
                       << "] breached!" << std::endl;
             break;
         }
+        case 3:
+        case 4:
+        {
+            // will go out once the group/retry allows it.
+            break;
+        }
         default:
         {
             std::cout << "ERROR: Failed to foward upstream message. Unknown rcode[" << rcode << "]"
@@ -759,53 +1685,155 @@ void Application::forwardMsg( const std::string& session_id, const MessagePtr_t&
 
 /*!
  * \brief Application::notifyDownstreamUploadFailure
+ * Sends a DOWNSTREAM_REJECT for 'msg' to the BAL session that sent it.
+ * \param project
  * \param ptr
+ * \param reason goes out as the error description.
+ */
+void Application::notifyDownstreamUploadFailure(
+        FcmProject& project,
+        const MessagePtr_t& msg,
+        const std::string& reason)
+{
+    notifyDownstreamUploadFailure(project.getName(),
+                                  project.getMessageManager().getSessionId(),
+                                  msg,
+                                  reason);
+}
+
+
+/*!
+ * \brief Application::notifyDownstreamUploadFailure
+ * Also for messages that never made it to a project's queue.
+ * \param project_name    'project' field of the reject.
+ * \param fcm_session_id  source session of the reject.
+ * \param msg
+ * \param reason
  */
-void Application::notifyDownstreamUploadFailure(const MessagePtr_t& msg)
+void Application::notifyDownstreamUploadFailure(
+        const std::string& project_name,
+        const SessionId_t& fcm_session_id,
+        const MessagePtr_t& msg,
+        const std::string& reason)
 {
     const QJsonDocument& jdoc = *(msg->getPayload());
     std::cout << "ERROR: Droping downstream message\n.["
               << jdoc.toJson().toStdString()
-              << "], Max retry [" << MAX_DOWNSTREAM_UPLOAD_RETRY <<"] reached." << std::endl;
+              << "], reason[" << reason <<"]." << std::endl;
 
     try
     {
         SequenceId_t nextseqid = __dbConn.getNextSequenceId();
+        MessagePtr_t msgptr = Message::createDownstreamReject(nextseqid,
+                                                              project_name,
+                                                              fcm_session_id,
+                                                              *msg,
+                                                              reason);
+        __dbConn.saveMsg(*msgptr);
 
-        const FcmMessageId_t& msgid = msg->getFcmMessageId();
-        //failure goes to the source session.
-        const SessionId_t& sessid = msg->getSourceSessionId();
+        forwardMsgToBalsession(msgptr->getTargetSessionId(), msgptr);
+    }
+    catch( std::exception& err)
+    {
+        PRINT_EXCEPTION_STRING(std::cout, err);
+    }
+    catch (...)
+    {
+        std::cout << "ERROR: Unknown message caught." << std::endl;
+    }
+}
+
+
+/*!
+ * \brief Application::supersedeDownstreamMessage
+ * Drops the queued, never uploaded 'old_msg' in favour of 'new_msg' with the
+ * same (to, collapse_key) and acks it to its BAL session, FCM would have
+ * collapsed it anyway.
+ * \param project
+ * \param old_msg
+ * \param new_msg
+ */
+void Application::supersedeDownstreamMessage(
+        FcmProject& project,
+        const MessagePtr_t& old_msg,
+        const MessagePtr_t& new_msg)
+{
+    std::cout << "Downstream message with id[" << old_msg->getMessageIdentifier()
+              << "] superseded by message with id[" << new_msg->getMessageIdentifier()
+              << "], collapse key[" << new_msg->getCollapseKey().second << "]." << std::endl;
+    try
+    {
+        __dbConn.updateMsgState(*old_msg, MessageState::SUPERSEDED);
+        old_msg->setState(MessageState::SUPERSEDED);
+        project.getMessageManager().removeMessage(old_msg->getSequenceId());
+
+        SequenceId_t nextseqid = __dbConn.getNextSequenceId();
+        const SessionId_t& sessid = old_msg->getSourceSessionId();
+
+        // same shape as the ack FCM would have sent.
+        QJsonObject ack;
+        ack[fcmfieldnames::MESSAGE_ID]   = old_msg->getFcmMessageId().c_str();
+        ack[fcmfieldnames::MESSAGE_TYPE] = "ack";
 
         QJsonDocument gimmm_msg;
         QJsonObject root;
         root[gimmmfieldnames::SEQUENCE_ID]   = (qint64)nextseqid;
-        root[gimmmfieldnames::MESSAGE_TYPE] = "DOWNSTREAM_REJECT";
-        root[gimmmfieldnames::SESSION_ID]   = sessid.c_str();
-        root[gimmmfieldnames::ERROR_DESC]   = "Max retry reached.";
-        // original downstream message.
-        root[gimmmfieldnames::FCM_DATA]     = msg->getPayload()->object();
+        root[gimmmfieldnames::MESSAGE_TYPE]  = "DOWNSTREAM_ACK";
+        root[gimmmfieldnames::SESSION_ID]    = sessid.c_str();
+        root[gimmmfieldnames::PROJECT]       = project.getName().c_str();
+        root[gimmmfieldnames::SUPERSEDED_BY] = new_msg->getFcmMessageId().c_str();
+        root[gimmmfieldnames::FCM_DATA]      = ack;
         gimmm_msg.setObject(root);
 
         PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
-        MessagePtr_t msgptr(new Message());
-        msgptr->setSequenceId(nextseqid);
-        msgptr->setType(MessageType::DOWNSTREAM_REJECT);
-        msgptr->setFcmMessageId(msgid);
-        msgptr->setTargetSessionId(sessid);
-        msgptr->setState(MessageState::PENDING_ACK);
-        msgptr->setPayload(pmsg);
-        __dbConn.saveMsg(*msgptr);
+        MessagePtr_t balack( new Message(
+                                  nextseqid,
+                                  MessageType::DOWNSTREAM_ACK,
+                                  old_msg->getFcmMessageId(),
+                                  "",
+                                  project.getMessageManager().getSessionId(),
+                                  sessid,
+                                  pmsg));
 
-        auto sess = findBalSession(sessid);
-        sess->writeMessage(jdoc);
+        __dbConn.saveMsg(*balack);
+        forwardMsgToBalsession(sessid, balack);
     }
-    catch( std::exception& err)
+    catch (std::exception& err)
     {
         PRINT_EXCEPTION_STRING(std::cout, err);
     }
-    catch (...)
+}
+
+
+/*!
+ * \brief Application::dropExpiredDownstreamMessages
+ * Removes messages whose time to live ran out from the queue and rejects them
+ * to their BAL sessions. All of it is written in one db transaction.
+ * \param project
+ * \param expired
+ */
+void Application::dropExpiredDownstreamMessages(
+        FcmProject& project,
+        const std::vector<MessagePtr_t>& expired)
+{
+    std::cout << "Dropping [" << expired.size() << "] expired downstream messages." << std::endl;
+    try
     {
-        std::cout << "ERROR: Unknown message caught." << std::endl;
+        __dbConn.beginTransaction();
+        for (auto&& msg: expired)
+        {
+            __dbConn.updateMsgState(*msg, MessageState::EXPIRED);
+            msg->setState(MessageState::EXPIRED);
+            releaseFcmSlot(project, msg);
+            project.getMessageManager().removeMessage(msg->getSequenceId());
+            notifyDownstreamUploadFailure(project, msg, "Time to live expired.");
+        }
+        __dbConn.commitTransaction();
+    }
+    catch (std::exception& err)
+    {
+        PRINT_EXCEPTION_STRING(std::cout, err);
+        __dbConn.rollbackTransaction();
     }
 }
 
@@ -815,12 +1843,55 @@ void Application::notifyDownstreamUploadFailure(const MessagePtr_t& msg)
  */
 void Application::printProperties()
 {
-    std::cout << "FCM_SECTION/port_no:"         << __fcmPortNo << std::endl;
-    std::cout << "FCM_SECTION/host_address:"    << __fcmHostAddress.toStdString() << std::endl;
-    std::cout << "FCM_SECTION/server_id:"       << __fcmServerId.toStdString() << std::endl;
-    std::cout << "FCM_SECTION/server_key:"      << __fcmServerKey.toStdString() << std::endl;
+    FcmDispatcher& dispatcher       = __fcmDefaultProject->getDispatcher();
+    RecipientRateLimiter& limiter   = __fcmDefaultProject->getRateLimiter();
+    std::cout << "FCM_SECTION/projects:" << std::endl;
+    for (auto&& it: __fcmProjects)
+    {
+        const FcmProject& project = *it.second;
+        std::cout << "\tPROJECT:" << project.getName()
+                  << ", port_no[" << project.getPortNo()
+                  << "], host_address[" << project.getHostAddress().toStdString()
+                  << "], server_id[" << project.getServerId().toStdString()
+                  << "], server_key[" << project.getServerKey().toStdString()
+                  << "], pool_size[" << project.getPoolSize()
+                  << "], standby_count[" << project.getStandbyCount()
+                  << "], send_rate_per_sec[" << project.getSendRatePerSec()
+                  << "], send_burst[" << project.getSendBurst() << "]" << std::endl;
+    }
+    std::cout << "FCM_SECTION/dispatch_policy:" << (char)dispatcher.getPolicy() << std::endl;
+    std::cout << "FCM_SECTION/congestion_control:" << dispatcher.isCongestionControlled() << std::endl;
+    std::cout << "FCM_SECTION/max_window:"      << dispatcher.getWindow() << std::endl;
+    std::cout << "FCM_SECTION/initial_window:"  << dispatcher.getInitialWindow() << std::endl;
+    std::cout << "FCM_SECTION/rate_limit_entries:" << limiter.getCapacity() << std::endl;
+    std::cout << "FCM_SECTION/rate_limit_interval_msec:" << limiter.getInitialInterval() << std::endl;
+    std::cout << "FCM_SECTION/upstream_dedup_entries:" << __upstreamDedup.getCapacity() << std::endl;
+    std::cout << "FCM_SECTION/upstream_dedup_window_sec:" << __upstreamDedup.getWindow() / 1000 << std::endl;
+    std::cout << "FCM_SECTION/stats_interval_msec:" << __fcmStatsInterval << std::endl;
+    std::cout << "FCM_SECTION/output_high_watermark_bytes:" << __fcmOutputHighWatermark << std::endl;
+    std::cout << "FCM_SECTION/output_low_watermark_bytes:" << __fcmOutputLowWatermark << std::endl;
+    std::cout << "FCM_SECTION/tls_protocol:"    << FcmConnection::tlsProtocolToString(__fcmTlsProtocol) << std::endl;
+    std::cout << "FCM_SECTION/tls_session_resumption:" << (__fcmTlsSessionCache != nullptr) << std::endl;
+    std::cout << "FCM_SECTION/tls_ca_certificates:" << __fcmTlsCaCertificates.size() << std::endl;
+    std::cout << "FCM_SECTION/shutdown_timeout_msec:" << __fcmShutdownTimeout << std::endl;
+    std::cout << "FCM_SECTION/keepalive_mode:"  << (char)__fcmKeepaliveMode << std::endl;
+    std::cout << "FCM_SECTION/ping_interval_msec:" << __fcmPingInterval << std::endl;
+    std::cout << "FCM_SECTION/idle_timeout_msec:" << __fcmIdleTimeout << std::endl;
     std::cout << "SERVER_SECTION/port_no:"      << __serverPortNo << std::endl;
     std::cout << "SERVER_SECTION/host_address:" << __serverHostAddress.toString().toStdString() << std::endl;
+
+    const RetryPolicy& down = __downstreamRetryScheduler.getPolicy();
+    const RetryPolicy& up   = __upstreamRetryScheduler.getPolicy();
+    std::cout << "RETRY_SECTION/downstream:"    << "base_msec[" << down.baseMsec
+              << "], cap_msec[" << down.capMsec << "], max_attempts[" << down.maxAttempts
+              << "], jitter[" << (char)down.jitter << "]" << std::endl;
+    std::cout << "RETRY_SECTION/upstream:"      << "base_msec[" << up.baseMsec
+              << "], cap_msec[" << up.capMsec << "], max_attempts[" << up.maxAttempts
+              << "], jitter[" << (char)up.jitter << "]" << std::endl;
+    std::cout << "RETRY_SECTION/batch_size:"    << __retryBatchSize << std::endl;
+    std::cout << "RETRY_SECTION/ack_timeout:"   << "downstream_msec[" << __downstreamAckTimeout
+              << "], upstream_msec[" << __upstreamAckTimeout
+              << "], check_interval_msec[" << __ackCheckInterval << "]" << std::endl;
     std::cout << "BAL_SECTION/sessions:" << std::endl;
     for (auto&& it : __balSessionMap)
     {
@@ -831,50 +1902,136 @@ void Application::printProperties()
 
 
 /*!
- * \brief Application::sendFcmAckMessage
+ * \brief Application::queueFcmAckMessage
  * @https://firebase.google.com/docs/cloud-messaging/server
  * For each device message your app server receives from CCS,
  * it needs to send an ACK message. It never needs to send a NACK message.
  * If you don't send an ACK for a message, CCS resends it the next time
  * a new XMPP connection is established, unless the message expires first.
+ * ACKs are only valid within the context of one connection, so the ack goes
+ * out on the connection 'original_msg' arrived on.
+ *
+ * Acks are only queued here; 'flushFcmAckMessages' sends them once the db
+ * transaction holding their messages has committed.
+ * \param id   fcm connection the upstream message came in on.
  * \param json
  */
-void Application::sendFcmAckMessage(const QJsonDocument& original_msg)
+void Application::queueFcmAckMessage(int id, const QJsonDocument& original_msg)
 {
-    std::string to = original_msg.object().value("from").toString().toStdString();
-    std::string mid = original_msg.object().value("message_id").toString().toStdString();
+    std::string to = original_msg.object().value(fcmfieldnames::FROM).toString().toStdString();
+    std::string mid = original_msg.object().value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
+
+    std::cout << "Queueing Ack back to FCM for message with msg id[" << mid << "]..." << std::endl;
+    __fcmAckBatches[id].appendAck(to, mid);
+}
 
-    std::cout << "Sending Ack back to FCM for message with msg id[" << mid << "]..." << std::endl;
 
-    QJsonDocument ackmsg;
-    QJsonObject root;
-    root[fcmfieldnames::TO] = to.c_str();
-    root[fcmfieldnames::MESSAGE_ID] = mid.c_str();
-    root[fcmfieldnames::MESSAGE_TYPE] = "ack";
-    ackmsg.setObject(root);
+/*!
+ * \brief Application::flushFcmAckMessages
+ * Hands the queued acks of each connection over as one write.
+ */
+void Application::flushFcmAckMessages()
+{
+    for (auto&& i: __fcmAckBatches)
+    {
+        StanzaEncoder& acks = i.second;
+        if (acks.empty())
+            continue;
+
+        auto it = __fcmConnectionsMap.find(i.first);
+        if (it == __fcmConnectionsMap.end())
+        {
+            // CCS resends them on the next connection.
+            std::cout << "WARNING: Connection[" << i.first << "] is gone. ["
+                      << acks.count() << "] acks not sent." << std::endl;
+            acks.clear();
+            continue;
+        }
+        std::cout << FCM_TAG_TX(i.first) << "Sending [" << acks.count() << "] acks." << std::endl;
+        std::size_t count = acks.count();
+        it->second->sendStanzas(acks.take(), count);
+    }
+    __fcmAckBatchIds.clear();
+}
+
+
+/*!
+ * \brief Application::discardFcmAckMessages
+ * The transaction holding the acked messages was rolled back. Nothing of
+ * them is stored, so FCM has to redeliver them rather than be acked, and
+ * neither the BAL nor the queues may see what the batch did. Downstream
+ * messages it acked stay pending until their ack timeout resends them.
+ */
+void Application::discardFcmAckMessages()
+{
+    for (auto&& i: __fcmAckBatches)
+        i.second.clear();
+    for (auto&& key: __fcmAckBatchIds)
+        __upstreamDedup.remove(key);
+    __fcmAckBatchIds.clear();
+    std::cout << "WARNING: Dropping [" << __fcmBatchActions.size()
+              << "] actions of the rolled back fcm batch." << std::endl;
+    __fcmBatchActions.clear();
+}
+
+
+/*!
+ * \brief Application::afterFcmCommit
+ * Queues 'action' until the transaction of handleFcmEvents commits; runs it
+ * right away when no transaction is open.
+ * \param action  a BAL forward or in-memory state change of a fcm event.
+ */
+void Application::afterFcmCommit(const std::function<void()>& action)
+{
+    if (__fcmBatchOpen)
+        __fcmBatchActions.push_back(action);
+    else
+        action();
+}
 
-    PRINT_JSON_DOC_RAW(std::cout, ackmsg);
-    // ack as many and as quickly as possible.
-    emit sendMessage(ackmsg);
+
+/*!
+ * \brief Application::runFcmBatchActions
+ * Runs the actions queued by afterFcmCommit in the order of their events.
+ */
+void Application::runFcmBatchActions()
+{
+    std::vector<std::function<void()>> actions;
+    actions.swap(__fcmBatchActions);
+    for (auto&& action: actions)
+    {
+        try
+        {
+            action();
+        }
+        catch (std::exception& err)
+        {
+            PRINT_EXCEPTION_STRING(std::cout, err);
+        }
+    }
 }
 
 
 /*!
  * \brief Application::retryDownstreamWithExponentialBackoff
+ * Hands 'msg' over to the downstream retry scheduler. The message keeps its
+ * window slot while it waits.
+ * \param project
  * \param msg
  */
-void Application::retryDownstreamWithExponentialBackoff(MessagePtr_t& msg)
+void Application::retryDownstreamWithExponentialBackoff(FcmProject& project, MessagePtr_t& msg)
 {
-    int msec = msg->getNextRetryTimeout();
+    int attempt = msg->incrementRetryCount();
+    std::int64_t msec = __downstreamRetryScheduler.schedule(
+                                        msg->getSequenceId(),
+                                        attempt,
+                                        __timerService.now());
     if ( msec != -1)
     {
+        // not on the wire until the retry fires.
+        project.getMessageManager().setAckDeadline(msg->getSequenceId(), NO_ACK_DEADLINE);
         msg->setRetryInProgress(true);
-        auto timerCallback = [msg, this]() mutable{
-            uploadToFcm(msg);
-            msg->setRetryInProgress(false);
-        };
-        // retry sending after 'msec' millisecs.
-        QTimer::singleShot(msec, Qt::TimerType::PreciseTimer, timerCallback);
+        armRetryTimer();
     }
     else
     {
@@ -883,8 +2040,9 @@ void Application::retryDownstreamWithExponentialBackoff(MessagePtr_t& msg)
                   << msg->getSequenceId() << "]. Max retry reached."
                   << std::endl;
         __dbConn.updateMsgState(*msg, MessageState::DELIVERY_FAILED);
-        __fcmMsgManager.removeMessageWithFcmMsgId(msg->getFcmMessageId());
-        notifyDownstreamUploadFailure(msg);
+        releaseFcmSlot(project, msg);
+        project.getMessageManager().removeMessageWithFcmMsgId(msg->getFcmMessageId());
+        notifyDownstreamUploadFailure(project, msg);
     }
 }
 
@@ -895,25 +2053,253 @@ void Application::retryDownstreamWithExponentialBackoff(MessagePtr_t& msg)
  */
 void Application::retryUpstreamWithExponentialBackoff(MessagePtr_t& msg)
 {
-    int msec = msg->getNextRetryTimeout();
+    int attempt = msg->incrementRetryCount();
+    std::int64_t msec = __upstreamRetryScheduler.schedule(
+                                        msg->getSequenceId(),
+                                        attempt,
+                                        __timerService.now());
     if ( msec != -1)
     {
+        findBalMessageManager(msg->getTargetSessionId())
+                .setAckDeadline(msg->getSequenceId(), NO_ACK_DEADLINE);
         msg->setRetryInProgress(true);
-        auto timerCallback = [msg, this]{
-            forwardMsg(msg->getTargetSessionId(), msg);
-            msg->setRetryInProgress(false);
-        };
-        // retry sending after 'msec' millisecs.
-        QTimer::singleShot(msec, Qt::TimerType::PreciseTimer, timerCallback);
+        armRetryTimer();
     }
     else
     {
+        std::cout << "ERROR: Unable to send msg [" << msg->getMessageIdentifier() << "]. Max retry reached."
+                  << std::endl;
         __dbConn.updateMsgState(*msg, MessageState::DELIVERY_FAILED);
         MessageManager& msgmanager = findBalMessageManager(msg->getTargetSessionId());
         msgmanager.removeMessageWithFcmMsgId(msg->getFcmMessageId());
     }
-    std::cout << "ERROR: Unable to send msg [" << msg->getMessageIdentifier() << "]. Max retry reached."
-              << std::endl;
+}
+
+
+/*!
+ * \brief Application::armRetryTimer
+ * (Re)arms the one retry timer for the earliest due retry in either direction.
+ */
+void Application::armRetryTimer()
+{
+    std::int64_t down = __downstreamRetryScheduler.nextDueTime();
+    std::int64_t up   = __upstreamRetryScheduler.nextDueTime();
+
+    std::int64_t next = down;
+    if (next == -1 || (up != -1 && up < next))
+        next = up;
+
+    if (__timerService.isActive(__retryTimer) && next == __retryTimerDue)
+        return;
+
+    __timerService.cancel(__retryTimer);
+    __retryTimerDue = next;
+    if (next == -1)
+        return;
+
+    __retryTimer = __timerService.scheduleAt(next, [this]{
+        __retryTimer = INVALID_TIMER_HANDLE;
+        handleRetryTimeout();
+    });
+}
+
+
+/*!
+ * \brief Application::handleRetryTimeout
+ * Fires up to 'batch_size' due retries per direction. Retries for messages that
+ * were acked/removed in the meantime are simply dropped.
+ */
+void Application::handleRetryTimeout()
+{
+    std::int64_t now = __timerService.now();
+    std::vector<RetryEntry> due;
+
+    __downstreamRetryScheduler.takeDue(now, due, __retryBatchSize);
+    for (auto&& entry: due)
+    {
+        FcmProjectPtr_t project;
+        MessagePtr_t msg = findDownstreamMessage(entry.sequenceId, project);
+        if (!msg)
+            continue;
+
+        MessageManager& msgmanager = project->getMessageManager();
+        RecipientRateLimiter& limiter = project->getRateLimiter();
+        // its recipient's hold timer releases it, not the retry.
+        if (msg->getHeld())
+            continue;
+
+        std::cout << "Retry attempt[" << entry.attempt << "] for downstream message with id["
+                  << msg->getMessageIdentifier() << "]" << std::endl;
+        msg->setRetryInProgress(false);
+        if (msg->getState() == MessageState::NEW)
+        {
+            // its slot was reclaimed; compete for a new one.
+            dispatchDownstreamMessage(*project, msg);
+        }
+        else if (msg->isExpired(QDateTime::currentMSecsSinceEpoch()))
+        {
+            dropExpiredDownstreamMessages(*project, std::vector<MessagePtr_t>(1, msg));
+            sendNextPendingDownstreamMessage(*project);
+        }
+        else if (limiter.readyAt(msg->getTo(), now) > now)
+        {
+            // another message to the same device got there first.
+            msgmanager.reclaimPendingAck(msg);
+            __dbConn.updateMsgState(*msg, MessageState::NEW);
+            holdDownstreamMessage(*project, msg);
+            sendNextPendingDownstreamMessage(*project);
+        }
+        else if (!project->admitSend(now))
+        {
+            // back to the queue until the project send rate allows it.
+            msgmanager.reclaimPendingAck(msg);
+            __dbConn.updateMsgState(*msg, MessageState::NEW);
+            armSendRateTimer(*project);
+        }
+        else if (uploadToFcm(*project, msg))
+        {
+            msgmanager.setAckDeadline(msg->getSequenceId(), now + __downstreamAckTimeout);
+        }
+        else
+        {
+            // no connection can take it; queue it up again.
+            msgmanager.reclaimPendingAck(msg);
+            __dbConn.updateMsgState(*msg, MessageState::NEW);
+        }
+    }
+
+    due.clear();
+    __upstreamRetryScheduler.takeDue(now, due, __retryBatchSize);
+    for (auto&& entry: due)
+    {
+        MessagePtr_t msg = findUpstreamMessage(entry.sequenceId);
+        if (!msg)
+            continue;
+
+        std::cout << "Retry attempt[" << entry.attempt << "] for upstream message with id["
+                  << msg->getMessageIdentifier() << "]" << std::endl;
+        msg->setRetryInProgress(false);
+        MessageManager& msgmanager = findBalMessageManager(msg->getTargetSessionId());
+        if (msg->getState() == MessageState::NEW)
+        {
+            dispatchUpstreamMessage(msgmanager, msg);
+        }
+        else
+        {
+            msgmanager.setAckDeadline(msg->getSequenceId(), now + __upstreamAckTimeout);
+            forwardMsg(msg->getTargetSessionId(), msg);
+        }
+    }
+    armRetryTimer();
+}
+
+
+/*!
+ * \brief Application::scheduleAckTimeoutCheck
+ */
+void Application::scheduleAckTimeoutCheck()
+{
+    __timerService.cancel(__ackCheckTimer);
+    __ackCheckTimer = __timerService.schedule(__ackCheckInterval, [this]{
+        __ackCheckTimer = INVALID_TIMER_HANDLE;
+        handleAckTimeoutCheck();
+        scheduleAckTimeoutCheck();
+    });
+}
+
+
+/*!
+ * \brief Application::handleAckTimeoutCheck
+ * Messages that were sent but never got an ack/nack within the configured
+ * deadline give their window slot back and are re-driven through the retry
+ * policy of their direction. The freed slots are handed to queued messages.
+ */
+void Application::handleAckTimeoutCheck()
+{
+    std::int64_t now = __timerService.now();
+    std::vector<MessagePtr_t> expired;
+
+    for (auto&& i: __fcmProjects)
+    {
+        FcmProject& project = *i.second;
+        MessageManager& msgmanager = project.getMessageManager();
+        expired.clear();
+        msgmanager.collectExpiredAcks(now, expired);
+        for (auto&& msg: expired)
+        {
+            std::cout << "WARNING: No ack/nack from FCM for downstream message with id["
+                      << msg->getMessageIdentifier() << "] within [" << __downstreamAckTimeout
+                      << "] msec. Reclaiming its slot." << std::endl;
+            project.getDispatcher().onThrottled(msg->getConnectionId());
+            msgmanager.reclaimPendingAck(msg);
+            releaseFcmSlot(project, msg);
+            __dbConn.updateMsgState(*msg, MessageState::NEW);
+            retryDownstreamWithExponentialBackoff(project, msg);
+        }
+        for (std::size_t n = 0; n < expired.size(); n++)
+            sendNextPendingDownstreamMessage(project);
+    }
+
+    for (auto&& i: __balSessionMap)
+    {
+        MessageManager& msgmanager = i.second->getMessageManager();
+        expired.clear();
+        msgmanager.collectExpiredAcks(now, expired);
+        for (auto&& msg: expired)
+        {
+            std::cout << "WARNING: No ack from BAL session[" << i.first
+                      << "] for upstream message with id[" << msg->getMessageIdentifier()
+                      << "] within [" << __upstreamAckTimeout << "] msec. Reclaiming its slot."
+                      << std::endl;
+            msgmanager.reclaimPendingAck(msg);
+            __dbConn.updateMsgState(*msg, MessageState::NEW);
+            retryUpstreamWithExponentialBackoff(msg);
+        }
+        for (std::size_t n = 0; n < expired.size(); n++)
+            sendNextPendingUpstreamMessage(msgmanager);
+    }
+}
+
+
+/*!
+ * \brief Application::findUpstreamMessage
+ * \param seqid
+ * \return the message or a null ptr if no BAL session holds 'seqid'.
+ */
+MessagePtr_t Application::findUpstreamMessage(const SequenceId_t& seqid)
+{
+    for (auto&& i: __balSessionMap)
+    {
+        MessageQueue_t& msgs = i.second->getMessageManager().getMessages();
+        auto it = msgs.find(seqid);
+        if (it != msgs.end())
+            return it->second;
+    }
+    MessagePtr_t nullmsg;
+    return nullmsg;
+}
+
+
+/*!
+ * \brief Application::findDownstreamMessage
+ * \param seqid
+ * \param project set to the project whose queue holds 'seqid'.
+ * \return the message or a null ptr if no project holds 'seqid'.
+ */
+MessagePtr_t Application::findDownstreamMessage(const SequenceId_t& seqid, FcmProjectPtr_t& project)
+{
+    for (auto&& i: __fcmProjects)
+    {
+        MessageQueue_t& msgs = i.second->getMessageManager().getMessages();
+        auto it = msgs.find(seqid);
+        if (it != msgs.end())
+        {
+            project = i.second;
+            return it->second;
+        }
+    }
+    MessagePtr_t nullmsg;
+    return nullmsg;
 }
 
 
@@ -1010,9 +2396,10 @@ void Application::handleNewBALConnection()
     __balSessionMapU.emplace(id, conn);
 
     auto timerCallback = [conn, this]{
+            conn->setTimeoutHandle(INVALID_TIMER_HANDLE);
             handleBalAuthenticationTimeout(conn);
       };
-    QTimer::singleShot(MAX_LOGON_MSG_WAIT_TIME, Qt::TimerType::PreciseTimer, conn->getTimerContext(), timerCallback);
+    conn->setTimeoutHandle(__timerService.schedule(MAX_LOGON_MSG_WAIT_TIME, timerCallback));
 }
 
 
@@ -1098,7 +2485,9 @@ void Application::handleBalLogonRequest(
     // it will be accepted. Or else it will be discarded.
     // Let's also stop the timeout timer.
     BALConnPtr_t conn = it->second;
-    conn->deleteTimerContext();
+    TimerHandle_t timeout = conn->getTimeoutHandle();
+    __timerService.cancel(timeout);
+    conn->setTimeoutHandle(INVALID_TIMER_HANDLE);
     __balSessionMapU.erase(it);
 
     // check if its a known BAL client.
@@ -1132,7 +2521,7 @@ void Application::handleBalLogonRequest(
     auto timerCallback = [sess, this]{
             resendPendingUpstreamMessages(sess);
       };
-    QTimer::singleShot(1000, Qt::TimerType::PreciseTimer, timerCallback);
+    __timerService.schedule(BAL_RESEND_DELAY, timerCallback);
     std::cout << "----------------------------------End handleBalLogonRequest---------------------------------------" << std::endl;
 }
 
@@ -1152,7 +2541,8 @@ void Application::handleBALSocketDisconnected()
     auto it = __balSessionMapU.find(desc);
     if ( it != __balSessionMapU.end())
     {
-        it->second->deleteTimerContext();
+        TimerHandle_t timeout = it->second->getTimeoutHandle();
+        __timerService.cancel(timeout);
         __balSessionMapU.erase(it);
         std::cout << "Unauthenticated session lost." << std::endl;
     }else
@@ -1179,6 +2569,9 @@ void Application::handleBALSocketDisconnected()
  *  If the pending message count reaches 100,
  *  the app server should stop sending new messages and wait for
  *  CCS to acknowledge some of the existing pending messages"
+ *  The message goes to the queue of the project named by its 'project' field,
+ *  the default project if it has none. An unknown project gets a
+ *  DOWNSTREAM_REJECT back.
  * \param session_id    session from where this message was recieved.
  * \param bal_downstream_msg
  */
@@ -1188,34 +2581,99 @@ void Application::handleBalDownstreamUploadRequest(
 {
     std::cout << "-----------------------------------Start handleBalDownstreamUploadRequest -------------------------------------\n";
     std::string gid  = bal_downstream_msg.object().value(gimmmfieldnames::GROUP_ID).toString().toStdString();
+    std::string name = bal_downstream_msg.object().value(gimmmfieldnames::PROJECT).toString().toStdString();
     QJsonObject data = bal_downstream_msg.object().value(gimmmfieldnames::FCM_DATA).toObject();
     std::string fcm_mid = data.value(fcmfieldnames::MESSAGE_ID).toString().toStdString();
 
     QJsonDocument jdoc(data);
     PayloadPtr_t pmsg(new QJsonDocument(jdoc));
 
+    FcmProjectPtr_t project = findFcmProject(name);
+    if (!project)
+    {
+        // never queued or stored; the BAL gets the reject right away.
+        std::stringstream reason;
+        reason << "Unknown project[" << name << "].";
+        MessagePtr_t rejected(new Message(0,
+                                          MessageType::DOWNSTREAM,
+                                          fcm_mid,
+                                          gid,
+                                          session_id,
+                                          DEFAULT_FCM_SESSION_ID,
+                                          pmsg));
+        notifyDownstreamUploadFailure(name, DEFAULT_FCM_SESSION_ID, rejected, reason.str());
+        std::cout << "-----------------------------------End handleBalDownstreamUploadRequest -------------------------------------\n";
+        return;
+    }
+    MessageManager& msgmanager = project->getMessageManager();
+
     SequenceId_t nextseqid = __dbConn.getNextSequenceId();
     MessagePtr_t msg( new Message( nextseqid,
                                    MessageType::DOWNSTREAM,
                                    fcm_mid,
                                    gid,
                                    session_id,
-                                   "fcm",
+                                   msgmanager.getSessionId(),
                                    pmsg));
+    msg->setExpiresAt(Message::computeExpiry(data, QDateTime::currentMSecsSinceEpoch()));
+    msg->setTo(Message::toFromPayload(data));
+    msg->setCollapseKey(Message::collapseKeyFromPayload(data));
     std::cout << "New message created:" << std::endl;
     std::cout << *msg << std::endl;
 
     __dbConn.saveMsg(*msg);
-    __fcmMsgManager.addMessage(nextseqid, msg);
-    int rcode = __fcmMsgManager.canSendMessage(msg);
+    MessagePtr_t superseded = msgmanager.findSupersededMessage(msg);
+    if (superseded)
+        supersedeDownstreamMessage(*project, superseded, msg);
+    msgmanager.addMessage(nextseqid, msg);
+    // queues up behind the messages already held for its recipient.
+    if (msgmanager.hasHeldMessages(msg->getTo()))
+        holdDownstreamMessage(*project, msg);
+    else
+        dispatchDownstreamMessage(*project, msg);
+    std::cout << "-----------------------------------End handleBalDownstreamUploadRequest -------------------------------------\n";
+}
+
+
+/*!
+ * \brief Application::dispatchDownstreamMessage
+ * Uploads 'msg' if the FCM window of its project allows it. Otherwise it
+ * stays queued and goes out when a slot opens up.
+ * \param project
+ * \param msg
+ */
+void Application::dispatchDownstreamMessage(FcmProject& project, MessagePtr_t& msg)
+{
+    if (msg->isExpired(QDateTime::currentMSecsSinceEpoch()))
+    {
+        dropExpiredDownstreamMessages(project, std::vector<MessagePtr_t>(1, msg));
+        return;
+    }
+
+    MessageManager& msgmanager = project.getMessageManager();
+    int rcode = msgmanager.canSendMessage(msg);
     switch (rcode)
     {
         case 0:
         {
+            std::int64_t now      = __timerService.now();
+            if (project.getRateLimiter().readyAt(msg->getTo(), now) > now)
+            {
+                holdDownstreamMessage(project, msg);
+                break;
+            }
+            // project wide limit; it waits in the queue for a token.
+            if (!project.admitSend(now))
+            {
+                armSendRateTimer(project);
+                break;
+            }
+            // stays queued until a connection has a free slot.
+            if (!uploadToFcm(project, msg))
+                break;
+
             __dbConn.updateMsgState(*msg, MessageState::PENDING_ACK);
-            msg->setState(MessageState::PENDING_ACK);
-            __fcmMsgManager.incrementPendingAckCount();
-            uploadToFcm(msg);
+            msgmanager.markPendingAck(msg, __timerService.now() + __downstreamAckTimeout);
             break;
         }
         case 1:
@@ -1230,28 +2688,176 @@ void Application::handleBalDownstreamUploadRequest(
                       << "] breached" << std::endl;
             break;
         }
+        case 3:
+        case 4:
+        case 5:
+        {
+            // will go out once the group/retry/hold allows it.
+            break;
+        }
         default:
         {
             std::cout << "Failed to upload upstream message with rcode[" << rcode << "]"
                       << std::endl;
         }
     }
-    std::cout << "-----------------------------------End handleBalDownstreamUploadRequest -------------------------------------\n";
+}
+
+
+/*!
+ * \brief Application::holdDownstreamMessage
+ * Keeps 'msg' queued (NEW) behind the other held messages of its recipient
+ * until the recipient's rate limit lets it go. Holding isn't a retry attempt.
+ * \param project
+ * \param msg
+ */
+void Application::holdDownstreamMessage(FcmProject& project, MessagePtr_t& msg)
+{
+    std::cout << "Recipient of message with id[" << msg->getMessageIdentifier()
+              << "] is rate limited. Holding it." << std::endl;
+    project.getMessageManager().holdMessage(msg);
+    armHoldTimer(project, msg->getTo());
+}
+
+
+/*!
+ * \brief Application::armHoldTimer
+ * One timer per rate limited recipient, armed for when its next token is
+ * there; its held messages are released one per token, oldest first.
+ * \param project
+ * \param to
+ */
+void Application::armHoldTimer(FcmProject& project, const std::string& to)
+{
+    HoldTimerMap_t& timers = project.getHoldTimers();
+    auto it = timers.find(to);
+    if (it != timers.end() && __timerService.isActive(it->second))
+        return;
+
+    // projects live as long as the application.
+    FcmProject* p = &project;
+    std::int64_t at = project.getRateLimiter().readyAt(to, __timerService.now());
+    timers[to] = __timerService.scheduleAt(at, [this, p, to]{
+        p->getHoldTimers().erase(to);
+        handleHoldTimeout(*p, to);
+    });
+}
+
+
+/*!
+ * \brief Application::handleHoldTimeout
+ * \param project
+ * \param to
+ */
+void Application::handleHoldTimeout(FcmProject& project, const std::string& to)
+{
+    MessageManager& msgmanager = project.getMessageManager();
+    std::int64_t now = __timerService.now();
+    // the limit can have been pushed back by a nack since the timer was armed.
+    if (project.getRateLimiter().readyAt(to, now) <= now)
+    {
+        MessagePtr_t msg = msgmanager.takeHeldMessage(to);
+        if (msg)
+            dispatchDownstreamMessage(project, msg);
+    }
+    if (msgmanager.hasHeldMessages(to))
+        armHoldTimer(project, to);
+}
+
+
+/*!
+ * \brief Application::armSendRateTimer
+ * One timer per project for every message waiting on its send rate, armed
+ * for when the next token is there.
+ * \param project
+ */
+void Application::armSendRateTimer(FcmProject& project)
+{
+    if (__timerService.isActive(project.getSendRateTimer()))
+        return;
+
+    // projects live as long as the application.
+    FcmProject* p = &project;
+    std::int64_t at = project.getSendRate().readyAt(__timerService.now());
+    project.setSendRateTimer(__timerService.scheduleAt(at, [this, p]{
+        p->setSendRateTimer(INVALID_TIMER_HANDLE);
+        handleSendRateTimeout(*p);
+    }));
+}
+
+
+/*!
+ * \brief Application::handleSendRateTimeout
+ * Spends the tokens that came back on queued messages while there are free
+ * slots. A message that still finds no token re-arms the timer.
+ * \param project
+ */
+void Application::handleSendRateTimeout(FcmProject& project)
+{
+    MessageManager& msgmanager = project.getMessageManager();
+    while (project.getSendRate().isReady(__timerService.now()) &&
+           project.getDispatcher().getFreeSlots() > 0)
+    {
+        std::int64_t pending = msgmanager.getPendingAckCount();
+        sendNextPendingDownstreamMessage(project);
+        // nothing sendable left.
+        if (msgmanager.getPendingAckCount() == pending)
+            break;
+    }
 }
 
 
 /*!
  * \brief Application::uploadToFcm
+ * Sends 'msg' on the connection of its project's pool picked by the
+ * project's dispatcher.
+ * \param project
  * \param msg
+ * \return false if no connection has a free slot; nothing was sent.
  */
-void Application::uploadToFcm(MessagePtr_t &msg)
+bool Application::uploadToFcm(FcmProject& project, MessagePtr_t &msg)
 {
-    std::cout << "Uploading message with id["
+    int id = project.getDispatcher().pick(msg->getTo());
+    auto it = __fcmConnectionsMap.find(id);
+    if (it == __fcmConnectionsMap.end())
+    {
+        std::cout << "No FCM connection with a free slot. Message with id["
+                  << msg->getMessageIdentifier() << "] stays queued." << std::endl;
+        return false;
+    }
+
+    std::cout << FCM_TAG_TX(id) << "Uploading message with id["
               << msg->getMessageIdentifier() << "] to FCM." << std::endl;
 
+    // a resend moves the message off the link it was on.
+    releaseFcmSlot(project, msg);
+    project.getMessageManager().assignConnection(msg, id);
+    msg->setSentAt(__timerService.now());
+    project.getDispatcher().onSent(id);
+    project.getRateLimiter().onSent(msg->getTo(), msg->getSentAt());
+    project.getSendRate().take(msg->getSentAt());
+
     const QJsonDocument& jdoc = *(msg->getPayload());
     PRINT_JSON_DOC_RAW(std::cout, jdoc);
-    emit sendMessage(jdoc);
+    it->second->send(jdoc);
+    return true;
+}
+
+
+/*!
+ * \brief Application::releaseFcmSlot
+ * Gives back the connection slot held by 'msg', if any.
+ * \param project
+ * \param msg
+ * \param rtt_msec send to ack/nack time or -1 if 'msg' wasn't acked/nacked.
+ */
+void Application::releaseFcmSlot(FcmProject& project, const MessagePtr_t& msg, std::int64_t rtt_msec)
+{
+    if (msg->getConnectionId() == NO_FCM_CONNECTION)
+        return;
+
+    project.getDispatcher().onCompleted(msg->getConnectionId(), rtt_msec);
+    project.getMessageManager().releaseConnection(msg);
 }
 
 
@@ -1288,10 +2894,8 @@ void Application::resendPendingUpstreamMessages(const BALSessionPtr_t& sess)
                       << sid <<"]" << std::endl;
 
             if ( msg->getState() != MessageState::PENDING_ACK)
-            {
                 __dbConn.updateMsgState(*msg, MessageState::PENDING_ACK);
-                msgmanager.incrementPendingAckCount();
-            }
+            msgmanager.markPendingAck(msg, __timerService.now() + __upstreamAckTimeout);
             forwardMsg(sid, msg);
         }
         else if ( rcode == 2 )
@@ -1305,6 +2909,10 @@ void Application::resendPendingUpstreamMessages(const BALSessionPtr_t& sess)
             std::cout << "Cannot forward message.There are other pending message for the same groupid."
                       << std::endl;
         }
+        else if (rcode == 4)
+        {
+            // goes out when its retry fires.
+        }
         else
         {
            std::cout << "ERROR: Unable to send message with msgid[" << msg->getMessageIdentifier()
@@ -1317,8 +2925,10 @@ void Application::resendPendingUpstreamMessages(const BALSessionPtr_t& sess)
 
 /*!
  * \brief Application::resendAllPendingDownstreamMessages
- * Called after a session is established/restablished with FCM. Resends all
- * NEW and PENDING ACK messages from the queue.
+ * Called after a session of 'project' is established/restablished with FCM.
+ * Sends the NEW messages and the PENDING ACK ones no connection carries, i.e
+ * those loaded from the db. A lost connection's in flight set was requeued
+ * already.
  *
  * REQUIREMENT:
  * Flow control @ https://firebase.google.com/docs/cloud-messaging/server#flow
@@ -1328,50 +2938,87 @@ void Application::resendPendingUpstreamMessages(const BALSessionPtr_t& sess)
  * message before ACKing it again. Similarly, all pending
  * messages for which an ACK/NACK was not received from CCS
  * before the connection was closed should be sent again.
+ * \param project
  */
-void Application::resendAllPendingDownstreamMessages()
+void Application::resendAllPendingDownstreamMessages(FcmProject& project)
 {
-    std::cout << "Attempting to resend all pending downstream messages..." << std::endl;
-    MessageQueue_t& msgmap = __fcmMsgManager.getMessages();
-    std::cout << "Found [" << msgmap.size() << "] pending downstream messages." << std::endl;
-    for (auto&& it: msgmap)
+    std::cout << "Attempting to resend all pending downstream messages of project["
+              << project.getName() << "]..." << std::endl;
+    MessageManager& msgmanager = project.getMessageManager();
+    FcmDispatcher& dispatcher  = project.getDispatcher();
+
+    // don't waste the window on messages FCM would discard anyway.
+    std::vector<MessagePtr_t> expired;
+    msgmanager.collectExpired(QDateTime::currentMSecsSinceEpoch(), expired,
+                              [&dispatcher](int id){ return dispatcher.isHealthy(id);});
+    if (!expired.empty())
+        dropExpiredDownstreamMessages(project, expired);
+
+    // the loop below may remove messages from the queue, walk a snapshot.
+    std::vector<MessagePtr_t> msgs;
+    for (auto&& it: msgmanager.getMessages())
+        msgs.push_back(it.second);
+    std::cout << "Found [" << msgs.size() << "] pending downstream messages." << std::endl;
+    MessagePtr_t waiting = project.resendPass(msgs, __timerService.now(),
+                                              [this, &project, &msgmanager](MessagePtr_t& msg)
     {
-        MessagePtr_t msg = it.second;
-
-        //skip all non downstream message. Just a safety check for clumsy people.
-        if (msg->getType() != MessageType::DOWNSTREAM)
-        {
-            std::cout << "WARNING: Non downstream message with id ["
-                      << msg ->getMessageIdentifier()
-                      << "] found. This shouldn't happen!" << std::endl;
-            continue;
-        }
-
         // resend new and pending ack messages.
-        int rcode = __fcmMsgManager.canSendMessageOnReconnect(msg);
+        int rcode = msgmanager.canSendMessageOnReconnect(msg);
         switch (rcode)
         {
             case 0:
             {
+                // as in dispatchDownstreamMessage: a rate limited recipient, or
+                // one with messages held ahead of this one, gets it in order.
+                std::int64_t now = __timerService.now();
+                if (project.getRateLimiter().readyAt(msg->getTo(), now) > now ||
+                    msgmanager.hasHeldMessages(msg->getTo()))
+                {
+                    if (msg->getState() == MessageState::PENDING_ACK)
+                    {
+                        msgmanager.reclaimPendingAck(msg);
+                        __dbConn.updateMsgState(*msg, MessageState::NEW);
+                    }
+                    holdDownstreamMessage(project, msg);
+                    break;
+                }
+
                 std::cout << "Resending message with msgid[" << msg->getMessageIdentifier()
                           << "] to FCM." << std::endl;
 
-                QJsonDocument& json = *msg->getPayload();
-                emit sendMessage(json);
+                if (!uploadToFcm(project, msg))
+                    break;
+                if ( msg->getState() != MessageState::PENDING_ACK)
+                    __dbConn.updateMsgState(*msg, MessageState::PENDING_ACK);
+                msgmanager.markPendingAck(msg, __timerService.now() + __downstreamAckTimeout);
                 break;
             }
             case 2:
             {
-                retryDownstreamWithExponentialBackoff(msg);
+                retryDownstreamWithExponentialBackoff(project, msg);
                 break;
             }
             case 1:// wrong state
             case 3:// max pending message limit breached.
+            case 4:// retry scheduled.
+            case 5:// held for its recipient's rate limit.
             default:
             {
                 //do nothing
             }
         }
+    });
+
+    // over the project send rate; this and the rest of the queue wait for
+    // the send rate timer, which releases them as tokens come back.
+    if (waiting)
+    {
+        if (waiting->getState() == MessageState::PENDING_ACK && !waiting->getRetryInProgress())
+        {
+            msgmanager.reclaimPendingAck(waiting);
+            __dbConn.updateMsgState(*waiting, MessageState::NEW);
+        }
+        armSendRateTimer(project);
     }
 }
 
@@ -1407,7 +3054,7 @@ void Application::handleSigTerm()
 
     // do Qt stuff
     std::cout << "SIGTERM RECIEVED:" << std::endl;
-    QCoreApplication::quit();
+    shutdown();
 
     snTerm->setEnabled(true);
 }
@@ -1424,7 +3071,7 @@ void Application::handleSigInt()
 
   // do Qt stuff
   std::cout << "SIGINT RECIEVED:" << std::endl;
-  QCoreApplication::quit();
+  shutdown();
 
   snHup->setEnabled(true);
 }
@@ -6,8 +6,14 @@
 #include "message.h"
 #include "messagemanager.h"
 #include "dbconnection.h"
+#include "retryscheduler.h"
+#include "timerservice.h"
+#include "fcmdispatcher.h"
+#include "fcmproject.h"
+#include "dedupindex.h"
 
 #include <cstring>
+#include <functional>
 #include <map>
 #include <set>
 #include <queue>
@@ -22,6 +28,15 @@ typedef std::map<std::string, BALSessionPtr_t>  BalSessionMap_t;
 // Unauthenticated sessions. Key = socket descriptor, Val = a BALConn.
 typedef std::map<qintptr,     BALConnPtr_t>     SessionMapU;
 typedef std::map<int, FcmConnectionPtr_t>       FcmConnectionsMap;
+// Key = fcm connection id, Val = the project the connection belongs to.
+typedef std::map<int, FcmProjectPtr_t>          FcmConnectionProjectMap_t;
+
+#define DEFAULT_ACK_TIMEOUT         60000   // in msec
+#define DEFAULT_ACK_CHECK_INTERVAL  1000    // in msec
+#define DEFAULT_FCM_STATS_INTERVAL  60000   // in msec
+#define DEFAULT_SEND_BURST          100     // tokens of the project send rate.
+#define DEFAULT_FCM_STANDBY_COUNT   1
+#define SHUTDOWN_GRACE_MSEC         500     // in msec, on top of the fcm shutdown timeout.
 
 
 /*!
@@ -35,19 +50,49 @@ class Application:public QObject
         quint16                     __serverPortNo;     // Port No for incomming BAL connection.
         QHostAddress                __serverHostAddress;// Host for incomming BAL connection.
 
+        TimerService                __timerService;     // all process timers; must outlive the users below.
+
         // Fcm stuff
         int                         __fcmConnCount;
-        FcmConnectionsMap           __fcmConnectionsMap;
-        QString                     __fcmServerId;      // FCM server id; read from config.ini
-        QString                     __fcmServerKey;     // FCM server key; read from config.ini
-        QString                     __fcmHostAddress;   // FCM host add; read from config.ini
-        quint16                     __fcmPortNo;        // FCM port no; read from config.ini
-        MessageManager              __fcmMsgManager;
+        FcmConnectionsMap           __fcmConnectionsMap;    // connections of every project.
+        FcmProjectMap_t             __fcmProjects;      // name --> project; read from config.ini
+        FcmProjectPtr_t             __fcmDefaultProject;    // FCM_SECTION's; takes msgs with no project.
+        FcmConnectionProjectMap_t   __fcmConnectionProjects;
+        std::int64_t                __fcmStatsInterval; // msec between connection stats dumps.
+        TimerHandle_t               __fcmStatsTimer;
+        std::int64_t                __fcmOutputHighWatermark; // bytes; see FcmConnection.
+        std::int64_t                __fcmOutputLowWatermark;
+        QSsl::SslProtocol           __fcmTlsProtocol;   // min tls version; read from config.ini
+        QList<QSslCertificate>      __fcmTlsCaCertificates; // extra trusted CAs e.g of a test server.
+        TlsSessionCachePtr_t        __fcmTlsSessionCache;   // shared by the pool, null = off.
+        std::int64_t                __fcmShutdownTimeout;   // msec a connection waits for FCM's stream end.
+        KeepaliveMode               __fcmKeepaliveMode;
+        std::int64_t                __fcmPingInterval;      // msec; see KeepaliveTracker.
+        std::int64_t                __fcmIdleTimeout;
+        std::set<int>               __fcmShutdownPending;   // connections not closed yet.
+        bool                        __shutdownInProgress;
+        TimerHandle_t               __shutdownTimer;
+        DedupIndex                  __upstreamDedup;    // recent upstream fcm message ids.
+        std::map<int, StanzaEncoder> __fcmAckBatches;   // upstream acks per connection, sent on commit.
+        std::vector<std::string>    __fcmAckBatchIds;   // upstream dedup keys saved by the open transaction.
+        std::vector<std::function<void()>> __fcmBatchActions; // BAL forwards & ack state, run on commit.
+        bool                        __fcmBatchOpen;     // handleFcmEvents has a transaction open.
 
         BalSessionMap_t             __balSessionMap;    // sessionid --> Authenticated BAL map.
         SessionMapU                 __balSessionMapU;   // socket --> Unauthenticated BAL map.
         DbConnection                __dbConn;           // database connection handle.
 
+        // Retry stuff
+        RetryScheduler              __downstreamRetryScheduler;
+        RetryScheduler              __upstreamRetryScheduler;
+        TimerHandle_t               __retryTimer;       // single timer armed for the earliest retry.
+        std::int64_t                __retryTimerDue;
+        std::size_t                 __retryBatchSize;   // max retries fired per timeout.
+        std::int64_t                __downstreamAckTimeout; // msec to wait for a FCM ack/nack.
+        std::int64_t                __upstreamAckTimeout;   // msec to wait for a BAL ack.
+        std::int64_t                __ackCheckInterval;
+        TimerHandle_t               __ackCheckTimer;
+
         // Variables to help setup catchers for
         // SIGTERM & SIGHUP
         static int sigintFd[2];
@@ -62,8 +107,6 @@ class Application:public QObject
         // POSIX signal handlers.
         static void hupSignalHandler(int unused);
         static void termSignalHandler(int unused);
-    signals:
-        void sendMessage(const QJsonDocument& data);
     public slots:
         // Qt signal handlers.
         void handleSigInt();
@@ -76,9 +119,10 @@ class Application:public QObject
         void handleBALmsg(QTcpSocket* socket,
                           const QJsonDocument& json);
         // FCM handle slots
+        void handleFcmEvents(int id);
         void handleFcmNewUpstreamMessage(int id, const QJsonDocument& json);
-        void handleFcmAckMessage(int id, const QJsonDocument& json);
-        void handleFcmNackMessage(int id, const QJsonDocument& json);
+        void handleFcmAckMessage(int id, const FcmEnvelope& ack_msg, const QJsonDocument& json);
+        void handleFcmNackMessage(int id, const FcmEnvelope& nack_msg);
         void handleFcmReceiptMessage(int id, const QJsonDocument& json);
         void handleFcmConnectionStarted(int id);
         void handleFcmConnectionEstablished(int id);
@@ -91,11 +135,25 @@ class Application:public QObject
         void handleFcmStreamClosed(int id);
         void handleFcmHeartbeatRecieved(int id);
         void handleFcmConnectionDrainingStarted(int id);
+        void handleFcmConnectionDrainingCompleted(int id);
+        void handleFcmOutputBlocked(int id);
+        void handleFcmOutputDrained(int id);
+        void handleFcmSendFailed(int id, const QString& message_id);
     private:
         // FCM downstream stuff
-        void sendFcmAckMessage(const QJsonDocument& original_msg);
-        void sendNextPendingDownstreamMessage(const MessageManager& msgmanager);
-        void resendAllPendingDownstreamMessages();
+        void queueFcmAckMessage(int id, const QJsonDocument& original_msg);
+        void flushFcmAckMessages();
+        void discardFcmAckMessages();
+        void afterFcmCommit(const std::function<void()>& action);
+        void runFcmBatchActions();
+        void sendNextPendingDownstreamMessage(FcmProject& project);
+        void dispatchDownstreamMessage(FcmProject& project, MessagePtr_t& msg);
+        void holdDownstreamMessage(FcmProject& project, MessagePtr_t& msg);
+        void armHoldTimer(FcmProject& project, const std::string& to);
+        void handleHoldTimeout(FcmProject& project, const std::string& to);
+        void armSendRateTimer(FcmProject& project);
+        void handleSendRateTimeout(FcmProject& project);
+        void resendAllPendingDownstreamMessages(FcmProject& project);
 
         //BAL
         void handleBalAuthenticationTimeout(BALConnPtr_t sess);
@@ -103,7 +161,18 @@ class Application:public QObject
                                    const std::string& session_id);
         void handleBalDownstreamUploadRequest(const SessionId_t& sesion_id,
                                      const QJsonDocument& downstream_msg);
-        void notifyDownstreamUploadFailure(const MessagePtr_t& ptr);
+        void notifyDownstreamUploadFailure(FcmProject& project,
+                                           const MessagePtr_t& ptr,
+                                           const std::string& reason = "Max retry reached.");
+        void notifyDownstreamUploadFailure(const std::string& project_name,
+                                           const SessionId_t& fcm_session_id,
+                                           const MessagePtr_t& ptr,
+                                           const std::string& reason);
+        void dropExpiredDownstreamMessages(FcmProject& project,
+                                           const std::vector<MessagePtr_t>& expired);
+        void supersedeDownstreamMessage(FcmProject& project,
+                                        const MessagePtr_t& old_msg,
+                                        const MessagePtr_t& new_msg);
         void handleBalAckMsg(const SessionId_t& session_id,
                              const SequenceId_t& seqid);
 
@@ -112,22 +181,40 @@ class Application:public QObject
         void setupOsSignalCatcher();
         void readConfigFile();
         void setupTcpServer();
-
-        FcmConnectionPtr_t createFcmHandle();
+        void shutdown();
+        void finishShutdown();
+
+        FcmProjectPtr_t findFcmProject(int id);
+        FcmProjectPtr_t findFcmProject(const std::string& name);
+        FcmConnectionPtr_t createFcmHandle(const FcmProjectPtr_t& project);
+        FcmConnectionPtr_t openFcmConnection(const FcmProjectPtr_t& project);
+        void promoteFcmStandby(FcmProject& project);
         void setupFcmHandle(FcmConnectionPtr_t fcmconn);
-        void uploadToFcm(MessagePtr_t& msg);
+        void releaseFcmConnection(FcmProject& project, int id, std::vector<MessagePtr_t>& lost);
+        void requeueFcmMessages(FcmProject& project, std::vector<MessagePtr_t>& msgs);
+        void scheduleFcmStatsDump();
+        void printFcmStats();
+        bool uploadToFcm(FcmProject& project, MessagePtr_t& msg);
+        void releaseFcmSlot(FcmProject& project, const MessagePtr_t& msg, std::int64_t rtt_msec = -1);
         int  getNextFcmConnectionId(){ return ++__fcmConnCount;}
-        void retryDownstreamWithExponentialBackoff(MessagePtr_t& msg);
+        void retryDownstreamWithExponentialBackoff(FcmProject& project, MessagePtr_t& msg);
         void resendPendingUpstreamMessages(const BALSessionPtr_t& sess);
         void forwardMsgToBalsession(const std::string& session_id,
                                     const MessagePtr_t& msg);
         void forwardMsg(const std::string& session_id, const MessagePtr_t& msg);
+        void dispatchUpstreamMessage(MessageManager& msgmanager, const MessagePtr_t& msg);
 
         void retryUpstreamWithExponentialBackoff(MessagePtr_t& msg);
+        void armRetryTimer();
+        void handleRetryTimeout();
+        void scheduleAckTimeoutCheck();
+        void handleAckTimeoutCheck();
+        MessagePtr_t findUpstreamMessage(const SequenceId_t& seqid);
+        MessagePtr_t findDownstreamMessage(const SequenceId_t& seqid, FcmProjectPtr_t& project);
 
         BALSessionPtr_t findBalSession(const SessionId_t& session_id);
         MessageManager& findBalMessageManager(const SessionId_t& bal_session_id);
-        void            sendNextPendingUpstreamMessage(const MessageManager& msgmanager);
+        void            sendNextPendingUpstreamMessage(MessageManager& msgmanager);
         std::string     getPeerDetail(const QTcpSocket* socket);
         void            printProperties();
 };
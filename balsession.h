@@ -2,6 +2,7 @@
 #define BALSESSION_H
 
 #include "messagemanager.h"
+#include "timingwheel.h"
 
 #include <QObject>
 
@@ -27,19 +28,18 @@ class QJsonDocument;
 class BALConn
 {
         QTcpSocket*       __socket;
-        QObject*          __timeoutContext;
+        TimerHandle_t     __timeoutHandle; // logon timeout.
     public:
-        BALConn(QTcpSocket* socket) :__socket(socket), __timeoutContext(new QObject())
+        BALConn(QTcpSocket* socket) :__socket(socket), __timeoutHandle(INVALID_TIMER_HANDLE)
         { std::cout << "New BALCONN created. this:" << this << ", socket:" << __socket->socketDescriptor() << std::endl;}
         ~BALConn()
         {
             std::cout << "DESTROYED BALCONN, this:" << this << ", socket:" << __socket->socketDescriptor() <<  std::endl;
-            if (__timeoutContext){ delete __timeoutContext; __timeoutContext = NULL;}
             if (__socket) __socket->deleteLater();
         }
-        QObject*            getTimerContext() const { return __timeoutContext;}
+        TimerHandle_t       getTimeoutHandle() const { return __timeoutHandle;}
         QTcpSocket*         getSocket() const { return __socket;}
-        void                deleteTimerContext(){ delete __timeoutContext; __timeoutContext = NULL;}
+        void                setTimeoutHandle(TimerHandle_t handle) { __timeoutHandle = handle;}
 };
 
 /*!
@@ -0,0 +1,111 @@
+#include "congestionwindow.h"
+
+#include <algorithm>
+
+
+/*!
+ * \brief CongestionWindow::CongestionWindow
+ * \param initial_window
+ * \param max_window        hard cap, at most FCM's pending message limit.
+ */
+CongestionWindow::CongestionWindow(std::int64_t initial_window,
+                                   std::int64_t max_window)
+    :__maxWindow(std::max<std::int64_t>(max_window, MIN_CONGESTION_WINDOW))
+{
+    reset(initial_window);
+}
+
+
+/*!
+ * \brief CongestionWindow::reset
+ * Starts over in slow start, e.g on a new connection; nothing measured on the
+ * old one says anything about the new path.
+ * \param initial_window
+ */
+void CongestionWindow::reset(std::int64_t initial_window)
+{
+    __cwnd          = (double)std::min(std::max<std::int64_t>(initial_window, MIN_CONGESTION_WINDOW),
+                                       __maxWindow);
+    __ssthresh      = (double)__maxWindow;
+    __minRtt        = 0;
+    __srtt          = 0;
+    __sinceBackoff  = __maxWindow;
+    __backoffs      = 0;
+}
+
+
+/*!
+ * \brief CongestionWindow::isRttRising
+ * \return true if the smoothed rtt is well above the lowest one seen.
+ */
+bool CongestionWindow::isRttRising() const
+{
+    return __minRtt > 0 &&
+           __srtt > __minRtt * RTT_TOLERANCE &&
+           __srtt - __minRtt > RTT_SLACK_MSEC;
+}
+
+
+/*!
+ * \brief CongestionWindow::onAck
+ * \param rtt_msec time from send to ack.
+ */
+void CongestionWindow::onAck(std::int64_t rtt_msec)
+{
+    __sinceBackoff++;
+    if (rtt_msec >= 0)
+    {
+        double rtt = (double)std::max<std::int64_t>(rtt_msec, 1);
+        if (__srtt == 0)
+            __srtt = rtt;
+        else
+            __srtt += RTT_EWMA_WEIGHT * (rtt - __srtt);
+        if (__minRtt == 0 || rtt < __minRtt)
+            __minRtt = rtt;
+    }
+
+    if (isRttRising())
+    {
+        if (size() > MIN_CONGESTION_WINDOW)
+        {
+            // hold the window while the last back off takes effect.
+            backoff(RTT_BACKOFF);
+            return;
+        }
+        // a single message in flight can't queue up; the path got slower.
+        __minRtt = __srtt;
+    }
+
+    if (__cwnd < __ssthresh)
+        __cwnd += 1;
+    else
+        __cwnd += 1 / __cwnd;
+    __cwnd = std::min(__cwnd, (double)__maxWindow);
+}
+
+
+/*!
+ * \brief CongestionWindow::onThrottled
+ * A nack telling us to slow down or an ack that never came.
+ */
+void CongestionWindow::onThrottled()
+{
+    __sinceBackoff++;
+    backoff(THROTTLE_BACKOFF);
+}
+
+
+/*!
+ * \brief CongestionWindow::backoff
+ * \param factor share of the window to keep.
+ */
+void CongestionWindow::backoff(double factor)
+{
+    if (__sinceBackoff < size())
+        return;
+
+    __ssthresh      = std::max(__cwnd * factor, (double)MIN_CONGESTION_WINDOW);
+    __cwnd          = __ssthresh;
+    __sinceBackoff  = 0;
+    __backoffs++;
+}
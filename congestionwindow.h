@@ -0,0 +1,58 @@
+#ifndef CONGESTIONWINDOW_H
+#define CONGESTIONWINDOW_H
+
+#include <cstdint>
+
+
+#define DEFAULT_INITIAL_WINDOW      10
+#define DEFAULT_MAX_WINDOW          100     // FCM's pending message limit per connection.
+#define MIN_CONGESTION_WINDOW       1
+#define RTT_EWMA_WEIGHT             0.125
+#define THROTTLE_BACKOFF            0.5     // window kept on a throttling nack/lost ack.
+#define RTT_BACKOFF                 0.8     // window kept when the ack rtt climbs.
+#define RTT_TOLERANCE               2.0     // smoothed rtt over this x min rtt counts as rising...
+#define RTT_SLACK_MSEC              50      // ...if it is also this much above it.
+
+
+/*!
+ * \brief The CongestionWindow class
+ * AIMD send window of one FCM connection. Each ack grows the window, by one
+ * per ack while below the slow start threshold and by one per window's worth
+ * of acks above it. A throttling nack (or an ack that never came) halves it,
+ * a smoothed ack rtt well above the lowest one seen shrinks it a little; FCM
+ * queueing our messages is the earliest sign that we send too fast.
+ *
+ * The window never leaves [MIN_CONGESTION_WINDOW, max] where max is at most
+ * FCM's own pending message limit. It backs off at most once per window's worth of
+ * completions, so the burst of nacks for one overload counts once.
+ */
+class CongestionWindow
+{
+        double          __cwnd;
+        double          __ssthresh;
+        std::int64_t    __maxWindow;
+        double          __minRtt;       // msec, 0 until measured.
+        double          __srtt;         // msec, 0 until measured.
+        std::int64_t    __sinceBackoff; // completions since the last back off.
+        std::uint64_t   __backoffs;
+    public:
+        CongestionWindow(std::int64_t initial_window = DEFAULT_INITIAL_WINDOW,
+                         std::int64_t max_window = DEFAULT_MAX_WINDOW);
+
+        //getters
+        std::int64_t    size() const { return (std::int64_t)__cwnd;}
+        std::int64_t    getMaxWindow() const { return __maxWindow;}
+        double          getSlowStartThreshold() const { return __ssthresh;}
+        double          getMinRtt() const { return __minRtt;}
+        double          getSmoothedRtt() const { return __srtt;}
+        std::uint64_t   getBackoffs() const { return __backoffs;}
+        bool            isRttRising() const;
+
+        void            reset(std::int64_t initial_window);
+        void            onAck(std::int64_t rtt_msec);
+        void            onThrottled();
+    private:
+        void            backoff(double factor);
+};
+
+#endif // CONGESTIONWINDOW_H
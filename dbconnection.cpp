@@ -1,6 +1,7 @@
 #include "dbconnection.h"
 #include "messagemanager.h"
 
+#include <set>
 #include <sstream>
 
 /*!
@@ -28,6 +29,52 @@ static int set_sequenceid_callback(void* notused, int argc, char** argv, char**
 }
 
 
+/*!
+ * \brief load_recent_ids_callback
+ * \param ids
+ * \param argc
+ * \param argv
+ * \param colnames
+ * \return
+ */
+static int load_recent_ids_callback(void* ids, int argc, char** argv, char** colnames )
+{
+    if ( argc != 4 || argv[0] == NULL || argv[1] == NULL || argv[2] == NULL) return 0;
+
+    RecentUpstreamId id;
+    std::stringstream r;
+    r << (argv[3] ? argv[3] : "0");
+    r >> id.ageSec;
+
+    // the sender is only in the stored fcm message.
+    QJsonDocument payload = QJsonDocument::fromJson(QByteArray(argv[1]));
+    id.project   = argv[0];
+    id.from      = payload.object().value(gimmmfieldnames::FCM_DATA).toObject()
+                          .value(fcmfieldnames::FROM).toString().toStdString();
+    id.messageId = argv[2];
+    ((RecentIds_t*)ids)->push_back(id);
+    return 0;
+}
+
+
+/*!
+ * \brief table_columns_callback
+ * \param columns   set the column names of a 'PRAGMA table_info' go to.
+ * \param argc
+ * \param argv
+ * \param colnames
+ * \return
+ */
+static int table_columns_callback(void* columns, int argc, char** argv, char** colnames )
+{
+    // cid, name, type, notnull, dflt_value, pk
+    if ( argc < 2 || argv[1] == NULL) return 0;
+
+    ((std::set<std::string>*)columns)->insert(argv[1]);
+    return 0;
+}
+
+
 /*!
  * \brief load_pending_messages_callback
  * \param mmanager
@@ -98,6 +145,7 @@ static int load_pending_messages_callback(
             case 6:
             {
                 std::string gid = argv[colno]? argv[colno]: "";
+                msg->setGroupId(gid);
                 break;
             }
             case 7:
@@ -123,6 +171,25 @@ static int load_pending_messages_callback(
                 QJsonDocument json = QJsonDocument::fromJson(array);
                 PayloadPtr_t pay(new QJsonDocument(json));
                 msg->setPayload(pay);
+                if (msg->getType() == MessageType::DOWNSTREAM)
+                {
+                    msg->setTo(Message::toFromPayload(json.object()));
+                    msg->setCollapseKey(Message::collapseKeyFromPayload(json.object()));
+                }
+                break;
+            }
+            case 10:
+            {
+                // NULL for rows saved before expiry tracking existed.
+                if (argv[colno] == NULL) break;
+
+                std::stringstream r;
+                r << argv[colno];
+
+                std::int64_t expires_at;
+                r >> expires_at;
+
+                msg->setExpiresAt(expires_at);
                 break;
             }
             default:
@@ -144,11 +211,13 @@ static int load_pending_messages_callback(
  *      Read and initialize
  */
 DbConnection::DbConnection()
+    :__txDepth(0)
 {
     try
     {
         createDb();
         createTables();
+        migrateTables();
         createIndex();
         prepareStatements();
         initSequenceId();
@@ -206,7 +275,8 @@ void DbConnection::createTables()
          << "group_id           TEXT, "
          << "state              INTEGER NOT NULL, "
          << "last_update        TEXT DEFAULT (datetime('now')), "
-         << "payload            TEXT NOT NULL)";
+         << "payload            TEXT NOT NULL, "
+         << "expires_at         INTEGER)";
 
     char* errmsg;
     int rc = sqlite3_exec(__dbhandle, stmt.str().c_str(), NULL, NULL, &errmsg);
@@ -221,13 +291,51 @@ void DbConnection::createTables()
 }
 
 
+/*!
+ * \brief DbConnection::migrateTables
+ * Brings a 'messages' table created by an older version up to date. Columns
+ * are only ever appended so that 'SELECT *' keeps the column order.
+ */
+void DbConnection::migrateTables()
+{
+    std::set<std::string> columns;
+    char* errmsg = NULL;
+    int rc = sqlite3_exec(__dbhandle,
+                          "PRAGMA table_info(messages)",
+                          table_columns_callback, &columns, &errmsg);
+    if ( rc != SQLITE_OK)
+    {
+        std::stringstream err;
+        err << "Cannot read the columns of table messages. Error["
+                  << (errmsg ? errmsg : "") << "]";
+        sqlite3_free(errmsg);
+        THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+    }
+    if (columns.count("expires_at") != 0)
+        return;
+
+    rc = sqlite3_exec(__dbhandle,
+                      "ALTER TABLE messages ADD COLUMN expires_at INTEGER",
+                      NULL, NULL, &errmsg);
+    if ( rc != SQLITE_OK)
+    {
+        std::stringstream err;
+        err << "Cannot add column expires_at to table messages. Error["
+                  << (errmsg ? errmsg : "") << "]";
+        sqlite3_free(errmsg);
+        THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+    }
+    std::cout << "Added column 'expires_at' to table 'messages'." << std::endl;
+}
+
+
 /*!
  * \brief DbConnection::createIndex
  */
 void DbConnection::createIndex()
 {
     std::cout << "Creating index on table 'messages'..." << std::endl;
-    std::stringstream stmt1, stmt2;
+    std::stringstream stmt1, stmt2, stmt3;
     char* errmsg;
     int rc = SQLITE_OK;
 
@@ -253,6 +361,18 @@ void DbConnection::createIndex()
         THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
     }
 
+    // upstream dedup index rebuild at startup.
+    stmt3 << "CREATE INDEX IF NOT EXISTS idx_type_entered ON messages ( type, entered_datetime)";
+    rc = sqlite3_exec(__dbhandle, stmt3.str().c_str(), NULL, NULL, &errmsg);
+    if ( rc != SQLITE_OK)
+    {
+        std::stringstream err;
+        err << "Cannot create index idx_type_entered on messages. Error["
+                  << errmsg << "]";
+        sqlite3_free(errmsg);
+        THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+    }
+
 }
 
 
@@ -263,8 +383,8 @@ void DbConnection::prepareStatements()
 {
     std::stringstream insertsql;
     insertsql << "INSERT INTO messages (sequence_id, source_session, "
-              << "target_session, type, fcm_message_id, group_id, state, payload) "
-              <<  "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);";
+              << "target_session, type, fcm_message_id, group_id, state, payload, expires_at) "
+              <<  "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9);";
 
     std::cout << "insertsql:" << insertsql.str() << std::endl;
 
@@ -328,6 +448,11 @@ void DbConnection::saveMsg(const Message &msg)
     // as a binary encoded message.
     //sqlite3_bind_text ( __insertStmt, 8, msg.getPayload()->toBinaryData(), -1, SQLITE_TRANSIENT);
 
+    if (msg.getExpiresAt() != NO_EXPIRY)
+        sqlite3_bind_int64( __insertStmt, 9, msg.getExpiresAt());
+    else
+        sqlite3_bind_null ( __insertStmt, 9);
+
     int rc = sqlite3_step(__insertStmt);
     if ( rc != SQLITE_DONE)
     {
@@ -413,6 +538,122 @@ void DbConnection::loadPendingMessages(MessageManager& msgmanager)
 }
 
 
+/*!
+ * \brief DbConnection::loadRecentUpstreamIds
+ * Project, sender and FCM message id of the upstream messages received
+ * within the last 'window_sec', the newest 'max_ids' of them, oldest first.
+ * \param window_sec
+ * \param max_ids
+ * \param out
+ */
+void DbConnection::loadRecentUpstreamIds(std::int64_t window_sec, std::size_t max_ids, RecentIds_t& out)
+{
+    std::stringstream stmt;
+    stmt << "SELECT source_session, payload, fcm_message_id, "
+         << "strftime('%s', 'now') - strftime('%s', entered_datetime) FROM ("
+         << "SELECT sequence_id, source_session, payload, fcm_message_id, entered_datetime FROM messages "
+         << "WHERE type = " << (int)MessageType::UPSTREAM
+         << " AND entered_datetime >= datetime('now', '-" << window_sec << " seconds') "
+         << "ORDER BY sequence_id DESC LIMIT " << max_ids
+         << ") ORDER BY sequence_id ASC";
+
+    char* errmsg;
+    int rc = sqlite3_exec(__dbhandle, stmt.str().c_str(),
+                          load_recent_ids_callback, &out,
+                          &errmsg );
+    if ( rc != SQLITE_OK)
+    {
+        std::cout << errmsg << std::endl;
+    }
+    sqlite3_free(errmsg);
+}
+
+
+/*!
+ * \brief DbConnection::beginTransaction
+ * Groups the writes that follow into one transaction (one fsync) until
+ * 'commitTransaction' or 'rollbackTransaction' is called. Calls nest; an
+ * inner one is a savepoint of the outer transaction.
+ */
+void DbConnection::beginTransaction()
+{
+    if (__txDepth == 0)
+    {
+        execute("BEGIN TRANSACTION");
+    }
+    else
+    {
+        std::string sql = "SAVEPOINT sp" + std::to_string(__txDepth);
+        execute(sql.c_str());
+    }
+    __txDepth++;
+}
+
+
+/*!
+ * \brief DbConnection::commitTransaction
+ * Only the outermost commit writes to disk.
+ */
+void DbConnection::commitTransaction()
+{
+    if (__txDepth <= 1)
+    {
+        execute("COMMIT TRANSACTION");
+        __txDepth = 0;
+        return;
+    }
+    std::string sql = "RELEASE sp" + std::to_string(__txDepth - 1);
+    execute(sql.c_str());
+    __txDepth--;
+}
+
+
+/*!
+ * \brief DbConnection::rollbackTransaction
+ * Undoes the innermost open transaction/savepoint. Called from error paths,
+ * so it only logs on failure.
+ */
+void DbConnection::rollbackTransaction()
+{
+    try
+    {
+        if (__txDepth <= 1)
+        {
+            __txDepth = 0;
+            execute("ROLLBACK TRANSACTION");
+            return;
+        }
+        __txDepth--;
+        std::string sp = "sp" + std::to_string(__txDepth);
+        execute(("ROLLBACK TO " + sp).c_str());
+        execute(("RELEASE " + sp).c_str());
+    }
+    catch (std::exception& err)
+    {
+        PRINT_EXCEPTION_STRING(std::cout, err);
+    }
+}
+
+
+/*!
+ * \brief DbConnection::execute
+ * \param sql
+ */
+void DbConnection::execute(const char* sql)
+{
+    char* errmsg = NULL;
+    int rc = sqlite3_exec(__dbhandle, sql, NULL, NULL, &errmsg);
+    if ( rc != SQLITE_OK)
+    {
+        std::stringstream err;
+        err << "Executing [" << sql << "] failed. Error["
+            << (errmsg ? errmsg : "") << "]";
+        sqlite3_free(errmsg);
+        THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+    }
+}
+
+
 /*!
  * \brief DbConnection::getNextSequenceId
  * \return
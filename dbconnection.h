@@ -4,14 +4,32 @@
 #include "message.h"
 #include "sqlite/sqlite3.h"
 
+#include <string>
+#include <utility>
+#include <vector>
+
 class MessageManager;
 
+/*!
+ * \brief The RecentUpstreamId struct
+ * What identifies a stored upstream message for duplicate detection.
+ */
+struct RecentUpstreamId
+{
+    std::string     project;    // source session i.e the project's queue.
+    std::string     from;
+    std::string     messageId;
+    std::int64_t    ageSec;
+};
+typedef std::vector<RecentUpstreamId> RecentIds_t;
+
 class DbConnection
 {
         SequenceId_t __sequenceId;
         sqlite3* __dbhandle;
         sqlite3_stmt* __insertStmt;
         sqlite3_stmt* __updateStmt;
+        int __txDepth;      // nested 'beginTransaction' calls open.
     public:
         DbConnection();
         ~DbConnection();
@@ -19,9 +37,15 @@ class DbConnection
         void saveMsg(const Message& msg);
         void updateMsgState(const Message& msg, MessageState new_state);
         void loadPendingMessages(MessageManager& msgmanager);
+        void loadRecentUpstreamIds(std::int64_t window_sec, std::size_t max_ids, RecentIds_t& out);
+        void beginTransaction();
+        void commitTransaction();
+        void rollbackTransaction();
     private:
         void createDb();
         void createTables();
+        void migrateTables();
+        void execute(const char* sql);
         void createIndex();
         void readDb();
         void initSequenceId();
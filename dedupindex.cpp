@@ -0,0 +1,141 @@
+#include "dedupindex.h"
+
+
+/*!
+ * \brief DedupIndex::DedupIndex
+ * \param capacity      max # of ids kept, 0 turns it off.
+ * \param window_msec   how long an id is remembered.
+ */
+DedupIndex::DedupIndex(std::size_t capacity, std::int64_t window_msec)
+    :__capacity(capacity),
+     __window(window_msec),
+     __duplicates(0),
+     __evictions(0)
+{
+}
+
+
+/*!
+ * \brief DedupIndex::setCapacity
+ * \param capacity
+ */
+void DedupIndex::setCapacity(std::size_t capacity)
+{
+    __capacity = capacity;
+    evict();
+}
+
+
+/*!
+ * \brief DedupIndex::isDuplicate
+ * \param id
+ * \param now
+ * \return true if 'id' was seen within the window. A duplicate starts the
+ *         window over; FCM keeps redelivering until it gets our ack.
+ */
+bool DedupIndex::isDuplicate(const std::string& id, std::int64_t now)
+{
+    expire(now);
+    auto it = __entries.find(id);
+    if (it == __entries.end())
+        return false;
+
+    __duplicates++;
+    it->second.seenAt = now;
+    __lru.splice(__lru.begin(), __lru, it->second.lru);
+    return true;
+}
+
+
+/*!
+ * \brief DedupIndex::insert
+ * \param id
+ * \param seen_at   normally 'now'; older when rebuilt from the store. Ids
+ *                  must be inserted oldest first.
+ */
+void DedupIndex::insert(const std::string& id, std::int64_t seen_at)
+{
+    if (__capacity == 0 || id.empty())
+        return;
+
+    auto it = __entries.find(id);
+    if (it != __entries.end())
+    {
+        it->second.seenAt = seen_at;
+        __lru.splice(__lru.begin(), __lru, it->second.lru);
+        return;
+    }
+
+    __lru.push_front(id);
+    Entry entry;
+    entry.seenAt    = seen_at;
+    entry.lru       = __lru.begin();
+    __entries.emplace(id, entry);
+    evict();
+}
+
+
+/*!
+ * \brief DedupIndex::remove
+ * Forgets 'id' e.g when the row recording it was rolled back.
+ * \param id
+ */
+void DedupIndex::remove(const std::string& id)
+{
+    auto it = __entries.find(id);
+    if (it == __entries.end())
+        return;
+    __lru.erase(it->second.lru);
+    __entries.erase(it);
+}
+
+
+/*!
+ * \brief DedupIndex::expire
+ * Drops the ids seen before the window.
+ * \param now
+ */
+void DedupIndex::expire(std::int64_t now)
+{
+    while (!__lru.empty())
+    {
+        auto it = __entries.find(__lru.back());
+        if (now - it->second.seenAt < __window)
+            break;
+        __entries.erase(it);
+        __lru.pop_back();
+    }
+}
+
+
+/*!
+ * \brief DedupIndex::evict
+ * Drops the least recently seen ids over capacity.
+ */
+void DedupIndex::evict()
+{
+    while (__entries.size() > __capacity)
+    {
+        __entries.erase(__lru.back());
+        __lru.pop_back();
+        __evictions++;
+    }
+}
+
+
+/*!
+ * \brief DedupIndex::upstreamKey
+ * \param project       queue session id of the project the message came in on.
+ * \param from          sender (device) of the message.
+ * \param message_id
+ * \return empty if there is no 'message_id'; such messages aren't tracked.
+ */
+std::string DedupIndex::upstreamKey(const std::string& project,
+                                    const std::string& from,
+                                    const std::string& message_id)
+{
+    if (message_id.empty())
+        return std::string();
+    // ascii unit separator; none of the parts contain it.
+    return project + '\x1f' + from + '\x1f' + message_id;
+}
@@ -0,0 +1,66 @@
+#ifndef DEDUPINDEX_H
+#define DEDUPINDEX_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+
+#define DEFAULT_DEDUP_ENTRIES       100000
+#define DEFAULT_DEDUP_WINDOW        86400   // sec
+
+
+/*!
+ * \brief The DedupIndex class
+ * Ids seen within the last 'window' msec, at most 'capacity' of them. Used
+ * to recognize the upstream messages FCM redelivers because our ack didn't
+ * make it back on the original connection. FCM message ids are only unique
+ * per sender, so upstream ids are keyed with 'upstreamKey'.
+ *
+ * Entries are kept in insertion order, so both the expired and the least
+ * recently seen ones are dropped off the tail. Times are in msec on any
+ * monotonic clock.
+ */
+class DedupIndex
+{
+        struct Entry
+        {
+            std::int64_t                        seenAt;
+            std::list<std::string>::iterator    lru;
+        };
+
+        std::size_t                             __capacity;
+        std::int64_t                            __window;   // msec
+        std::unordered_map<std::string, Entry>  __entries;
+        std::list<std::string>                  __lru;      // newest first.
+        std::uint64_t                           __duplicates;
+        std::uint64_t                           __evictions;
+    public:
+        DedupIndex(std::size_t capacity = DEFAULT_DEDUP_ENTRIES,
+                   std::int64_t window_msec = DEFAULT_DEDUP_WINDOW * 1000);
+
+        //setters
+        void            setCapacity(std::size_t capacity);
+        void            setWindow(std::int64_t msec) { __window = msec;}
+
+        //getters
+        std::size_t     getCapacity() const { return __capacity;}
+        std::int64_t    getWindow() const { return __window;}
+        std::size_t     size() const { return __entries.size();}
+        std::uint64_t   getDuplicates() const { return __duplicates;}
+        std::uint64_t   getEvictions() const { return __evictions;}
+
+        bool            isDuplicate(const std::string& id, std::int64_t now);
+        void            insert(const std::string& id, std::int64_t seen_at);
+        void            remove(const std::string& id);
+        void            expire(std::int64_t now);
+
+        static std::string upstreamKey(const std::string& project,
+                                       const std::string& from,
+                                       const std::string& message_id);
+    private:
+        void            evict();
+};
+
+#endif // DEDUPINDEX_H
@@ -2,45 +2,141 @@
 #include "macros.h"
 #include "message.h"
 
-#include <thread>
-#include <chrono>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 
-#include <QTimer>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QThread>
+#include <QDateTime>
+#include <QSslConfiguration>
 
 
 /*!
  * \brief FcmConnection::FcmConnection
+ * The socket and the timers are children so that they follow the connection
+ * to its thread.
  */
 FcmConnection::FcmConnection(int id)
-    :__state(FcmSessionState::UNKNOWN),
+    :__fcmSocket(this),
+     __state(FcmSessionState::UNKNOWN),
      __expBoff(),
      __connectionDrainingInProgress(false),
-     __id(id)
+     __id(id),
+     __timers(DEFAULT_TIMER_TICK_MSEC, this),
+     __flushScheduled(false),
+     __eventsWakePending(false),
+     __outputHighWatermark(DEFAULT_OUTPUT_HIGH_WATERMARK),
+     __outputLowWatermark(DEFAULT_OUTPUT_LOW_WATERMARK),
+     __outputBlocked(false),
+     __handshakeState(FcmHandshakeState::DISCONNECTED),
+     __establishedAt(0),
+     __tlsProtocol(QSsl::TlsV1_2OrLater),
+     __tlsTicketOffered(false),
+     __shutdownInProgress(false),
+     __shutdownCompleted(false),
+     __shutdownTimer(INVALID_TIMER_HANDLE),
+     __keepaliveMode(KeepaliveMode::XMPP_PING),
+     __keepaliveTimer(INVALID_TIMER_HANDLE),
+     __pingCount(0)
 {
 
 }
 
 
+/*!
+ * \brief FcmConnection::create
+ * Creates connection 'id' and moves it to a new worker thread. Releasing the
+ * last reference stops the thread; the connection is destroyed on its own
+ * thread once the event loop has exited.
+ * \param id
+ * \return
+ */
+FcmConnectionPtr_t FcmConnection::create(int id)
+{
+    QThread* thread = new QThread();
+    thread->setObjectName(QString("fcm-%1").arg(id));
+
+    FcmConnection* conn = new FcmConnection(id);
+    conn->moveToThread(thread);
+    QObject::connect(thread, &QThread::finished, conn, &QObject::deleteLater);
+    thread->start();
+
+    return FcmConnectionPtr_t(conn, [thread](FcmConnection*)
+    {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    });
+}
+
+
 /*!
  * \brief FcmConnection::~FcmConnection
+ * Never blocks. A connection that wasn't 'shutdown' first is simply aborted.
  */
 FcmConnection::~FcmConnection()
 {
+    cancelPendingSteps();
+    __timers.cancel(__shutdownTimer);
+    __timers.cancel(__keepaliveTimer);
+    blockSignals(true);
+    __fcmSocket.abort();
+    blockSignals(false);
+}
+
+
+/*!
+ * \brief FcmConnection::shutdown
+ * Closes the stream without blocking the connection thread: whatever is
+ * queued for sending (acks included) goes out first, followed by the stream
+ * end. The socket is closed once FCM closes its side of the stream or after
+ * 'timeout_msec', whichever comes first. 'connectionShutdownCompleted' is
+ * emitted exactly once either way; no reconnect follows.
+ * \param timeout_msec
+ */
+void FcmConnection::shutdown(qint64 timeout_msec)
+{
+    if (__shutdownInProgress)
+        return;
+
+    __shutdownInProgress = true;
+    cancelPendingSteps();
+    __timers.cancel(__keepaliveTimer);
     emit connectionShutdownStarted(__id);
-    if (__fcmSocket.state() == QAbstractSocket::ConnectedState)
+    // no stream to close yet.
+    if (__fcmSocket.state() != QAbstractSocket::ConnectedState ||
+            __handshakeState == FcmHandshakeState::CONNECTING)
     {
-        //Socket still open. Send STREAM END before closing connection to FCM.
-        QByteArray arr("</stream:stream>");
-        __fcmSocket.write(arr);
-        std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_TIME_BEFORE_DISCONNECT));
-        blockSignals(true);
-        __fcmSocket.close();
-        blockSignals(false);
+        __fcmSocket.abort();
+        completeShutdown();
+        return;
     }
+
+    flushSendQueue();
+    __state = FcmSessionState::UNKNOWN;
+    __fcmSocket.write("</stream:stream>");
+    __shutdownTimer = __timers.schedule(timeout_msec, [this]{
+        __shutdownTimer = INVALID_TIMER_HANDLE;
+        emit connectionError(__id, "No stream end from FCM before the shutdown deadline. Aborting.");
+        __fcmSocket.abort();
+        completeShutdown();
+    });
+}
+
+
+/*!
+ * \brief FcmConnection::completeShutdown
+ */
+void FcmConnection::completeShutdown()
+{
+    if (__shutdownCompleted)
+        return;
+
+    __shutdownCompleted = true;
+    __timers.cancel(__shutdownTimer);
+    __handshakeState = FcmHandshakeState::DISCONNECTED;
     emit connectionShutdownCompleted(__id);
 }
 
@@ -63,9 +159,12 @@ void FcmConnection::connectToFcm(
     __fcmHostAddress    = host;
     __fcmPortNo         = port_no;
 
-    //fcm handle
-    __fcmSocket.setProtocol(QSsl::TlsV1_0);
+    //fcm handle. The tls configuration is (re)applied by every connect.
     connect(&__fcmSocket, SIGNAL(encrypted()), this, SLOT(socketEncrypted()), Qt::DirectConnection);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    // TLS 1.3 servers hand the ticket out after the handshake.
+    connect(&__fcmSocket, SIGNAL(newSessionTicketReceived()), this, SLOT(storeTlsSession()), Qt::DirectConnection);
+#endif
     connect(&__fcmSocket, SIGNAL(disconnected()), this, SLOT(handleDisconnected()), Qt::DirectConnection);
     //connect and print errors for debug. 'handleDisconnected' will be called eventually.
     connect(&__fcmSocket, static_cast<void(QSslSocket::*)(const QList<QSslError> &)>(&QSslSocket::sslErrors),
@@ -76,6 +175,10 @@ void FcmConnection::connectToFcm(
             emit connectionError(__id, i.errorString());
         }
     });
+    connect(&__fcmSocket, &QSslSocket::bytesWritten, this, [this](qint64 bytes){
+        __stats.bytesSent += bytes;
+        updateOutputBackpressure();
+    });
     __fcmWriter.setDevice(&__fcmSocket);
     connectToFirebase();
 }
@@ -87,32 +190,183 @@ void FcmConnection::connectToFcm(
 void FcmConnection::connectToFirebase()
 {
     //std::cout << "Connecting to FCM server..." << std::endl;
+    __handshakeState = FcmHandshakeState::CONNECTING;
+    __handshakeClock.start();
     emit connectionStarted(__id);
+    prepareTls();
     __fcmSocket.connectToHostEncrypted(__fcmHostAddress, __fcmPortNo);
 }
 
 
+/*!
+ * \brief FcmConnection::prepareTls
+ * Applies the tls policy to the socket and offers the pool's newest session
+ * ticket for this server, if there is one.
+ */
+void FcmConnection::prepareTls()
+{
+    QSslConfiguration config = __fcmSocket.sslConfiguration();
+    config.setProtocol(__tlsProtocol);
+    if (!__tlsCaCertificates.isEmpty())
+    {
+        QList<QSslCertificate> ca_certs = QSslConfiguration::defaultConfiguration().caCertificates();
+        ca_certs.append(__tlsCaCertificates);
+        config.setCaCertificates(ca_certs);
+    }
+
+    __tlsTicketOffered = applyTlsSession(config, __tlsSessionCache, tlsServerKey(),
+                                         QDateTime::currentMSecsSinceEpoch());
+    __fcmSocket.setSslConfiguration(config);
+
+    __stats.lastTlsTicketOffered = __tlsTicketOffered;
+    if (__tlsTicketOffered)
+        __stats.tlsTicketsOffered++;
+}
+
+
+/*!
+ * \brief FcmConnection::storeTlsSession
+ * Shares the session of this connection with the rest of the pool.
+ */
+void FcmConnection::storeTlsSession()
+{
+    saveTlsSession(__fcmSocket.sslConfiguration(), __tlsSessionCache, tlsServerKey(),
+                   QDateTime::currentMSecsSinceEpoch());
+}
+
+
+/*!
+ * \brief FcmConnection::applyTlsSession
+ * Sets 'config' up for the next handshake with 'server': offers the pool's
+ * ticket, if there is one, and keeps the new session for the pool.
+ * \param config
+ * \param cache   null = no resumption.
+ * \param server  see TlsSessionCache::serverKey.
+ * \param now_msec
+ * \return true if a ticket is offered.
+ */
+bool FcmConnection::applyTlsSession(
+        QSslConfiguration& config,
+        const TlsSessionCachePtr_t& cache,
+        const std::string& server,
+        std::int64_t now_msec)
+{
+    // the session has to outlive the handshake to be handed to the pool.
+    bool resume = cache != nullptr;
+    config.setSslOption(QSsl::SslOptionDisableSessionTickets, !resume);
+    config.setSslOption(QSsl::SslOptionDisableSessionPersistence, !resume);
+    QByteArray ticket;
+    if (resume)
+        ticket = cache->find(server, now_msec);
+    // replaces whatever the socket kept from its previous session.
+    config.setSessionTicket(ticket);
+    return !ticket.isEmpty();
+}
+
+
+/*!
+ * \brief FcmConnection::saveTlsSession
+ * \param config  of a socket whose handshake just completed.
+ * \param cache   null = no resumption.
+ * \param server  see TlsSessionCache::serverKey.
+ * \param now_msec
+ */
+void FcmConnection::saveTlsSession(
+        const QSslConfiguration& config,
+        const TlsSessionCachePtr_t& cache,
+        const std::string& server,
+        std::int64_t now_msec)
+{
+    if (cache == nullptr)
+        return;
+
+    cache->store(server,
+                 config.sessionTicket(),
+                 config.sessionTicketLifeTimeHint(),
+                 now_msec);
+}
+
+
+/*!
+ * \brief FcmConnection::tlsServerKey
+ * \return the session cache key of the server this connection talks to.
+ */
+std::string FcmConnection::tlsServerKey() const
+{
+    return TlsSessionCache::serverKey(__fcmHostAddress.toStdString(), __fcmPortNo);
+}
+
+
+/*!
+ * \brief FcmConnection::scheduleStep
+ * Runs 'step' on this connection after 'delay_msec'. Pending steps are
+ * cancelled when the connection is destroyed.
+ * \param delay_msec
+ * \param step
+ */
+void FcmConnection::scheduleStep(std::int64_t delay_msec, void (FcmConnection::*step)())
+{
+    // forget the ones that already fired.
+    __pendingTimers.erase(std::remove_if(__pendingTimers.begin(), __pendingTimers.end(),
+                                         [this](TimerHandle_t h){ return !__timers.isActive(h);}),
+                          __pendingTimers.end());
+
+    TimerHandle_t handle = __timers.schedule(delay_msec, [this, step]{ (this->*step)();});
+    __pendingTimers.push_back(handle);
+}
+
+
+/*!
+ * \brief FcmConnection::cancelPendingSteps
+ */
+void FcmConnection::cancelPendingSteps()
+{
+    for (auto& handle : __pendingTimers)
+        __timers.cancel(handle);
+    __pendingTimers.clear();
+}
+
+
 /*!
  * \brief FcmConnection::socketEncrypted
  */
 void FcmConnection::socketEncrypted()
 {
+    __stats.lastTlsMsec = __handshakeClock.elapsed();
+    __stats.lastTlsProtocol = __fcmSocket.sessionProtocol();
+    storeTlsSession();
+    // a server that stops talking mid handshake is caught as well.
+    __keepalive.reset(__timers.now());
+    armKeepalive();
     emit connectionEstablished(__id);
     //std::cout << "Connected to FCM server.Starting XMPP handshake. Opening stream..." << std::endl;
 
-    //socket is secured now, lets prepare to read messages.
-    connect(&__fcmSocket, SIGNAL(readyRead()), this, SLOT(handleReadyRead()), Qt::DirectConnection);
+    //socket is secured now, lets prepare to read messages. Reconnects reuse the socket.
+    connect(&__fcmSocket, SIGNAL(readyRead()), this, SLOT(handleReadyRead()),
+            (Qt::ConnectionType)(Qt::DirectConnection | Qt::UniqueConnection));
 
     emit xmppHandshakeStarted(__id);
-    __fcmWriter.writeStartDocument();
-    __fcmWriter.writeStartElement("stream:stream");
-    __fcmWriter.writeAttribute("to", "gcm.googleapis.com");
-    __fcmWriter.writeAttribute("version", "1.0");
-    __fcmWriter.writeAttribute("xmlns", "jabber:client");
-    __fcmWriter.writeAttribute("xmlns:stream", "http://etherx.jabber.org/streams");
+    openStream(true);
+    __handshakeState = FcmHandshakeState::AWAIT_FEATURES;
+}
 
-    QByteArray arr(">");// Do we need to escape this??
-    __fcmSocket.write(arr);
+
+/*!
+ * \brief FcmConnection::expectHandshakeState
+ * \param state  state in which 'stanza' is expected.
+ * \param stanza for the error message.
+ * \return false (and an error is raised) if the handshake is elsewhere.
+ */
+bool FcmConnection::expectHandshakeState(FcmHandshakeState state, const char* stanza)
+{
+    if (__handshakeState == state)
+        return true;
+
+    std::stringstream err;
+    err << "Unexpected '" << stanza << "' in handshake state["
+        << (char)__handshakeState.load() << "]. Ignored.";
+    emit connectionError(__id, err.str().c_str());
+    return false;
 }
 
 
@@ -125,11 +379,39 @@ void FcmConnection::socketEncrypted()
 void FcmConnection::handleDisconnected()
 {
     __state = FcmSessionState::UNKNOWN;
-    if ( __connectionDrainingInProgress == false)
+    bool was_established = __handshakeState == FcmHandshakeState::ESTABLISHED;
+    // tls never came up while offering a ticket; the next attempt does a full
+    // handshake rather than offering it again.
+    if (__handshakeState == FcmHandshakeState::CONNECTING && __tlsTicketOffered &&
+            __tlsSessionCache != nullptr)
+    {
+        __tlsSessionCache->remove(tlsServerKey());
+    }
+    __handshakeState = FcmHandshakeState::DISCONNECTED;
+    __timers.cancel(__keepaliveTimer);
+    // the next connection starts a new document.
+    __scanner.reset();
+    __scanner.setFastPath(false);
+    __fcmReader.clear();
+    // the application unblocks the link when it releases it.
+    __outputBlocked = false;
+    __stats.pendingOutput = 0;
+    if (__shutdownInProgress)
+    {
+        completeShutdown();
+    }
+    else if ( __connectionDrainingInProgress == false)
     {
         emit connectionLost(__id);
-        int msec = __expBoff.next();
-        QTimer::singleShot(msec, this, &FcmConnection::connectToFirebase);
+        // a session that lasted gets an immediate reconnect. One that drops
+        // right after coming up keeps backing off, or a server that accepts
+        // and then closes us would have us reconnecting in a tight loop.
+        int msec = 0;
+        if (was_established && __timers.now() - __establishedAt >= STABLE_SESSION_MSEC)
+            __expBoff.reset();
+        else
+            msec = __expBoff.next();
+        scheduleStep(msec, &FcmConnection::connectToFirebase);
     }else
     {
         emit connectionDrainingCompleted(__id);
@@ -142,34 +424,59 @@ void FcmConnection::handleDisconnected()
  */
 void FcmConnection::handleReadyRead()
 {
-    QSslSocket* socket = (QSslSocket*)sender();
-    QByteArray bytes;
-    bytes = socket->readAll();
-
-    if (bytes.length() == 1 && isspace(bytes.at(0)))
+    // read straight into the scanner's buffer; no intermediate QByteArray.
+    qint64 avail = __fcmSocket.bytesAvailable();
+    if (avail <= 0)
+        return;
+    char* dst = __scanner.prepare((std::size_t)avail);
+    qint64 n = __fcmSocket.read(dst, avail);
+    if (n <= 0)
+        return;
+    __scanner.commit((std::size_t)n);
+    __stats.bytesReceived += n;
+    __stats.rxBufferCapacity = __scanner.getCapacity();
+    __stats.peakRxBuffered = __scanner.getPeakBufferedSize();
+    __keepalive.onReceived(__timers.now());
+    __stats.maxRxGapMsec = __keepalive.getMaxGap();
+
+    if (n == 1 && isspace(dst[0]))
     {
         //std::cout << "RX[1]: Recieved keepalive from FCM." << std::endl;
+        // the scanner skips it as inter stanza white space.
         emit heartbeatRecieved(__id);
         return;
     }
     // Recieved regular message. We can start parsing.
     // TODO implement an option to print this to a file.
-    //std::cout << std::endl << "RX["<< bytes.length() <<"]:" << bytes.toStdString() << std::endl;
-    __fcmReader.addData(bytes);
-    try
+    StanzaSlice stanza;
+    while (__scanner.next(stanza))
     {
-        parseXml();
-    }
-    catch(std::exception& err)
-    {
-        //std::cout << "Exception caught. Error[" << err.what() << std::endl;
-        emit connectionError(__id, err.what());
-    }
-    catch (...)
-    {
-        std::stringstream err;
-        err << "unknown exception caught.";
-        emit connectionError(__id, err.str().c_str());
+        try
+        {
+            if (stanza.kind == StanzaKind::GCM_JSON)
+            {
+                // fast path; the JSON never goes through QString.
+                __stats.stanzasReceived++;
+                handleFcmMessage(QByteArray::fromRawData(stanza.data, (int)stanza.size));
+            }
+            else
+            {
+                // the reader keeps a copy of its own.
+                __fcmReader.addData(QByteArray::fromRawData(stanza.data, (int)stanza.size));
+                parseXml();
+            }
+        }
+        catch(std::exception& err)
+        {
+            //std::cout << "Exception caught. Error[" << err.what() << std::endl;
+            emit connectionError(__id, err.what());
+        }
+        catch (...)
+        {
+            std::stringstream err;
+            err << "unknown exception caught.";
+            emit connectionError(__id, err.str().c_str());
+        }
     }
 }
 
@@ -223,6 +530,12 @@ void FcmConnection::handleOtherElement()
 void FcmConnection::handleEndOfStream()
 {
     //std::cout << "Recieved 'END STREAM' from FCM. Closing stream..." << std::endl;
+    if (__shutdownInProgress)
+    {
+        // our stream end went out already; FCM answered it.
+        __fcmSocket.disconnectFromHost();
+        return;
+    }
     __fcmWriter.writeEndElement();
     __fcmWriter.writeEndDocument();
     emit streamClosed(__id);
@@ -247,6 +560,10 @@ void FcmConnection::handleStartElement()
     {
         handleIq();
     }
+    else if (__fcmReader.name() == "iq" && __fcmReader.namespaceUri() == DEFAULT_NSPACE_URI)
+    {
+        handleIqPing();
+    }
     else if (__fcmReader.name() == "success" && __fcmReader.namespaceUri() == SASL_NSPACE_URI)
     {
         handleSaslSuccess();
@@ -314,7 +631,10 @@ void FcmConnection::readMechanisms()
           else
               __fcmReader.skipCurrentElement();
     }
-    QTimer::singleShot(10, this, &FcmConnection::sendAuthenticationInfo);
+    if (!expectHandshakeState(FcmHandshakeState::AWAIT_FEATURES, "mechanisms"))
+        return;
+    sendAuthenticationInfo();
+    __handshakeState = FcmHandshakeState::AWAIT_SASL;
 }
 
 
@@ -336,7 +656,10 @@ void FcmConnection::readBind()
 {
     __fcmReader.readElementText();
     //std::cout << "	Recieved xmpp 'bind' feature from FCM server." << std::endl;
-    QTimer::singleShot(10, this, &FcmConnection::sendIQBind);
+    if (!expectHandshakeState(FcmHandshakeState::AWAIT_BIND_FEATURES, "bind"))
+        return;
+    sendIQBind();
+    __handshakeState = FcmHandshakeState::AWAIT_BIND;
 }
 
 
@@ -369,8 +692,12 @@ void FcmConnection::handleSaslSuccess()
 {
     __fcmReader.readElementText();
     //std::cout << "Recieved xmpp-sasl SUCCESS from FCM server." << std::endl;
+    if (!expectHandshakeState(FcmHandshakeState::AWAIT_SASL, "success"))
+        return;
     emit saslSucess(__id);
-    QTimer::singleShot(10, this, &FcmConnection::startNewStream);
+    // the restart header goes out right away; FCM answers with the new features.
+    openStream(false);
+    __handshakeState = FcmHandshakeState::AWAIT_BIND_FEATURES;
 }
 
 
@@ -410,6 +737,41 @@ void FcmConnection::handleIq()
 }
 
 
+/*!
+ * \brief FcmConnection::handleIqPing
+ * Answers a XEP-0199 ping from FCM. An error reply to one of our own pings
+ * only means FCM doesn't implement them; the reply itself already counted as
+ * traffic.
+ */
+void FcmConnection::handleIqPing()
+{
+    QString type = __fcmReader.attributes().value("type").toString();
+    QString id   = __fcmReader.attributes().value("id").toString();
+    bool ping = false;
+    while (__fcmReader.readNextStartElement())
+    {
+        if (__fcmReader.name() == "ping" && __fcmReader.namespaceUri() == PING_NSPACE_URI)
+            ping = true;
+        __fcmReader.skipCurrentElement();
+    }
+
+    if (type == "get" && ping)
+    {
+        __fcmWriter.writeStartElement("iq");
+        __fcmWriter.writeAttribute("id", id);
+        __fcmWriter.writeAttribute("type", "result");
+        __fcmWriter.writeEndElement();
+    }
+    else if (!(type == "error" && id.startsWith(PING_ID_PREFIX)))
+    {
+        std::stringstream err;
+        err << "ERROR:Unexpected iq of type[" << type.toStdString()
+            << "] recieved from FCM, id:[" << id.toStdString() << "]";
+        THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+    }
+}
+
+
 /*!
  * \brief FcmConnection::readIQBindResult
  */
@@ -432,9 +794,16 @@ void FcmConnection::readJid()
 {
     //std::string jid = __fcmReader.readElementText().toStdString();
     //std::cout << "Recieved JID from FCM server:"<< jid << std::endl;
+    if (!expectHandshakeState(FcmHandshakeState::AWAIT_BIND, "jid"))
+        return;
 
+    __handshakeState = FcmHandshakeState::ESTABLISHED;
+    __stats.lastHandshakeMsec = __handshakeClock.elapsed();
+    __stats.handshakes++;
     __state = FcmSessionState::AUTHENTICATED;
-    __expBoff.reset();
+    __scanner.setFastPath(true);
+    // the backoff is reset once the session proved stable; see handleDisconnected.
+    __establishedAt = __timers.now();
     emit sessionEstablished(__id);
 }
 
@@ -445,12 +814,13 @@ void FcmConnection::readJid()
 void FcmConnection::handleMessage()
 {
     //std::cout << "Parsing new XMPP stanza..." << std::endl;
+    __stats.stanzasReceived++;
     while (__fcmReader.readNextStartElement())
     {
           if (__fcmReader.name() == "gcm" && __fcmReader.namespaceUri() == GCM_NSPACE_URI)
           {
               QString json = __fcmReader.readElementText();
-              handleFcmMessage(json);
+              handleFcmMessage(json.toUtf8());
           }
           else
               __fcmReader.skipCurrentElement();
@@ -460,13 +830,11 @@ void FcmConnection::handleMessage()
 
 /*!
  * \brief FcmConnection::handleFcmMessage
- * \param json_str
+ * \param bytes UTF-8 JSON.
  */
-void FcmConnection::handleFcmMessage(const QString& json_str)
+void FcmConnection::handleFcmMessage(const QByteArray& bytes)
 {
     //std::cout << "-------------------START NEW FCM MESSAGE ----------------------" << std::endl;
-    QByteArray bytes(json_str.toStdString().c_str());
-
     QJsonParseError parseErr;
     QJsonDocument jdoc = QJsonDocument::fromJson(bytes, &parseErr);
     if (jdoc.isNull())
@@ -480,35 +848,31 @@ void FcmConnection::handleFcmMessage(const QString& json_str)
     //std::cout << "Message:" << std::endl;
     //PRINT_JSON_DOC(std::cout, jdoc);
 
-    // All good so far.
-    if ( jdoc.object().contains("message_type"))
+    // All good so far. Decode the routing fields once.
+    FcmEnvelope envelope = FcmEnvelope::decode(jdoc.object());
+    switch (envelope.type)
     {
-        // this is either an 'ack'/'nack'/'control'
-        std::string msg_type = jdoc.object().value(fcmfieldnames::MESSAGE_TYPE).toString().toStdString();
-        if ( msg_type == "ack")
-        {
-            emit newAckMessage(__id, jdoc);
-        }
-        else if ( msg_type == "nack")
-        {
-            emit newNackMessage(__id, jdoc);
-        }
-        else if ( msg_type == "control")
-        {
-            handleControlMessage(jdoc);
-        }else if (msg_type == "receipt")
-        {
-            handleReceiptMessage(jdoc);
-        }else
+        case FcmMessageType::ACK:
+            // forwarded to the BAL as FCM sent it.
+            postEvent(FcmEvent(envelope, jdoc));
+            break;
+        case FcmMessageType::NACK:
+            postEvent(FcmEvent(envelope));
+            break;
+        case FcmMessageType::CONTROL:
+            handleControlMessage(envelope);
+            break;
+        case FcmMessageType::RECEIPT:
+        case FcmMessageType::UPSTREAM:
+            // this is a receipt or a new message from a client.
+            postEvent(FcmEvent(envelope, jdoc));
+            break;
+        default:
         {
             std::stringstream err;
-            err << "Unknown message type<" << msg_type << "> found.";
+            err << "Unknown message type<" << envelope.typeName << "> found.";
             THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
         }
-    }else
-    {
-        // this is a new message from a client.
-        emit newMessage(__id, jdoc);
     }
     //std::cout << "-------------------END NEW FCM MESSAGE ----------------------" << std::endl;
 }
@@ -542,11 +906,10 @@ void FcmConnection::handleFcmMessage(const QString& json_str)
  *
  * \param control_msg
  */
-void FcmConnection::handleControlMessage(const QJsonDocument& control_msg)
+void FcmConnection::handleControlMessage(const FcmEnvelope& control_msg)
 {
     //std::cout << "Recieved 'control' message from FCM..." << std::endl;
-    QString control_type = control_msg.object().value(fcmfieldnames::CONTROL_TYPE).toString();
-    if ( control_type == "CONNECTION_DRAINING" )
+    if ( control_msg.controlType == "CONNECTION_DRAINING" )
     {
         __connectionDrainingInProgress = true;
         emit connectionDrainingStarted(__id);
@@ -561,16 +924,6 @@ void FcmConnection::handleControlMessage(const QJsonDocument& control_msg)
 }
 
 
-/*!
- * \brief FcmConnection::handleReceiptMessage
- * \param receipt_msg
- */
-void FcmConnection::handleReceiptMessage(const QJsonDocument& receipt_msg)
-{
-    emit newReceiptMessage(__id, receipt_msg);
-}
-
-
 /*!
  * \brief FcmConnection::sendAuthenticationInfo
  */
@@ -599,11 +952,15 @@ void FcmConnection::sendAuthenticationInfo()
 
 
 /*!
- * \brief FcmConnection::startNewStream
+ * \brief FcmConnection::openStream
+ * Sends the initial stream header, or the new one after SASL (RFC 6120 4.3.3).
+ * \param with_declaration write the XML declaration first.
  */
-void FcmConnection::startNewStream()
+void FcmConnection::openStream(bool with_declaration)
 {
     //std::cout << std::endl << "TX:Starting new stream...." << std::endl;
+    if (with_declaration)
+        __fcmWriter.writeStartDocument();
     __fcmWriter.writeStartElement("stream:stream");
     __fcmWriter.writeAttribute("to", "gcm.googleapis.com");
     __fcmWriter.writeAttribute("version", "1.0");
@@ -634,18 +991,338 @@ void FcmConnection::sendIQBind()
 
 
 /*!
- * \brief Application::sendMessage
+ * \brief FcmConnection::send
+ * Queues 'data' for this connection. Called from the application thread; the
+ * queue is written out by the connection thread.
  * \param data - This is a fully formed FCM message.
  */
-void FcmConnection::handleSendMessage(const QJsonDocument &data)
+void FcmConnection::send(const QJsonDocument& data)
+{
+    __sendQueue.push(data);
+    if (!__flushScheduled.exchange(true))
+        QMetaObject::invokeMethod(this, "flushSendQueue", Qt::QueuedConnection);
+}
+
+
+/*!
+ * \brief FcmConnection::sendStanzas
+ * Like 'send' for stanzas the application already encoded e.g a batch of
+ * upstream acks; they go out with the next flush.
+ * \param stanzas
+ * \param count   # of stanzas in 'stanzas'.
+ */
+void FcmConnection::sendStanzas(std::string&& stanzas, std::size_t count)
+{
+    __stanzaQueue.push(std::make_pair(std::move(stanzas), count));
+    if (!__flushScheduled.exchange(true))
+        QMetaObject::invokeMethod(this, "flushSendQueue", Qt::QueuedConnection);
+}
+
+
+/*!
+ * \brief FcmConnection::postEvent
+ * Hands a parsed stanza to the application. Only the first event of a batch
+ * wakes the application up.
+ * \param event
+ */
+void FcmConnection::postEvent(FcmEvent&& event)
+{
+    __events.push(std::move(event));
+    if (!__eventsWakePending.exchange(true))
+        emit eventsReady(__id);
+}
+
+
+/*!
+ * \brief FcmConnection::takeEvents
+ * Called from the application thread on 'eventsReady'.
+ * \param out  events are appended in arrival order.
+ * \return # of events taken.
+ */
+std::size_t FcmConnection::takeEvents(std::vector<FcmEvent>& out)
+{
+    // re-arm first; anything posted from now on raises a new 'eventsReady'.
+    __eventsWakePending.store(false);
+
+    std::size_t n = 0;
+    FcmEvent event;
+    while (__events.pop(event))
+    {
+        out.push_back(std::move(event));
+        n++;
+    }
+    return n;
+}
+
+
+/*!
+ * \brief FcmConnection::flushSendQueue
+ * Writes every queued stanza. Whatever is queued while the session is down is
+ * dropped; acks are only valid on the connection they were meant for. Each
+ * dropped downstream message is reported with 'sendFailed' so the application
+ * can queue it again rather than wait for its ack timeout.
+ */
+void FcmConnection::flushSendQueue()
 {
+    __flushScheduled.store(false);
+    QJsonDocument data;
+    std::pair<std::string, std::size_t> stanzas;
+    if (__state != FcmSessionState::AUTHENTICATED)
+    {
+        std::size_t dropped = 0;
+        while (__sendQueue.pop(data))
+        {
+            dropped++;
+            emit sendFailed(__id, data.object().value(fcmfieldnames::MESSAGE_ID).toString());
+        }
+        while (__stanzaQueue.pop(stanzas))
+            dropped += stanzas.second;
+        if (dropped)
+        {
+            std::stringstream err;
+            err << "Session not established. Dropping [" << dropped
+                << "] queued stanzas.";
+            emit connectionError(__id, err.str().c_str());
+        }
+        return;
+    }
+
+    while (__stanzaQueue.pop(stanzas))
+    {
+        __stats.stanzasSent += stanzas.second;
+        __encoder.appendRaw(stanzas.first.data(), stanzas.first.size(), stanzas.second);
+    }
+    while (__sendQueue.pop(data))
+        writeMessage(data);
+
+    // one socket/TLS write for the whole batch.
+    if (!__encoder.empty())
+    {
+        __fcmSocket.write(__encoder.data(), (qint64)__encoder.size());
+        __encoder.clear();
+        updateOutputBackpressure();
+    }
+}
+
+
+/*!
+ * \brief FcmConnection::setOutputWatermarks
+ * May be called from any thread.
+ * \param high 'outputBlocked' once more than this many bytes wait to be written.
+ * \param low  'outputDrained' once the backlog is down to this many bytes.
+ */
+void FcmConnection::setOutputWatermarks(std::int64_t high, std::int64_t low)
+{
+    __outputHighWatermark = high;
+    __outputLowWatermark  = low;
+}
+
+
+/*!
+ * \brief FcmConnection::setTlsPolicy
+ * Call before 'connectToFcm' is invoked; it applies to every (re)connect.
+ * \param protocol         see 'tlsProtocolFromString'.
+ * \param ca_certificates  trusted on top of the system ones e.g the CA of a
+ *                         local test server.
+ * \param session_cache    shared by the pool; null turns resumption off.
+ */
+void FcmConnection::setTlsPolicy(QSsl::SslProtocol protocol,
+                                 const QList<QSslCertificate>& ca_certificates,
+                                 const TlsSessionCachePtr_t& session_cache)
+{
+    __tlsProtocol       = protocol;
+    __tlsCaCertificates = ca_certificates;
+    __tlsSessionCache   = session_cache;
+}
+
+
+/*!
+ * \brief FcmConnection::tlsProtocolFromString
+ * \param name tls1.2+|tls1.3; tls1.3 needs Qt 5.12 or later.
+ * \return
+ */
+QSsl::SslProtocol FcmConnection::tlsProtocolFromString(const std::string& name)
+{
+    if (name == "tls1.2+")
+        return QSsl::TlsV1_2OrLater;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    else if (name == "tls1.3")
+        return QSsl::TlsV1_3OrLater;
+#endif
+
+    std::stringstream err;
+    err << "Unknown tls protocol[" << name << "]";
+    THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+}
+
+
+/*!
+ * \brief FcmConnection::tlsProtocolToString
+ * \param protocol as returned by 'tlsProtocolFromString'.
+ * \return
+ */
+const char* FcmConnection::tlsProtocolToString(QSsl::SslProtocol protocol)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (protocol == QSsl::TlsV1_3OrLater)
+        return "tls1.3";
+#endif
+    return protocol == QSsl::TlsV1_2OrLater ? "tls1.2+" : "unknown";
+}
+
+
+/*!
+ * \brief FcmConnection::tlsProtocolName
+ * \param protocol negotiated QSsl::SslProtocol.
+ * \return
+ */
+const char* FcmConnection::tlsProtocolName(int protocol)
+{
+    switch (protocol)
+    {
+        case QSsl::TlsV1_0: return "TLSv1.0";
+        case QSsl::TlsV1_1: return "TLSv1.1";
+        case QSsl::TlsV1_2: return "TLSv1.2";
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+        case QSsl::TlsV1_3: return "TLSv1.3";
+#endif
+        default:            return "unknown";
+    }
+}
+
+
+/*!
+ * \brief FcmConnection::setKeepalive
+ * Call before 'connectToFcm' is invoked.
+ * \param mode
+ * \param ping_interval_msec receive idle time after which we ping, 0 = never.
+ * \param idle_timeout_msec  receive idle time after which the connection is
+ *                           dropped (and its window failed over), 0 = never.
+ */
+void FcmConnection::setKeepalive(KeepaliveMode mode,
+                                 std::int64_t ping_interval_msec,
+                                 std::int64_t idle_timeout_msec)
+{
+    __keepaliveMode = mode;
+    __keepalive.setPingInterval(ping_interval_msec);
+    __keepalive.setIdleTimeout(idle_timeout_msec);
+}
+
+
+/*!
+ * \brief FcmConnection::armKeepalive
+ * One timer at the next keepalive deadline; receiving data doesn't touch it.
+ */
+void FcmConnection::armKeepalive()
+{
+    __timers.cancel(__keepaliveTimer);
+    std::int64_t at = __keepalive.nextCheckAt();
+    if (at < 0)
+        return;
+
+    __keepaliveTimer = __timers.scheduleAt(at, [this]{
+        __keepaliveTimer = INVALID_TIMER_HANDLE;
+        checkKeepalive();
+    });
+}
+
+
+/*!
+ * \brief FcmConnection::checkKeepalive
+ * A connection that received nothing for the idle timeout is presumed half
+ * open and aborted. The resulting 'connectionLost' makes the application
+ * move its in flight window to the other connections.
+ */
+void FcmConnection::checkKeepalive()
+{
+    std::int64_t now = __timers.now();
+    switch (__keepalive.check(now))
+    {
+        case KeepaliveAction::DEAD:
+        {
+            __stats.livenessTimeouts++;
+            std::stringstream err;
+            err << "Nothing recieved for [" << __keepalive.getIdle(now)
+                << "] msec. Dropping connection.";
+            emit connectionError(__id, err.str().c_str());
+            __fcmSocket.abort();
+            return;
+        }
+        case KeepaliveAction::PING:
+        {
+            sendPing();
+            __keepalive.onPingSent(now);
+            break;
+        }
+        case KeepaliveAction::NONE:
+        default:
+            break;
+    }
+    armKeepalive();
+}
+
+
+/*!
+ * \brief FcmConnection::sendPing
+ * XMPP pings need a bound session; until then a whitespace one is sent.
+ */
+void FcmConnection::sendPing()
+{
+    __stats.pingsSent++;
+    if (__keepaliveMode == KeepaliveMode::XMPP_PING &&
+            __handshakeState == FcmHandshakeState::ESTABLISHED)
+    {
+        __fcmWriter.writeStartElement("iq");
+        __fcmWriter.writeAttribute("id", QString(PING_ID_PREFIX) + QString::number((qulonglong)++__pingCount));
+        __fcmWriter.writeAttribute("type", "get");
+        __fcmWriter.writeStartElement("ping");
+        __fcmWriter.writeAttribute("xmlns", PING_NSPACE_URI);
+        __fcmWriter.writeEndElement();
+        __fcmWriter.writeEndElement();
+    }
+    else
+    {
+        __fcmSocket.write(" ");
+    }
+}
+
+
+/*!
+ * \brief FcmConnection::updateOutputBackpressure
+ * Tracks the socket write backlog against the watermarks. The gap between the
+ * two keeps a link from flapping around a single threshold.
+ */
+void FcmConnection::updateOutputBackpressure()
+{
+    std::uint64_t pending = (std::uint64_t)__fcmSocket.bytesToWrite();
+    __stats.pendingOutput = pending;
+    if (pending > __stats.peakPendingOutput)
+        __stats.peakPendingOutput = pending;
+
+    if (!__outputBlocked && (std::int64_t)pending > __outputHighWatermark)
+    {
+        __outputBlocked = true;
+        __stats.outputBlocked++;
+        emit outputBlocked(__id);
+    }
+    else if (__outputBlocked && (std::int64_t)pending <= __outputLowWatermark)
+    {
+        __outputBlocked = false;
+        emit outputDrained(__id);
+    }
+}
+
+
+/*!
+ * \brief FcmConnection::writeMessage
+ * Encodes 'data' into the pending write batch.
+ * \param data - This is a fully formed FCM message.
+ */
+void FcmConnection::writeMessage(const QJsonDocument &data)
+{
+    __stats.stanzasSent++;
     //std::cout << "Sending Message to FCM:" << std::endl;
     //PRINT_JSON_DOC(std::cout, data);
-    __fcmWriter.writeStartElement("message");
-    __fcmWriter.writeAttribute("id", "");
-    __fcmWriter.writeStartElement("gcm");
-    __fcmWriter.writeAttribute("xmlns", GCM_NSPACE_URI);
-    __fcmWriter.writeCharacters(data.toJson());
-    __fcmWriter.writeEndElement();
-    __fcmWriter.writeEndElement();
+    QByteArray json = data.toJson(QJsonDocument::Compact);
+    __encoder.appendGcmMessage(json.constData(), json.size());
 }
@@ -2,14 +2,27 @@
 #define FCMCONNECTION_H
 
 #include "exponentialbackoff.h"
+#include "timerservice.h"
+#include "spscqueue.h"
+#include "stanzascanner.h"
+#include "fcmenvelope.h"
+#include "stanzaencoder.h"
+#include "tlssessioncache.h"
+#include "keepalivetracker.h"
 
 #include <QObject>
+#include <QJsonDocument>
 #include <QSslSocket>
+#include <QSslCertificate>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
+#include <QElapsedTimer>
 
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <string>
+#include <utility>
 
 
 #define DEFAULT_NSPACE_URI		"jabber:client"
@@ -18,8 +31,14 @@
 #define BIND_NSPACE_URI                 "urn:ietf:params:xml:ns:xmpp-bind"
 #define SESSION_NSPACE_URI		"urn:ietf:params:xml:ns:xmpp-session"
 #define GCM_NSPACE_URI			"google:mobile:data"
+#define PING_NSPACE_URI                 "urn:xmpp:ping"
+#define PING_ID_PREFIX                  "ping-"
 
-#define WAIT_TIME_BEFORE_DISCONNECT 50 //msec
+#define DEFAULT_SHUTDOWN_TIMEOUT    2000 //msec; see FcmConnection::shutdown.
+#define DEFAULT_OUTPUT_HIGH_WATERMARK   (1024 * 1024) // bytes
+#define DEFAULT_OUTPUT_LOW_WATERMARK    (256 * 1024)  // bytes
+#define DEFAULT_TLS_PROTOCOL            "tls1.2+"
+#define STABLE_SESSION_MSEC             30000 // msec a session must last to reset the reconnect backoff.
 
 
 /*!
@@ -31,8 +50,101 @@ enum class FcmSessionState:char
     AUTHENTICATED = 'A'
 };
 
+/*!
+ * \brief The FcmHandshakeState enum
+ * Client side of the XMPP handshake (RFC 6120). Each step is sent as soon as
+ * the stanza it waits for has been parsed.
+ */
+enum class FcmHandshakeState:char
+{
+    DISCONNECTED        = 'D',
+    CONNECTING          = 'C',  // TCP + TLS.
+    AWAIT_FEATURES      = 'F',  // stream opened, waiting for SASL mechanisms.
+    AWAIT_SASL          = 'S',  // auth sent.
+    AWAIT_BIND_FEATURES = 'R',  // stream restarted, waiting for bind feature.
+    AWAIT_BIND          = 'B',  // iq bind sent.
+    ESTABLISHED         = 'E'
+};
+
+
+/*!
+ * \brief The FcmConnectionStats struct
+ * Traffic counters of one connection. Atomic so that they can be read from
+ * any thread.
+ */
+struct FcmConnectionStats
+{
+    std::atomic<std::uint64_t>  bytesSent;
+    std::atomic<std::uint64_t>  bytesReceived;
+    std::atomic<std::uint64_t>  stanzasSent;
+    std::atomic<std::uint64_t>  stanzasReceived;
+    std::atomic<std::uint64_t>  pendingOutput;      // bytes the socket has yet to write.
+    std::atomic<std::uint64_t>  peakPendingOutput;  // high water mark of 'pendingOutput'.
+    std::atomic<std::uint64_t>  outputBlocked;      // # of times the high watermark was crossed.
+    std::atomic<std::uint64_t>  handshakes;         // # of sessions established.
+    std::atomic<std::int64_t>   lastTlsMsec;        // connect -> TLS up, last handshake.
+    std::atomic<std::int64_t>   lastHandshakeMsec;  // connect -> session up, last handshake.
+    std::atomic<std::uint64_t>  tlsTicketsOffered;  // # of handshakes that tried to resume.
+    std::atomic<bool>           lastTlsTicketOffered;
+    std::atomic<int>            lastTlsProtocol;    // QSsl::SslProtocol negotiated.
+    std::atomic<std::uint64_t>  pingsSent;
+    std::atomic<std::uint64_t>  livenessTimeouts;   // # of times the idle timeout killed the connection.
+    std::atomic<std::int64_t>   maxRxGapMsec;       // longest time without receiving anything.
+    std::atomic<std::uint64_t>  rxBufferCapacity;   // bytes allocated for receiving.
+    std::atomic<std::uint64_t>  peakRxBuffered;     // most bytes ever waiting to be parsed.
+
+    FcmConnectionStats()
+        :bytesSent(0),
+         bytesReceived(0),
+         stanzasSent(0),
+         stanzasReceived(0),
+         pendingOutput(0),
+         peakPendingOutput(0),
+         outputBlocked(0),
+         handshakes(0),
+         lastTlsMsec(0),
+         lastHandshakeMsec(0),
+         tlsTicketsOffered(0),
+         lastTlsTicketOffered(false),
+         lastTlsProtocol(QSsl::UnknownProtocol),
+         pingsSent(0),
+         livenessTimeouts(0),
+         maxRxGapMsec(0),
+         rxBufferCapacity(0),
+         peakRxBuffered(0)
+    {}
+};
+
+
+/*!
+ * \brief The FcmEvent struct
+ * A parsed stanza handed from the connection thread to the application.
+ * 'data' is only set for upstream, receipt and ack messages.
+ */
+struct FcmEvent
+{
+    FcmEnvelope     envelope;
+    QJsonDocument   data;
+
+    FcmEvent() {}
+    FcmEvent(const FcmEnvelope& env, const QJsonDocument& json = QJsonDocument())
+        :envelope(env),
+         data(json)
+    {}
+};
+
+
 /*!
  * \brief The FcmConnection class
+ * Each connection lives on a worker thread of its own (see 'create') so that
+ * TLS, XML and JSON work for different connections runs in parallel. Parsed
+ * ack/nack/receipt/upstream stanzas are handed to the application through a
+ * lock free queue; 'eventsReady' is emitted once per batch, not per stanza.
+ * Everything else is reported through (queued) signals. Both travel through
+ * the application event loop in the order they were raised.
+ *
+ * Only 'send', 'sendStanzas', 'takeEvents' and the getters may be called
+ * from the application thread.
  */
 class FcmConnection:public QObject
 {
@@ -41,36 +153,94 @@ class FcmConnection:public QObject
         QSslSocket                  __fcmSocket;   // fcm facing socket
         QXmlStreamWriter            __fcmWriter;   // writes to __socket
         QXmlStreamReader            __fcmReader;   // read to __socket
+        StanzaScanner               __scanner;     // frames __socket reads for __fcmReader.
         QString                     __fcmServerId; // FCM server id; read from config.ini
         QString                     __fcmServerKey;// FCM server key; read from config.ini
         QString                     __fcmHostAddress;
         quint16                     __fcmPortNo;   //
         std::vector<std::string>    __authMethodVect; //
-        FcmSessionState             __state;
+        std::atomic<FcmSessionState> __state;
         ExponentialBackoff          __expBoff;
         bool                        __connectionDrainingInProgress;
         int                         __id;
+        TimerService                __timers;        // runs on the connection thread.
+        std::vector<TimerHandle_t>  __pendingTimers; // handshake steps/reconnect.
+        SpscQueue<QJsonDocument>    __sendQueue;     // application -> connection.
+        SpscQueue<std::pair<std::string, std::size_t>> __stanzaQueue; // pre-encoded stanzas, # of them.
+        StanzaEncoder               __encoder;       // stanzas written by one flush.
+        std::atomic<bool>           __flushScheduled;
+        SpscQueue<FcmEvent>         __events;        // connection -> application.
+        std::atomic<bool>           __eventsWakePending;
+        FcmConnectionStats          __stats;
+        std::atomic<std::int64_t>   __outputHighWatermark;
+        std::atomic<std::int64_t>   __outputLowWatermark;
+        bool                        __outputBlocked;
+        std::atomic<FcmHandshakeState> __handshakeState; // written by the connection thread only.
+        QElapsedTimer               __handshakeClock; // started on connect.
+        std::int64_t                __establishedAt; // when the current session came up.
+        QSsl::SslProtocol           __tlsProtocol;
+        QList<QSslCertificate>      __tlsCaCertificates; // trusted on top of the system ones.
+        TlsSessionCachePtr_t        __tlsSessionCache;   // shared by the pool, null = no resumption.
+        bool                        __tlsTicketOffered;
+        bool                        __shutdownInProgress;
+        bool                        __shutdownCompleted;
+        TimerHandle_t               __shutdownTimer;
+        KeepaliveTracker            __keepalive;
+        KeepaliveMode               __keepaliveMode;
+        TimerHandle_t               __keepaliveTimer;
+        std::uint64_t               __pingCount;     // id of our xmpp pings.
 
 
     public:
         FcmConnection(int id);
         ~FcmConnection();
-        void connectToFcm(QString server_id,
+        static std::shared_ptr<FcmConnection> create(int id);
+        Q_INVOKABLE void connectToFcm(QString server_id,
                           QString server_key,
                           QString host,
                           quint16 port_no);
+        Q_INVOKABLE void shutdown(qint64 timeout_msec);
         void setServerId(const QString& id) { __fcmServerId = id;}
         void setServerKey(const QString& key){ __fcmServerKey = key;}
         void setFcmHost(const QString& host) { __fcmHostAddress = host;}
         void setFcmPortNo(quint16 port_no) { __fcmPortNo = port_no;}
         FcmSessionState getState()const { return __state;}
         int             getId()const { return __id;}
+        FcmHandshakeState getHandshakeState()const { return __handshakeState;}
+        const FcmConnectionStats& getStats()const { return __stats;}
+        std::size_t     getSendQueueSize()const { return __sendQueue.size();}
+        std::int64_t    getOutputHighWatermark()const { return __outputHighWatermark;}
+        std::int64_t    getOutputLowWatermark()const { return __outputLowWatermark;}
+        void            setOutputWatermarks(std::int64_t high, std::int64_t low);
+        void            setTlsPolicy(QSsl::SslProtocol protocol,
+                                     const QList<QSslCertificate>& ca_certificates,
+                                     const TlsSessionCachePtr_t& session_cache);
+        void            setKeepalive(KeepaliveMode mode,
+                                     std::int64_t ping_interval_msec,
+                                     std::int64_t idle_timeout_msec);
+
+        void            send(const QJsonDocument& data);
+        void            sendStanzas(std::string&& stanzas, std::size_t count);
+        std::size_t     takeEvents(std::vector<FcmEvent>& out);
+
+        static QSsl::SslProtocol tlsProtocolFromString(const std::string& name);
+        static const char*       tlsProtocolToString(QSsl::SslProtocol protocol);
+        static const char*       tlsProtocolName(int protocol);
+        static bool              applyTlsSession(QSslConfiguration& config,
+                                                 const TlsSessionCachePtr_t& cache,
+                                                 const std::string& server,
+                                                 std::int64_t now_msec);
+        static void              saveTlsSession(const QSslConfiguration& config,
+                                                const TlsSessionCachePtr_t& cache,
+                                                const std::string& server,
+                                                std::int64_t now_msec);
     public slots:
         // slots
         void socketEncrypted();
+        void storeTlsSession();
         void handleReadyRead();
         void handleDisconnected();
-        void handleSendMessage(const QJsonDocument& data);
+        void flushSendQueue();
     signals:
         void connectionStarted(int id);
         void connectionEstablished(int id);
@@ -87,17 +257,18 @@ class FcmConnection:public QObject
         void sessionEstablished(int id);
         void heartbeatRecieved(int id);
 
-        void newMessage(int id, const QJsonDocument& msg);
-        void newAckMessage(int id, const QJsonDocument& msg);
-        void newNackMessage(int id, const QJsonDocument& msg);
-        void newReceiptMessage(int id, const QJsonDocument& msg);
+        void eventsReady(int id);
+        void sendFailed(int id, const QString& message_id);
+        void outputBlocked(int id);
+        void outputDrained(int id);
     private:
         void parseXml();
         void handleStartElement();
         void handleOtherElement();
         void sendAuthenticationInfo();
         void sendIQBind();
-        void startNewStream();
+        void openStream(bool with_declaration);
+        bool expectHandshakeState(FcmHandshakeState state, const char* stanza);
         void readConsoleCmd();
         void handleEndOfStream();
         // STREAM URI
@@ -116,10 +287,21 @@ class FcmConnection:public QObject
         void readSession();
         void readIQBindResult();
         void connectToFirebase();
+        void prepareTls();
+        void completeShutdown();
+        void armKeepalive();
+        void checkKeepalive();
+        void sendPing();
+        void handleIqPing();
+        std::string tlsServerKey() const;
+        void scheduleStep(std::int64_t delay_msec, void (FcmConnection::*step)());
+        void cancelPendingSteps();
         // FCM URI
-        void handleFcmMessage(const QString& json_str);
-        void handleControlMessage(const QJsonDocument& json);
-        void handleReceiptMessage(const QJsonDocument& json);
+        void handleFcmMessage(const QByteArray& bytes);
+        void handleControlMessage(const FcmEnvelope& envelope);
+        void writeMessage(const QJsonDocument& data);
+        void postEvent(FcmEvent&& event);
+        void updateOutputBackpressure();
 };
 
 /*!
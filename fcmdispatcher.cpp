@@ -0,0 +1,429 @@
+#include "fcmdispatcher.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+
+/*!
+ * \brief FcmDispatcher::FcmDispatcher
+ * \param policy
+ * \param window    max in flight messages per connection.
+ */
+FcmDispatcher::FcmDispatcher(DispatchPolicy policy, std::int64_t window)
+    :__policy(policy),
+     __window(window),
+     __congestionControl(false),
+     __initialWindow(window)
+{
+}
+
+
+/*!
+ * \brief FcmDispatcher::setMaxWindow
+ * Applies to links added from now on; call before 'setCongestionControl'.
+ * \param window    max in flight messages per connection.
+ */
+void FcmDispatcher::setMaxWindow(std::int64_t window)
+{
+    __window        = window;
+    __initialWindow = std::min(__initialWindow, window);
+}
+
+
+/*!
+ * \brief FcmDispatcher::setCongestionControl
+ * Applies to links added from now on.
+ * \param enabled         false keeps every window at the max.
+ * \param initial_window  window a new link starts (and restarts) with.
+ */
+void FcmDispatcher::setCongestionControl(bool enabled, std::int64_t initial_window)
+{
+    __congestionControl = enabled;
+    __initialWindow     = enabled ? std::min(initial_window, __window) : __window;
+}
+
+
+/*!
+ * \brief FcmDispatcher::policyFromString
+ * \param name free_window|ack_latency|token_hash
+ * \return
+ */
+DispatchPolicy FcmDispatcher::policyFromString(const std::string& name)
+{
+    if (name == "free_window")
+        return DispatchPolicy::FREE_WINDOW;
+    else if (name == "ack_latency")
+        return DispatchPolicy::ACK_LATENCY;
+    else if (name == "token_hash")
+        return DispatchPolicy::TOKEN_HASH;
+
+    std::stringstream err;
+    err << "Unknown dispatch policy[" << name << "]";
+    THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+}
+
+
+/*!
+ * \brief FcmDispatcher::hashToken
+ * FNV-1a; unlike std::hash it is stable across runs and platforms.
+ * \param token
+ * \return
+ */
+std::uint32_t FcmDispatcher::hashToken(const std::string& token)
+{
+    std::uint32_t hash = 2166136261u;
+    for (unsigned char c : token)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*!
+ * \brief FcmDispatcher::addLink
+ * New links start unauthenticated; they take traffic once 'setAuthenticated'.
+ * \param id
+ */
+void FcmDispatcher::addLink(int id)
+{
+    FcmLink link;
+    link.id             = id;
+    link.authenticated  = false;
+    link.draining       = false;
+    link.blocked        = false;
+    link.standby        = false;
+    link.inFlight       = 0;
+    link.ackRttMsec     = 0;
+    link.acked          = 0;
+    link.throttled      = 0;
+    link.congestion     = CongestionWindow(__initialWindow, __window);
+    link.window         = link.congestion.size();
+    __links[id] = link;
+}
+
+
+/*!
+ * \brief FcmDispatcher::removeLink
+ * \param id
+ */
+void FcmDispatcher::removeLink(int id)
+{
+    __links.erase(id);
+}
+
+
+/*!
+ * \brief FcmDispatcher::setAuthenticated
+ * \param id
+ * \param val
+ */
+void FcmDispatcher::setAuthenticated(int id, bool val)
+{
+    auto it = __links.find(id);
+    if (it != __links.end())
+        it->second.authenticated = val;
+}
+
+
+/*!
+ * \brief FcmDispatcher::setDraining
+ * \param id
+ * \param val
+ */
+void FcmDispatcher::setDraining(int id, bool val)
+{
+    auto it = __links.find(id);
+    if (it != __links.end())
+        it->second.draining = val;
+}
+
+
+/*!
+ * \brief FcmDispatcher::setBlocked
+ * A blocked link keeps its in flight messages but takes no new ones.
+ * \param id
+ * \param val
+ */
+void FcmDispatcher::setBlocked(int id, bool val)
+{
+    auto it = __links.find(id);
+    if (it != __links.end())
+        it->second.blocked = val;
+}
+
+
+/*!
+ * \brief FcmDispatcher::setStandby
+ * Promoting a standby (val = false) is all a failover takes; the link is
+ * already authenticated.
+ * \param id
+ * \param val
+ */
+void FcmDispatcher::setStandby(int id, bool val)
+{
+    auto it = __links.find(id);
+    if (it != __links.end())
+        it->second.standby = val;
+}
+
+
+/*!
+ * \brief FcmDispatcher::findLink
+ * \param id
+ * \return null if 'id' is unknown.
+ */
+const FcmLink* FcmDispatcher::findLink(int id) const
+{
+    auto it = __links.find(id);
+    if (it == __links.end())
+        return nullptr;
+    return &it->second;
+}
+
+
+/*!
+ * \brief FcmDispatcher::isUsable
+ * \param id
+ * \return true if 'id' is authenticated, not draining and not blocked.
+ */
+bool FcmDispatcher::isUsable(int id) const
+{
+    const FcmLink* link = findLink(id);
+    return link != nullptr && link->usable();
+}
+
+
+/*!
+ * \brief FcmDispatcher::isHealthy
+ * \param id
+ * \return true if 'id' is up and not draining, blocked or not.
+ */
+bool FcmDispatcher::isHealthy(int id) const
+{
+    const FcmLink* link = findLink(id);
+    return link != nullptr && link->healthy();
+}
+
+
+/*!
+ * \brief FcmDispatcher::countActive
+ * \return # of healthy links that aren't standbys, blocked or not.
+ */
+std::size_t FcmDispatcher::countActive() const
+{
+    std::size_t n = 0;
+    for (auto&& i : __links)
+    {
+        if (i.second.healthy() && !i.second.standby)
+            n++;
+    }
+    return n;
+}
+
+
+/*!
+ * \brief FcmDispatcher::countStandby
+ * \return # of healthy standby links.
+ */
+std::size_t FcmDispatcher::countStandby() const
+{
+    std::size_t n = 0;
+    for (auto&& i : __links)
+    {
+        if (i.second.healthy() && i.second.standby)
+            n++;
+    }
+    return n;
+}
+
+
+/*!
+ * \brief FcmDispatcher::findStandby
+ * \return id of a healthy standby link or NO_FCM_CONNECTION.
+ */
+int FcmDispatcher::findStandby() const
+{
+    for (auto&& i : __links)
+    {
+        if (i.second.healthy() && i.second.standby)
+            return i.first;
+    }
+    return NO_FCM_CONNECTION;
+}
+
+
+/*!
+ * \brief FcmDispatcher::getFreeSlots
+ * \return free slots over all usable links.
+ */
+std::int64_t FcmDispatcher::getFreeSlots() const
+{
+    std::int64_t n = 0;
+    for (auto&& i : __links)
+    {
+        if (i.second.usable())
+            n += i.second.freeSlots();
+    }
+    return n;
+}
+
+
+/*!
+ * \brief FcmDispatcher::pick
+ * \param token device registration token ('to') of the message.
+ * \return id of the link to send on or NO_FCM_CONNECTION if no usable link
+ *         has a free slot.
+ */
+int FcmDispatcher::pick(const std::string& token) const
+{
+    const FcmLink* best = nullptr;
+    switch (__policy)
+    {
+        case DispatchPolicy::TOKEN_HASH:
+        {
+            std::vector<const FcmLink*> usable;
+            for (auto&& i : __links)
+            {
+                if (i.second.usable())
+                    usable.push_back(&i.second);
+            }
+            if (usable.empty())
+                break;
+
+            // probe the next links if the hashed one is full.
+            std::size_t start = hashToken(token) % usable.size();
+            for (std::size_t n = 0; n < usable.size(); n++)
+            {
+                const FcmLink* link = usable[(start + n) % usable.size()];
+                if (link->freeSlots() > 0)
+                {
+                    best = link;
+                    break;
+                }
+            }
+            break;
+        }
+        case DispatchPolicy::ACK_LATENCY:
+        {
+            for (auto&& i : __links)
+            {
+                const FcmLink& link = i.second;
+                if (!link.usable() || link.freeSlots() == 0)
+                    continue;
+                if (best == nullptr ||
+                    link.ackRttMsec < best->ackRttMsec ||
+                    (link.ackRttMsec == best->ackRttMsec && link.freeSlots() > best->freeSlots()))
+                {
+                    best = &link;
+                }
+            }
+            break;
+        }
+        case DispatchPolicy::FREE_WINDOW:
+        default:
+        {
+            for (auto&& i : __links)
+            {
+                const FcmLink& link = i.second;
+                if (!link.usable() || link.freeSlots() == 0)
+                    continue;
+                if (best == nullptr || link.freeSlots() > best->freeSlots())
+                    best = &link;
+            }
+            break;
+        }
+    }
+    return best ? best->id : NO_FCM_CONNECTION;
+}
+
+
+/*!
+ * \brief FcmDispatcher::onSent
+ * \param id link a message was just written to.
+ */
+void FcmDispatcher::onSent(int id)
+{
+    auto it = __links.find(id);
+    if (it != __links.end())
+        it->second.inFlight++;
+}
+
+
+/*!
+ * \brief FcmDispatcher::onCompleted
+ * A message sent on 'id' got its ack/nack or was taken off the link. Only a
+ * completion with an rtt grows the window; a throttled or timed out one must
+ * pass -1 so it doesn't undo the back off 'onThrottled' just did.
+ * \param id
+ * \param rtt_msec time from send to ack/nack or -1 if not an ack/nack.
+ */
+void FcmDispatcher::onCompleted(int id, std::int64_t rtt_msec)
+{
+    auto it = __links.find(id);
+    if (it == __links.end())
+        return;
+
+    FcmLink& link = it->second;
+    if (link.inFlight > 0)
+        link.inFlight--;
+
+    if (rtt_msec < 0)
+        return;
+
+    if (link.acked == 0)
+        link.ackRttMsec = (double)rtt_msec;
+    else
+        link.ackRttMsec += RTT_EWMA_WEIGHT * ((double)rtt_msec - link.ackRttMsec);
+    link.acked++;
+
+    if (__congestionControl)
+    {
+        link.congestion.onAck(rtt_msec);
+        link.window = link.congestion.size();
+    }
+}
+
+
+/*!
+ * \brief FcmDispatcher::onThrottled
+ * FCM asked us to slow down on 'id' or an ack didn't come back in time. The
+ * message's slot is given back by 'onCompleted' as usual.
+ * \param id
+ */
+void FcmDispatcher::onThrottled(int id)
+{
+    auto it = __links.find(id);
+    if (it == __links.end())
+        return;
+
+    FcmLink& link = it->second;
+    link.throttled++;
+    if (__congestionControl)
+    {
+        link.congestion.onThrottled();
+        link.window = link.congestion.size();
+    }
+}
+
+
+/*!
+ * \brief FcmDispatcher::resetInFlight
+ * The link went away; nothing sent on it will be acked anymore. Its window
+ * starts over for the reconnect.
+ * \param id
+ */
+void FcmDispatcher::resetInFlight(int id)
+{
+    auto it = __links.find(id);
+    if (it == __links.end())
+        return;
+
+    FcmLink& link = it->second;
+    link.inFlight = 0;
+    link.congestion.reset(__initialWindow);
+    link.window   = link.congestion.size();
+}
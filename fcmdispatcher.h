@@ -0,0 +1,113 @@
+#ifndef FCMDISPATCHER_H
+#define FCMDISPATCHER_H
+
+#include "congestionwindow.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+
+#define NO_FCM_CONNECTION   0   // fcm connection ids start at 1.
+
+
+/*!
+ * \brief The DispatchPolicy enum
+ * How a downstream message is assigned to one of the pooled FCM connections.
+ * FREE_WINDOW : connection with the most free slots in its window.
+ * ACK_LATENCY : connection with the lowest smoothed ack round trip time.
+ * TOKEN_HASH  : connection picked by a hash of the device token so that the
+ *               messages of one device stay on one connection.
+ */
+enum class DispatchPolicy: char
+{
+    FREE_WINDOW = 'W',
+    ACK_LATENCY = 'L',
+    TOKEN_HASH  = 'H'
+};
+
+
+/*!
+ * \brief The FcmLink struct
+ * Dispatcher side view of one FCM connection.
+ */
+struct FcmLink
+{
+    int             id;
+    bool            authenticated;
+    bool            draining;
+    bool            blocked;    // socket output above its high watermark.
+    bool            standby;    // authenticated spare, takes no traffic until promoted.
+    std::int64_t    inFlight;   // messages sent on this link awaiting ack/nack.
+    std::int64_t    window;     // max in flight, 'congestion' size when adaptive.
+    double          ackRttMsec; // smoothed ack round trip time, 0 until measured.
+    std::uint64_t   acked;      // # of ack/nack received.
+    std::uint64_t   throttled;  // # of throttling nacks and lost acks.
+    CongestionWindow congestion;
+
+    bool healthy() const { return authenticated && !draining;}
+    bool usable() const { return healthy() && !blocked && !standby;}
+    std::int64_t freeSlots() const { return inFlight < window ? window - inFlight : 0;}
+};
+
+typedef std::map<int, FcmLink> FcmLinkMap_t;
+
+
+/*!
+ * \brief The FcmDispatcher class
+ * Keeps the per connection flow control accounting for the FCM connection
+ * pool and picks the connection each downstream message goes out on. CCS
+ * enforces its 100 pending message limit per connection, so the pool window
+ * is the sum of the windows of the usable connections.
+ *
+ * With congestion control on, each connection's window adapts between 1 and
+ * that limit to how fast FCM acks; otherwise it stays at the limit.
+ */
+class FcmDispatcher
+{
+        DispatchPolicy      __policy;
+        std::int64_t        __window;
+        bool                __congestionControl;
+        std::int64_t        __initialWindow;
+        FcmLinkMap_t        __links;
+    public:
+        FcmDispatcher(DispatchPolicy policy = DispatchPolicy::FREE_WINDOW,
+                      std::int64_t window = DEFAULT_MAX_WINDOW);
+
+        //setters
+        void                setPolicy(DispatchPolicy policy) { __policy = policy;}
+        void                setMaxWindow(std::int64_t window);
+        void                setAuthenticated(int id, bool val);
+        void                setDraining(int id, bool val);
+        void                setBlocked(int id, bool val);
+        void                setStandby(int id, bool val);
+        void                setCongestionControl(bool enabled,
+                                                 std::int64_t initial_window = DEFAULT_INITIAL_WINDOW);
+
+        //getters
+        DispatchPolicy      getPolicy() const { return __policy;}
+        std::int64_t        getWindow() const { return __window;}
+        bool                isCongestionControlled() const { return __congestionControl;}
+        std::int64_t        getInitialWindow() const { return __initialWindow;}
+        const FcmLinkMap_t& getLinks() const { return __links;}
+        const FcmLink*      findLink(int id) const;
+        bool                isUsable(int id) const;
+        bool                isHealthy(int id) const;
+        std::int64_t        getFreeSlots() const;
+        std::size_t         countActive() const;
+        std::size_t         countStandby() const;
+        int                 findStandby() const;
+
+        void                addLink(int id);
+        void                removeLink(int id);
+        int                 pick(const std::string& token) const;
+        void                onSent(int id);
+        void                onCompleted(int id, std::int64_t rtt_msec = -1);
+        void                onThrottled(int id);
+        void                resetInFlight(int id);
+
+        static DispatchPolicy policyFromString(const std::string& name);
+        static std::uint32_t  hashToken(const std::string& token);
+};
+
+#endif // FCMDISPATCHER_H
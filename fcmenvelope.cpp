@@ -0,0 +1,88 @@
+#include "fcmenvelope.h"
+#include "message.h"
+
+#include <QJsonValue>
+
+
+/*!
+ * \brief to_std_string
+ * \param value
+ * \return UTF-8 string or "" if 'value' isn't a string.
+ */
+static std::string to_std_string(const QJsonValue& value)
+{
+    return value.isString() ? value.toString().toStdString() : std::string();
+}
+
+
+/*!
+ * \brief FcmEnvelope::decode
+ * \param root top level object of an FCM stanza.
+ * \return
+ */
+FcmEnvelope FcmEnvelope::decode(const QJsonObject& root)
+{
+    FcmEnvelope envelope;
+    QJsonValue type = root.value(fcmfieldnames::MESSAGE_TYPE);
+    if (type.isUndefined())
+    {
+        envelope.type = FcmMessageType::UPSTREAM;
+    }
+    else
+    {
+        envelope.typeName = to_std_string(type);
+        envelope.type     = typeFromString(envelope.typeName);
+    }
+    envelope.messageId        = to_std_string(root.value(fcmfieldnames::MESSAGE_ID));
+    envelope.from             = to_std_string(root.value(fcmfieldnames::FROM));
+    envelope.category         = to_std_string(root.value(fcmfieldnames::CATEGORY));
+    envelope.error            = to_std_string(root.value(fcmfieldnames::ERROR));
+    envelope.errorDescription = to_std_string(root.value(fcmfieldnames::ERROR_DESC));
+    envelope.controlType      = to_std_string(root.value(fcmfieldnames::CONTROL_TYPE));
+    return envelope;
+}
+
+
+/*!
+ * \brief FcmEnvelope::typeFromString
+ * \param name value of 'message_type'.
+ * \return UNKNOWN for anything FCM doesn't document.
+ */
+FcmMessageType FcmEnvelope::typeFromString(const std::string& name)
+{
+    if (name == "ack")
+        return FcmMessageType::ACK;
+    else if (name == "nack")
+        return FcmMessageType::NACK;
+    else if (name == "receipt")
+        return FcmMessageType::RECEIPT;
+    else if (name == "control")
+        return FcmMessageType::CONTROL;
+    return FcmMessageType::UNKNOWN;
+}
+
+
+/*!
+ * \brief FcmEnvelope::toJson
+ * Rebuilds the FCM fields that were present, e.g. to forward an ack to a BAL.
+ * \return
+ */
+QJsonObject FcmEnvelope::toJson() const
+{
+    QJsonObject root;
+    if (!typeName.empty())
+        root[fcmfieldnames::MESSAGE_TYPE] = typeName.c_str();
+    if (!messageId.empty())
+        root[fcmfieldnames::MESSAGE_ID] = messageId.c_str();
+    if (!from.empty())
+        root[fcmfieldnames::FROM] = from.c_str();
+    if (!category.empty())
+        root[fcmfieldnames::CATEGORY] = category.c_str();
+    if (!error.empty())
+        root[fcmfieldnames::ERROR] = error.c_str();
+    if (!errorDescription.empty())
+        root[fcmfieldnames::ERROR_DESC] = errorDescription.c_str();
+    if (!controlType.empty())
+        root[fcmfieldnames::CONTROL_TYPE] = controlType.c_str();
+    return root;
+}
@@ -0,0 +1,48 @@
+#ifndef FCMENVELOPE_H
+#define FCMENVELOPE_H
+
+#include <QJsonObject>
+
+#include <string>
+
+
+/*!
+ * \brief The FcmMessageType enum
+ * FCM 'message_type' of a stanza; a stanza without one is an upstream message.
+ */
+enum class FcmMessageType:char
+{
+    UNKNOWN     = 0,
+    UPSTREAM    = 'U',
+    ACK         = 'A',
+    NACK        = 'N',
+    RECEIPT     = 'R',
+    CONTROL     = 'C'
+};
+
+
+/*!
+ * \brief The FcmEnvelope struct
+ * The routing fields of an FCM stanza, decoded once from the parsed JSON.
+ * Nacks travel as an envelope only; everything forwarded to the BAL keeps
+ * the original JSON next to it.
+ */
+struct FcmEnvelope
+{
+    FcmMessageType  type;
+    std::string     typeName;   // raw 'message_type'; kept for UNKNOWN.
+    std::string     messageId;
+    std::string     from;
+    std::string     category;
+    std::string     error;
+    std::string     errorDescription;
+    std::string     controlType;
+
+    FcmEnvelope():type(FcmMessageType::UNKNOWN) {}
+
+    static FcmEnvelope      decode(const QJsonObject& root);
+    static FcmMessageType   typeFromString(const std::string& name);
+    QJsonObject             toJson() const;
+};
+
+#endif // FCMENVELOPE_H
@@ -0,0 +1,140 @@
+#include "fcmproject.h"
+
+#include <iostream>
+
+
+/*!
+ * \brief FcmProject::FcmProject
+ * \param name          project name BAL downstream messages are routed by.
+ * \param session_id    session id of the downstream queue.
+ */
+FcmProject::FcmProject(const std::string& name, const std::string& session_id)
+    :__name(name),
+     __portNo(0),
+     __poolSize(1),
+     __standbyCount(0),
+     __sendRate(0, 1),
+     __sendRatePerSec(0),
+     __sendRateTimer(INVALID_TIMER_HANDLE),
+     __sendRateWaits(0),
+     __msgManager(session_id)
+{
+}
+
+
+/*!
+ * \brief FcmProject::setPoolSize
+ * CCS allows MAX_PENDING_MESSAGES per connection, the queue lets as many
+ * go out for the whole pool.
+ * \param size
+ */
+void FcmProject::setPoolSize(int size)
+{
+    __poolSize = size;
+    __msgManager.setMaxPendingAllowed(size * MAX_PENDING_MESSAGES);
+}
+
+
+/*!
+ * \brief FcmProject::setSendRate
+ * \param per_sec   0 = unlimited.
+ * \param burst
+ * \param now
+ */
+void FcmProject::setSendRate(double per_sec, double burst, std::int64_t now)
+{
+    __sendRatePerSec = per_sec;
+    __sendRate = TokenBucket(per_sec > 0 ? 1000 / per_sec : 0, burst, now);
+}
+
+
+/*!
+ * \brief FcmProject::admitSend
+ * The project send rate check every downstream send goes through. The token
+ * itself is taken when the message is uploaded.
+ * \param now
+ * \return false if there is no token; the caller waits for the send rate
+ *         timer and the wait is counted.
+ */
+bool FcmProject::admitSend(std::int64_t now)
+{
+    if (__sendRate.isReady(now))
+        return true;
+
+    __sendRateWaits++;
+    return false;
+}
+
+
+/*!
+ * \brief FcmProject::resendPass
+ * Walks the queue after a reconnect or standby promotion. Messages still in
+ * flight on a healthy connection are left alone. The pass ends when the pool
+ * is full or at the first message the send rate has no token for; the rest
+ * waits for the send rate timer, so only one wait is counted.
+ * \param msgs    snapshot of the queue, in sequence order.
+ * \param now
+ * \param resend  sends one message; takes its token.
+ * \return the message the pass stopped at for want of a token, null if none.
+ */
+MessagePtr_t FcmProject::resendPass(
+        const std::vector<MessagePtr_t>& msgs,
+        std::int64_t now,
+        const std::function<void(MessagePtr_t&)>& resend)
+{
+    MessagePtr_t waiting;
+    for (auto&& m: msgs)
+    {
+        MessagePtr_t msg = m;
+        // the pool is full, the rest goes out as acks free up slots.
+        if (__dispatcher.getFreeSlots() == 0)
+            break;
+
+        // still in flight on a healthy connection.
+        if (msg->getState() == MessageState::PENDING_ACK &&
+            __dispatcher.isHealthy(msg->getConnectionId()))
+        {
+            continue;
+        }
+
+        //skip all non downstream message. Just a safety check for clumsy people.
+        if (msg->getType() != MessageType::DOWNSTREAM)
+        {
+            std::cout << "WARNING: Non downstream message with id ["
+                      << msg ->getMessageIdentifier()
+                      << "] found. This shouldn't happen!" << std::endl;
+            continue;
+        }
+
+        if (!admitSend(now))
+        {
+            waiting = msg;
+            break;
+        }
+        resend(msg);
+    }
+    return waiting;
+}
+
+
+/*!
+ * \brief routeFcmProject
+ * \param projects        name --> project.
+ * \param default_project takes the messages with no 'project' field.
+ * \param name            'project' field of a BAL message.
+ * \return the project or a null ptr if none is configured under 'name'.
+ */
+FcmProjectPtr_t routeFcmProject(
+        const FcmProjectMap_t& projects,
+        const FcmProjectPtr_t& default_project,
+        const std::string& name)
+{
+    if (name.empty())
+        return default_project;
+
+    auto it = projects.find(name);
+    if (it != projects.end())
+        return it->second;
+    FcmProjectPtr_t nullproject;
+    return nullproject;
+}
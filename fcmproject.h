@@ -0,0 +1,104 @@
+#ifndef FCMPROJECT_H
+#define FCMPROJECT_H
+
+#include "messagemanager.h"
+#include "fcmdispatcher.h"
+#include "recipientratelimiter.h"
+#include "tokenbucket.h"
+#include "timingwheel.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QString>
+
+
+#define DEFAULT_FCM_PROJECT         "default"   // name of the FCM_SECTION project.
+#define DEFAULT_FCM_SESSION_ID      "fcm"       // queue of the FCM_SECTION project.
+
+
+// Key = recipient ('to'), Val = timer releasing its held messages.
+typedef std::map<std::string, TimerHandle_t> HoldTimerMap_t;
+
+
+/*!
+ * \brief The FcmProject class
+ * Everything that belongs to one Firebase project (sender id): credentials,
+ * the connection pool's dispatch/window accounting, the downstream queue and
+ * the send rate limits. Projects share the process, the db and the BAL
+ * sessions but never each others queue or connections, so a slow or
+ * throttled project can't hold up the others.
+ *
+ * The queue's session id is the 'target_session' of the project's downstream
+ * rows, which is how they find their way back after a restart.
+ */
+class FcmProject
+{
+        std::string             __name;             // 'project' field of BAL downstream msgs.
+        QString                 __serverId;
+        QString                 __serverKey;
+        QString                 __hostAddress;
+        quint16                 __portNo;
+        int                     __poolSize;         // # of connections carrying traffic.
+        int                     __standbyCount;     // # of authenticated spare connections.
+        FcmDispatcher           __dispatcher;       // picks the connection for each downstream msg.
+        RecipientRateLimiter    __rateLimiter;      // per device/topic limits learned from nacks.
+        TokenBucket             __sendRate;         // project wide downstream send rate.
+        double                  __sendRatePerSec;   // 0 = unlimited.
+        TimerHandle_t           __sendRateTimer;    // armed while messages wait for a token.
+        std::uint64_t           __sendRateWaits;
+        HoldTimerMap_t          __holdTimers;       // one per rate limited recipient.
+        MessageManager          __msgManager;       // downstream queue.
+    public:
+        FcmProject(const std::string& name, const std::string& session_id);
+
+        //setters
+        void                    setServerId(const QString& id) { __serverId = id;}
+        void                    setServerKey(const QString& key) { __serverKey = key;}
+        void                    setHostAddress(const QString& addr) { __hostAddress = addr;}
+        void                    setPortNo(quint16 port) { __portNo = port;}
+        void                    setPoolSize(int size);
+        void                    setStandbyCount(int count) { __standbyCount = count;}
+        void                    setSendRate(double per_sec, double burst, std::int64_t now);
+        void                    setSendRateTimer(TimerHandle_t handle) { __sendRateTimer = handle;}
+
+        //getters
+        const std::string&      getName() const { return __name;}
+        const QString&          getServerId() const { return __serverId;}
+        const QString&          getServerKey() const { return __serverKey;}
+        const QString&          getHostAddress() const { return __hostAddress;}
+        quint16                 getPortNo() const { return __portNo;}
+        int                     getPoolSize() const { return __poolSize;}
+        int                     getStandbyCount() const { return __standbyCount;}
+        double                  getSendRatePerSec() const { return __sendRatePerSec;}
+        double                  getSendBurst() const { return __sendRate.getBurst();}
+        TimerHandle_t           getSendRateTimer() const { return __sendRateTimer;}
+        std::uint64_t           getSendRateWaits() const { return __sendRateWaits;}
+        FcmDispatcher&          getDispatcher() { return __dispatcher;}
+        RecipientRateLimiter&   getRateLimiter() { return __rateLimiter;}
+        HoldTimerMap_t&         getHoldTimers() { return __holdTimers;}
+        TokenBucket&            getSendRate() { return __sendRate;}
+        MessageManager&         getMessageManager() { return __msgManager;}
+
+        bool                    admitSend(std::int64_t now);
+        MessagePtr_t            resendPass(const std::vector<MessagePtr_t>& msgs,
+                                           std::int64_t now,
+                                           const std::function<void(MessagePtr_t&)>& resend);
+};
+
+/*!
+ * \brief FcmProjectPtr_t
+ */
+typedef std::shared_ptr<FcmProject> FcmProjectPtr_t;
+// Key = project name, Val = project.
+typedef std::map<std::string, FcmProjectPtr_t> FcmProjectMap_t;
+
+FcmProjectPtr_t routeFcmProject(const FcmProjectMap_t& projects,
+                                const FcmProjectPtr_t& default_project,
+                                const std::string& name);
+
+#endif // FCMPROJECT_H
@@ -0,0 +1,113 @@
+#include "keepalivetracker.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <sstream>
+
+
+/*!
+ * \brief KeepaliveTracker::KeepaliveTracker
+ * \param ping_interval_msec    receive idle time after which we ping.
+ * \param idle_timeout_msec     receive idle time after which the connection
+ *                              is considered dead.
+ */
+KeepaliveTracker::KeepaliveTracker(std::int64_t ping_interval_msec,
+                                   std::int64_t idle_timeout_msec)
+    :__pingInterval(ping_interval_msec),
+     __idleTimeout(idle_timeout_msec),
+     __lastReceived(0),
+     __lastPing(0),
+     __maxGap(0)
+{
+}
+
+
+/*!
+ * \brief KeepaliveTracker::reset
+ * Call when a connection (re)starts; 'now' counts as the last receive.
+ * \param now
+ */
+void KeepaliveTracker::reset(std::int64_t now)
+{
+    __lastReceived  = now;
+    __lastPing      = now;
+}
+
+
+/*!
+ * \brief KeepaliveTracker::onReceived
+ * \param now
+ */
+void KeepaliveTracker::onReceived(std::int64_t now)
+{
+    __maxGap = std::max(__maxGap, now - __lastReceived);
+    __lastReceived = now;
+}
+
+
+/*!
+ * \brief KeepaliveTracker::onPingSent
+ * \param now
+ */
+void KeepaliveTracker::onPingSent(std::int64_t now)
+{
+    __lastPing = now;
+}
+
+
+/*!
+ * \brief KeepaliveTracker::check
+ * \param now
+ * \return what is due at 'now'. A dead connection wins over a ping.
+ */
+KeepaliveAction KeepaliveTracker::check(std::int64_t now) const
+{
+    std::int64_t idle = getIdle(now);
+    if (__idleTimeout > 0 && idle >= __idleTimeout)
+        return KeepaliveAction::DEAD;
+
+    // one ping per interval while nothing comes back.
+    if (__pingInterval > 0 && idle >= __pingInterval &&
+            now - __lastPing >= __pingInterval)
+    {
+        return KeepaliveAction::PING;
+    }
+    return KeepaliveAction::NONE;
+}
+
+
+/*!
+ * \brief KeepaliveTracker::nextCheckAt
+ * \return time at which 'check' may return something other than NONE, or -1
+ *         if both the pings and the idle timeout are off.
+ */
+std::int64_t KeepaliveTracker::nextCheckAt() const
+{
+    std::int64_t at = -1;
+    if (__pingInterval > 0)
+        at = std::max(__lastReceived, __lastPing) + __pingInterval;
+    if (__idleTimeout > 0)
+    {
+        std::int64_t dead = __lastReceived + __idleTimeout;
+        at = at < 0 ? dead : std::min(at, dead);
+    }
+    return at;
+}
+
+
+/*!
+ * \brief KeepaliveTracker::modeFromString
+ * \param name whitespace|xmpp
+ * \return
+ */
+KeepaliveMode KeepaliveTracker::modeFromString(const std::string& name)
+{
+    if (name == "whitespace")
+        return KeepaliveMode::WHITESPACE;
+    else if (name == "xmpp")
+        return KeepaliveMode::XMPP_PING;
+
+    std::stringstream err;
+    err << "Unknown keepalive mode[" << name << "]";
+    THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+}
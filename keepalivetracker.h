@@ -0,0 +1,77 @@
+#ifndef KEEPALIVETRACKER_H
+#define KEEPALIVETRACKER_H
+
+#include <cstdint>
+#include <string>
+
+
+#define DEFAULT_PING_INTERVAL   30000   // msec
+#define DEFAULT_IDLE_TIMEOUT    75000   // msec
+
+
+/*!
+ * \brief The KeepaliveMode enum
+ * WHITESPACE : a single ' ' between stanzas; keeps NATs/proxies open but FCM
+ *              doesn't answer it.
+ * XMPP_PING  : XEP-0199 <iq type="get"><ping/></iq>; any reply, an error
+ *              included, proves the connection is alive.
+ */
+enum class KeepaliveMode: char
+{
+    WHITESPACE  = 'W',
+    XMPP_PING   = 'X'
+};
+
+
+/*!
+ * \brief The KeepaliveAction enum
+ */
+enum class KeepaliveAction: char
+{
+    NONE    = 'N',
+    PING    = 'P',  // nothing received for a ping interval.
+    DEAD    = 'D'   // nothing received for the idle timeout.
+};
+
+
+/*!
+ * \brief The KeepaliveTracker class
+ * Liveness bookkeeping of one connection. Every byte received counts, FCM's
+ * whitespace heartbeats and the replies to our own pings included. Times are
+ * in msec on any monotonic clock; a 0 interval/timeout turns that part off.
+ *
+ * The owner arms a single timer at 'nextCheckAt' and calls 'check' when it
+ * fires, so an idle connection doesn't wake up between deadlines.
+ */
+class KeepaliveTracker
+{
+        std::int64_t    __pingInterval;
+        std::int64_t    __idleTimeout;
+        std::int64_t    __lastReceived;
+        std::int64_t    __lastPing;
+        std::int64_t    __maxGap;   // longest receive gap seen.
+    public:
+        KeepaliveTracker(std::int64_t ping_interval_msec = DEFAULT_PING_INTERVAL,
+                         std::int64_t idle_timeout_msec = DEFAULT_IDLE_TIMEOUT);
+
+        //setters
+        void            setPingInterval(std::int64_t msec) { __pingInterval = msec;}
+        void            setIdleTimeout(std::int64_t msec) { __idleTimeout = msec;}
+
+        //getters
+        std::int64_t    getPingInterval() const { return __pingInterval;}
+        std::int64_t    getIdleTimeout() const { return __idleTimeout;}
+        std::int64_t    getLastReceived() const { return __lastReceived;}
+        std::int64_t    getMaxGap() const { return __maxGap;}
+        std::int64_t    getIdle(std::int64_t now) const { return now - __lastReceived;}
+
+        void            reset(std::int64_t now);
+        void            onReceived(std::int64_t now);
+        void            onPingSent(std::int64_t now);
+        KeepaliveAction check(std::int64_t now) const;
+        std::int64_t    nextCheckAt() const;
+
+        static KeepaliveMode modeFromString(const std::string& name);
+};
+
+#endif // KEEPALIVETRACKER_H
@@ -1,12 +1,18 @@
 #include "message.h"
 
+#include <algorithm>
 #include <sstream>
 
 Message::Message()
     :__sequenceId(0),
      __type(MessageType::UNKNOWN),
      __state(MessageState::UNKNOWN),
-     __retryInProgress(false)
+     __expiresAt(NO_EXPIRY),
+     __connectionId(0),
+     __sentAt(0),
+     __retryCount(0),
+     __retryInProgress(false),
+     __held(false)
 {
 }
 
@@ -39,9 +45,12 @@ Message::Message(
      __groupId(gid),
      __state(state),
      __payload(payload),
-     __nRetry(0),
-     __maxRetry(-1),
-     __retryInProgress(false)
+     __expiresAt(NO_EXPIRY),
+     __connectionId(0),
+     __sentAt(0),
+     __retryCount(0),
+     __retryInProgress(false),
+     __held(false)
 {
 }
 
@@ -60,7 +69,14 @@ const Message& Message::operator =(const Message& rhs)
         this->__sourceSessionId     = rhs.__sourceSessionId;
         this->__targetSessionId     = rhs.__targetSessionId;
         this->__state               = rhs.__state;
-        this->__exboff              = rhs.__exboff;
+        this->__expiresAt           = rhs.__expiresAt;
+        this->__collapseKey         = rhs.__collapseKey;
+        this->__to                  = rhs.__to;
+        this->__connectionId        = rhs.__connectionId;
+        this->__sentAt              = rhs.__sentAt;
+        this->__retryCount          = rhs.__retryCount;
+        this->__retryInProgress     = rhs.__retryInProgress;
+        this->__held                = rhs.__held;
 
         QJsonDocument& p  = *(rhs.__payload);
         this->__payload.reset(new QJsonDocument(p));
@@ -83,14 +99,92 @@ std::string Message::getMessageIdentifier()const
     return id.str();
 }
 
-int Message::getNextRetryTimeout() 
+
+/*!
+ * \brief Message::computeExpiry
+ * FCM keeps a message for 'time_to_live' secs (4 weeks when absent). Past that
+ * it is discarded by FCM, so there is no point in uploading it. A ttl of 0
+ * means "deliver now or never"; such a message still gets ZERO_TTL_GRACE_MSEC
+ * to be uploaded, or it would be expired before its first dispatch.
+ * \param fcm_data downstream message as sent to FCM.
+ * \param now_msec msec since epoch.
+ * \return absolute expiry in msec since epoch.
+ */
+std::int64_t Message::computeExpiry(const QJsonObject& fcm_data, std::int64_t now_msec)
 {
-    __nRetry++;
+    std::int64_t ttl = fcm_data.value(fcmfieldnames::TIME_TO_LIVE).toInt(MAX_TTL);
+    if (ttl < MIN_TTL)
+        ttl = MIN_TTL;
+    else if (ttl > MAX_TTL)
+        ttl = MAX_TTL;
+    return now_msec + std::max<std::int64_t>(ttl * 1000, ZERO_TTL_GRACE_MSEC);
+}
 
-    if ( __maxRetry != -1)
-    {
-        if ( __nRetry > __maxRetry)
-            return -1;
-    }
-    return __exboff.next();
+
+/*!
+ * \brief Message::collapseKeyFromPayload
+ * \param fcm_data downstream message as sent to FCM.
+ * \return (to, collapse_key); collapse_key is empty if the message has none.
+ */
+CollapseKey_t Message::collapseKeyFromPayload(const QJsonObject& fcm_data)
+{
+    return CollapseKey_t(
+                fcm_data.value(fcmfieldnames::TO).toString().toStdString(),
+                fcm_data.value(fcmfieldnames::COLLAPSE_KEY).toString().toStdString());
+}
+
+
+/*!
+ * \brief Message::toFromPayload
+ * \param fcm_data downstream message as sent to FCM.
+ * \return the 'to' (registration token or topic), empty if there is none.
+ */
+std::string Message::toFromPayload(const QJsonObject& fcm_data)
+{
+    return fcm_data.value(fcmfieldnames::TO).toString().toStdString();
+}
+
+
+/*!
+ * \brief Message::createDownstreamReject
+ * The DOWNSTREAM_REJECT telling a BAL session its downstream message won't be
+ * delivered.
+ * \param seqid           sequence id of the reject.
+ * \param project_name    'project' field of the reject.
+ * \param fcm_session_id  source session of the reject; the project's queue.
+ * \param rejected        the downstream message, as the BAL sent it.
+ * \param reason          goes out as the error description.
+ * \return
+ */
+MessagePtr_t Message::createDownstreamReject(
+        SequenceId_t seqid,
+        const std::string& project_name,
+        const SessionId_t& fcm_session_id,
+        const Message& rejected,
+        const std::string& reason)
+{
+    //failure goes to the source session.
+    const SessionId_t& sessid = rejected.getSourceSessionId();
+
+    QJsonDocument gimmm_msg;
+    QJsonObject root;
+    root[gimmmfieldnames::SEQUENCE_ID]  = (qint64)seqid;
+    root[gimmmfieldnames::MESSAGE_TYPE] = "DOWNSTREAM_REJECT";
+    root[gimmmfieldnames::SESSION_ID]   = sessid.c_str();
+    root[gimmmfieldnames::PROJECT]      = project_name.c_str();
+    root[gimmmfieldnames::ERROR_DESC]   = reason.c_str();
+    // original downstream message.
+    root[gimmmfieldnames::FCM_DATA]     = rejected.getPayload()->object();
+    gimmm_msg.setObject(root);
+
+    PayloadPtr_t pmsg(new QJsonDocument(gimmm_msg));
+    MessagePtr_t msgptr(new Message());
+    msgptr->setSequenceId(seqid);
+    msgptr->setType(MessageType::DOWNSTREAM_REJECT);
+    msgptr->setFcmMessageId(rejected.getFcmMessageId());
+    msgptr->setSourceSessionId(fcm_session_id);
+    msgptr->setTargetSessionId(sessid);
+    msgptr->setState(MessageState::NEW);
+    msgptr->setPayload(pmsg);
+    return msgptr;
 }
@@ -1,7 +1,6 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
-#include "exponentialbackoff.h"
 #include "macros.h"
 
 #include <iostream>
@@ -14,10 +13,13 @@
 
 #define MAX_TTL                         2419200 // Max time to live in secs(28 days)
 #define MIN_TTL                         0
+#define ZERO_TTL_GRACE_MSEC             1000    // a 'send now or never' msg may wait this long for a slot.
+#define NO_EXPIRY                       -1
 #define MAX_PENDING_MESSAGES            100
 #define MAX_DOWNSTREAM_UPLOAD_RETRY     10
 #define MAX_UPSTREAM_UPLOAD_RETRY       10
 #define MAX_LOGON_MSG_WAIT_TIME         10000 // in msec
+#define BAL_RESEND_DELAY                1000  // in msec
 
 class Message;
 
@@ -27,6 +29,7 @@ typedef std::int64_t                    SequenceId_t; // std::int64_t as string.
 typedef std::string                     SessionId_t;
 typedef std::shared_ptr<QJsonDocument>  PayloadPtr_t;
 typedef std::shared_ptr<Message> MessagePtr_t;
+typedef std::pair<std::string, std::string> CollapseKey_t; // (to, collapse_key)
 
 /*!
  * field names in the root JSON message inside a xmpp stanza
@@ -42,6 +45,8 @@ namespace fcmfieldnames
   static const char* const CATEGORY         = "category";
   static const char* const CONTROL_TYPE     = "control_type";
   static const char* const TO               = "to";
+  static const char* const TIME_TO_LIVE     = "time_to_live";
+  static const char* const COLLAPSE_KEY     = "collapse_key";
 }
 
 
@@ -56,6 +61,8 @@ namespace gimmmfieldnames
   static const char* const SESSION_ID       = "session_id";
   static const char* const ERROR_DESC       = "error_description";
   static const char* const FCM_DATA         = "fcm_data";
+  static const char* const SUPERSEDED_BY    = "superseded_by";
+  static const char* const PROJECT          = "project";
 }
 
 
@@ -93,7 +100,9 @@ enum class MessageState: char
     NEW             = 1,
     PENDING_ACK     = 2,
     DELIVERED       = 3,
-    DELIVERY_FAILED = 4
+    DELIVERY_FAILED = 4,
+    EXPIRED         = 5,    // time to live ran out before upload.
+    SUPERSEDED      = 6     // replaced by a newer message with the same collapse key before upload.
 };
 
 
@@ -109,11 +118,15 @@ class Message
         MessageState        __state;
         std::string         __lastUpdateDatetime; //YYYY-MM-DD HH:MM:SS.SSS
         PayloadPtr_t        __payload;
-        ExponentialBackoff  __exboff;
+        std::int64_t        __expiresAt; // msec since epoch or NO_EXPIRY.
+        CollapseKey_t       __collapseKey;
+        std::string         __to;           // registration token or topic of a downstream msg.
+        int                 __connectionId; // fcm connection carrying the message, 0 if none.
+        std::int64_t        __sentAt;       // msec, TimerService clock.
 
-        int                 __nRetry;
-        int                 __maxRetry;
+        int                 __retryCount;
         bool                __retryInProgress;
+        bool                __held;         // waits for its recipient's rate limit; see MessageManager::holdMessage.
         friend std::ostream &operator<< (std::ostream&, const Message&);
     public:
         Message();
@@ -139,8 +152,14 @@ class Message
         void setSourceSessionId(const SessionId_t& sid) { __sourceSessionId = sid;}
         void setState(MessageState state){__state = state;}
         void setPayload(PayloadPtr_t mptr) { __payload = mptr;}
-        void setMaxRetry(int max_retry) { __maxRetry = max_retry;}
+        void setExpiresAt(std::int64_t expires_at) { __expiresAt = expires_at;}
+        void setCollapseKey(const CollapseKey_t& key) { __collapseKey = key;}
+        void setTo(const std::string& to) { __to = to;}
+        void setConnectionId(int id) { __connectionId = id;}
+        void setSentAt(std::int64_t sent_at) { __sentAt = sent_at;}
+        void setRetryCount(int count) { __retryCount = count;}
         void setRetryInProgress(bool val) { __retryInProgress = val;}
+        void setHeld(bool val) { __held = val;}
 
         //getters
         const std::string&  getEnteredDatetime()const { return __enteredDatetime;}
@@ -153,11 +172,29 @@ class Message
         const SessionId_t&  getSourceSessionId()const { return __sourceSessionId;}
         MessageState        getState()const { return __state;}
         PayloadPtr_t        getPayload() const { return __payload;}
-        int                 getMaxRetry() const { return __maxRetry;}
-        bool                getRetryInProgress() const { return true;}
-
-        int getNextRetryTimeout();
+        std::int64_t        getExpiresAt() const { return __expiresAt;}
+        const CollapseKey_t& getCollapseKey() const { return __collapseKey;}
+        bool                hasCollapseKey() const { return !__collapseKey.second.empty();}
+        const std::string&  getTo() const { return __to;}
+        int                 getConnectionId() const { return __connectionId;}
+        std::int64_t        getSentAt() const { return __sentAt;}
+        int                 getRetryCount() const { return __retryCount;}
+        bool                getRetryInProgress() const { return __retryInProgress;}
+        bool                getHeld() const { return __held;}
+
+        int incrementRetryCount() { return ++__retryCount;}
+        bool isExpired(std::int64_t now_msec) const
+        { return __expiresAt != NO_EXPIRY && now_msec > __expiresAt;}
         std::string getMessageIdentifier()const;
+
+        static std::int64_t computeExpiry(const QJsonObject& fcm_data, std::int64_t now_msec);
+        static CollapseKey_t collapseKeyFromPayload(const QJsonObject& fcm_data);
+        static std::string   toFromPayload(const QJsonObject& fcm_data);
+        static MessagePtr_t  createDownstreamReject(SequenceId_t seqid,
+                                                    const std::string& project_name,
+                                                    const SessionId_t& fcm_session_id,
+                                                    const Message& rejected,
+                                                    const std::string& reason);
     private:
 };
 
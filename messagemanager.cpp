@@ -1,6 +1,8 @@
 #include "messagemanager.h"
+#include "fcmdispatcher.h"
 #include "macros.h"
 
+#include <algorithm>
 #include <sstream>
 
 
@@ -30,9 +32,15 @@ void MessageManager::addMessage(const SequenceId_t& seqid, const MessagePtr_t &m
 
     // add to messages
     __messages.emplace(seqid, msg);
+    if (msg->getState() == MessageState::NEW)
+        __unsent.insert(seqid);
 
     addToGroups(msg);
     //addToSessions(msg);
+
+    // grouped messages must all go out in order, so only ungrouped ones collapse.
+    if (msg->hasCollapseKey() && msg->getGroupId().empty())
+        __collapseKeys[msg->getCollapseKey()] = seqid;
 }
 
 
@@ -72,14 +80,24 @@ void MessageManager::removeMessage(const SequenceId_t &seqid)
     SessionId_t sessid = msg->getTargetSessionId();
 
     __messages.erase(seqid);
+    __unsent.erase(seqid);
+    removeFromHeld(msg);
     removeFromGroups(grpid, seqid);
     //removeFromSessions(sessid, seqid);
 
     // erase msg ->seqid mapping.
     __sequenceIdMap.erase(fcm_msgid);
 
-    if (msg->getState() == MessageState::PENDING_ACK)
+    if (__ackDeadlines.erase(seqid) != 0)
         decrementPendingAckCount();
+    releaseConnection(msg);
+
+    if (msg->hasCollapseKey())
+    {
+        auto it = __collapseKeys.find(msg->getCollapseKey());
+        if (it != __collapseKeys.end() && it->second == seqid)
+            __collapseKeys.erase(it);
+    }
 }
 
 
@@ -128,6 +146,8 @@ const MessagePtr_t MessageManager::findMessage(SequenceId_t seqid)const
  *         1 = bad state.
  *         2 = too many messages in pending ack.
  *         3 = there are message/messages from the same grp awaiting 'ack'.
+ *         4 = message is waiting for a scheduled retry.
+ *         5 = message is held for its recipient's rate limit.
  */
 int MessageManager::canSendMessage(const MessagePtr_t& msg)const
 {
@@ -136,8 +156,18 @@ int MessageManager::canSendMessage(const MessagePtr_t& msg)const
     {
         return 1;
     }
+    // retry rule; it will be sent when its retry fires.
+    if ( msg->getRetryInProgress())
+    {
+        return 4;
+    }
+    // hold rule; it will be sent when its recipient's hold timer releases it.
+    if ( msg->getHeld())
+    {
+        return 5;
+    }
     // pending count rule.
-    if ( getPendingAckCount() >= MAX_PENDING_MESSAGES)
+    if ( getPendingAckCount() >= __maxPendingAllowed)
     {
         return 2;
     }
@@ -164,6 +194,8 @@ int MessageManager::canSendMessage(const MessagePtr_t& msg)const
  *  1: Bad state
  *  2: Max pending message breached.
  *  3: There is another message of the same group ahead of 'msg'.
+ *  4: Message is waiting for a scheduled retry.
+ *  5: Message is held for its recipient's rate limit.
  */
 int MessageManager::canSendMessageOnReconnect(const MessagePtr_t& msg)const
 {
@@ -173,8 +205,18 @@ int MessageManager::canSendMessageOnReconnect(const MessagePtr_t& msg)const
     {
         return 1;
     }
+    // retry rule.
+    if ( msg->getRetryInProgress())
+    {
+        return 4;
+    }
+    // hold rule.
+    if ( msg->getHeld())
+    {
+        return 5;
+    }
     // pending count rule.
-    if ( getPendingAckCount() >= MAX_PENDING_MESSAGES)
+    if ( getPendingAckCount() >= __maxPendingAllowed)
     {
         return 2;
     }
@@ -194,14 +236,20 @@ int MessageManager::canSendMessageOnReconnect(const MessagePtr_t& msg)const
 
 /*!
  * \brief MessageManager::getNext
+ * Only looks at the unsent messages; the ones in flight or held for their
+ * recipient's rate limit aren't walked past.
  * \return
  */
 MessagePtr_t MessageManager::getNext()const
 {
-    for ( auto i: __messages)
+    if (getPendingAckCount() < __maxPendingAllowed)
     {
-        MessagePtr_t& msg = i.second;
-        if (canSendMessage(msg) == 0) return msg;
+        for ( auto&& seqid: __unsent)
+        {
+            auto it = __messages.find(seqid);
+            if (it != __messages.end() && canSendMessage(it->second) == 0)
+                return it->second;
+        }
     }
     //nothing left to send, return null msg
     MessagePtr_t nullmsg;
@@ -259,3 +307,286 @@ void MessageManager::removeMessageWithFcmMsgId(FcmMessageId_t fcm_msgid)
 }
 
 
+/*!
+ * \brief MessageManager::markPendingAck
+ * Moves 'msg' to PENDING_ACK. The message takes a window slot unless it
+ * already holds one, in which case only its deadline is refreshed.
+ * \param msg
+ * \param deadline time by which an ack/nack is expected or NO_ACK_DEADLINE.
+ */
+void MessageManager::markPendingAck(const MessagePtr_t& msg, std::int64_t deadline)
+{
+    msg->setState(MessageState::PENDING_ACK);
+    __unsent.erase(msg->getSequenceId());
+    auto it = __ackDeadlines.find(msg->getSequenceId());
+    if (it != __ackDeadlines.end())
+    {
+        it->second = deadline;
+        return;
+    }
+    __ackDeadlines.emplace(msg->getSequenceId(), deadline);
+    incrementPendingAckCount();
+}
+
+
+/*!
+ * \brief MessageManager::setAckDeadline
+ * \param seqid
+ * \param deadline NO_ACK_DEADLINE while the message keeps its slot but isn't
+ *        on the wire e.g waiting for a retry.
+ */
+void MessageManager::setAckDeadline(const SequenceId_t& seqid, std::int64_t deadline)
+{
+    auto it = __ackDeadlines.find(seqid);
+    if (it != __ackDeadlines.end())
+        it->second = deadline;
+}
+
+
+/*!
+ * \brief MessageManager::reclaimPendingAck
+ * Gives the window slot held by 'msg' back and moves it to the NEW state.
+ * \param msg
+ * \return true if 'msg' was holding a slot.
+ */
+bool MessageManager::reclaimPendingAck(const MessagePtr_t& msg)
+{
+    msg->setState(MessageState::NEW);
+    __unsent.insert(msg->getSequenceId());
+    if (__ackDeadlines.erase(msg->getSequenceId()) == 0)
+        return false;
+
+    decrementPendingAckCount();
+    return true;
+}
+
+
+/*!
+ * \brief MessageManager::assignConnection
+ * Records that 'msg' is in flight on fcm connection 'id', moving it off the
+ * connection it was on before.
+ * \param msg
+ * \param id NO_FCM_CONNECTION to only release it.
+ */
+void MessageManager::assignConnection(const MessagePtr_t& msg, int id)
+{
+    int old = msg->getConnectionId();
+    if (old != NO_FCM_CONNECTION)
+    {
+        auto it = __inFlightByConnection.find(old);
+        if (it != __inFlightByConnection.end())
+        {
+            it->second.erase(msg->getSequenceId());
+            if (it->second.empty())
+                __inFlightByConnection.erase(it);
+        }
+    }
+
+    msg->setConnectionId(id);
+    if (id != NO_FCM_CONNECTION)
+        __inFlightByConnection[id].insert(msg->getSequenceId());
+}
+
+
+/*!
+ * \brief MessageManager::releaseConnection
+ * \param msg
+ */
+void MessageManager::releaseConnection(const MessagePtr_t& msg)
+{
+    assignConnection(msg, NO_FCM_CONNECTION);
+}
+
+
+/*!
+ * \brief MessageManager::takeConnectionMessages
+ * Detaches every message in flight on connection 'id'. Only that connection's
+ * set is looked at, not the whole queue.
+ * \param id
+ * \param out  the detached messages in sequence order.
+ * \return # of messages added to 'out'.
+ */
+std::size_t MessageManager::takeConnectionMessages(int id, std::vector<MessagePtr_t>& out)
+{
+    auto it = __inFlightByConnection.find(id);
+    if (it == __inFlightByConnection.end())
+        return 0;
+
+    std::set<SequenceId_t> seqids;
+    seqids.swap(it->second);
+    __inFlightByConnection.erase(it);
+
+    std::size_t n = 0;
+    for (auto&& seqid : seqids)
+    {
+        auto msg = __messages.find(seqid);
+        if (msg == __messages.end())
+            continue;
+        msg->second->setConnectionId(NO_FCM_CONNECTION);
+        out.push_back(msg->second);
+        n++;
+    }
+    return n;
+}
+
+
+/*!
+ * \brief MessageManager::collectExpiredAcks
+ * Only messages holding a window slot are looked at, so this is bounded by
+ * the window size and not the queue size.
+ * \param now
+ * \param out  messages whose ack deadline passed.
+ * \return # of messages added to 'out'.
+ */
+std::size_t MessageManager::collectExpiredAcks(
+        std::int64_t now,
+        std::vector<MessagePtr_t>& out)const
+{
+    std::size_t n = 0;
+    for (auto&& i : __ackDeadlines)
+    {
+        if (i.second == NO_ACK_DEADLINE || i.second > now)
+            continue;
+
+        auto it = __messages.find(i.first);
+        if (it != __messages.end())
+        {
+            out.push_back(it->second);
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/*!
+ * \brief MessageManager::collectExpired
+ * Only messages yet to be uploaded expire here. One in flight on a healthy
+ * connection is FCM's now; its ack or nack still has to find it.
+ * \param now_msec   msec since epoch.
+ * \param out        queued messages whose time to live ran out, in sequence order.
+ * \param is_healthy tells if a fcm connection id still carries its messages.
+ * \return # of messages added to 'out'.
+ */
+std::size_t MessageManager::collectExpired(
+        std::int64_t now_msec,
+        std::vector<MessagePtr_t>& out,
+        const std::function<bool(int)>& is_healthy)const
+{
+    std::size_t n = 0;
+    for (auto&& i : __messages)
+    {
+        const MessagePtr_t& msg = i.second;
+        if (!msg->isExpired(now_msec))
+            continue;
+
+        MessageState state = msg->getState();
+        if (state == MessageState::PENDING_ACK && is_healthy(msg->getConnectionId()))
+            continue;
+        if (state != MessageState::NEW && state != MessageState::PENDING_ACK)
+            continue;
+
+        out.push_back(msg);
+        n++;
+    }
+    return n;
+}
+
+
+/*!
+ * \brief MessageManager::findSupersededMessage
+ * FCM only ever shows the latest message of a collapse key, so an older one
+ * that hasn't been uploaded yet is not worth sending once a newer one arrives.
+ * \param msg new message, not yet added.
+ * \return queued NEW message with the same (to, collapse_key) as 'msg' or a
+ *         null ptr.
+ */
+MessagePtr_t MessageManager::findSupersededMessage(const MessagePtr_t& msg)const
+{
+    MessagePtr_t nullmsg;
+    if (!msg->hasCollapseKey() || !msg->getGroupId().empty())
+        return nullmsg;
+
+    auto it = __collapseKeys.find(msg->getCollapseKey());
+    if (it == __collapseKeys.end())
+        return nullmsg;
+
+    auto it1 = __messages.find(it->second);
+    if (it1 == __messages.end() || it1->second->getState() != MessageState::NEW)
+        return nullmsg;
+    return it1->second;
+}
+
+
+/*!
+ * \brief MessageManager::holdMessage
+ * Queues 'msg' behind the other held messages of its recipient until the
+ * recipient's rate limit lets it go; see 'takeHeldMessage'. A held message
+ * isn't looked at by 'getNext'.
+ * \param msg
+ * \return true if 'msg' is the first one held for its recipient.
+ */
+bool MessageManager::holdMessage(const MessagePtr_t& msg)
+{
+    msg->setHeld(true);
+    __unsent.erase(msg->getSequenceId());
+    std::deque<SequenceId_t>& held = __heldByRecipient[msg->getTo()];
+    held.push_back(msg->getSequenceId());
+    return held.size() == 1;
+}
+
+
+/*!
+ * \brief MessageManager::takeHeldMessage
+ * Releases the oldest message held for 'to' back to the unsent ones.
+ * \param to
+ * \return null if nothing is held for 'to'.
+ */
+MessagePtr_t MessageManager::takeHeldMessage(const std::string& to)
+{
+    MessagePtr_t msg;
+    auto it = __heldByRecipient.find(to);
+    if (it == __heldByRecipient.end())
+        return msg;
+
+    SequenceId_t seqid = it->second.front();
+    it->second.pop_front();
+    if (it->second.empty())
+        __heldByRecipient.erase(it);
+
+    auto m = __messages.find(seqid);
+    if (m == __messages.end())
+        return msg;
+    msg = m->second;
+    msg->setHeld(false);
+    __unsent.insert(seqid);
+    return msg;
+}
+
+
+/*!
+ * \brief MessageManager::hasHeldMessages
+ * \param to
+ * \return true if messages to 'to' are held; a new one must queue up behind them.
+ */
+bool MessageManager::hasHeldMessages(const std::string& to)const
+{
+    return __heldByRecipient.find(to) != __heldByRecipient.end();
+}
+
+
+/*!
+ * \brief MessageManager::removeFromHeld
+ * \param msg
+ */
+void MessageManager::removeFromHeld(const MessagePtr_t& msg)
+{
+    auto it = __heldByRecipient.find(msg->getTo());
+    if (it == __heldByRecipient.end())
+        return;
+
+    std::deque<SequenceId_t>& held = it->second;
+    held.erase(std::remove(held.begin(), held.end(), msg->getSequenceId()), held.end());
+    if (held.empty())
+        __heldByRecipient.erase(it);
+}
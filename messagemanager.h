@@ -5,13 +5,22 @@
 #include "message.h"
 #include "dbconnection.h"
 
+#include <deque>
+#include <functional>
 #include <queue>
+#include <vector>
 #include <set>
 #include <sstream>
 
 
 typedef std::map<FcmMessageId_t, SequenceId_t>    SequenceIdMap_t;
 typedef std::map<SequenceId_t, MessagePtr_t>    MessageQueue_t;
+typedef std::map<SequenceId_t, std::int64_t>    AckDeadlineMap_t;
+typedef std::map<CollapseKey_t, SequenceId_t>   CollapseKeyMap_t;
+typedef std::map<int, std::set<SequenceId_t>>   ConnectionIndex_t;
+typedef std::map<std::string, std::deque<SequenceId_t>> HeldQueueMap_t;
+
+#define NO_ACK_DEADLINE -1
 
 /*!
  * \brief The Group class
@@ -98,11 +107,24 @@ class MessageManager
     //main queue that stores msg in order or reciept.
     MessageQueue_t                          __messages;//SequenceId_t, message. //TODO check for order.
     GroupMap_t                              __groups;// msgid --> group information .
+    // messages holding a window slot --> time by which an ack/nack is expected.
+    AckDeadlineMap_t                        __ackDeadlines;
+    // (to, collapse_key) --> newest ungrouped message with that key.
+    CollapseKeyMap_t                        __collapseKeys;
+    // fcm connection id --> messages in flight on it.
+    ConnectionIndex_t                       __inFlightByConnection;
+    // messages 'getNext' looks at; held and in flight ones are kept out.
+    std::set<SequenceId_t>                  __unsent;
+    // recipient ('to') --> messages held for its rate limit, oldest first.
+    HeldQueueMap_t                          __heldByRecipient;
 
     public:
         MessageManager(const std::string& sessionid,
                        std::int64_t maxpendingallowed = MAX_PENDING_MESSAGES);
 
+        // setters
+        void                    setMaxPendingAllowed(std::uint64_t max) { __maxPendingAllowed = max;}
+
         // getters
         std::string             getSessionId() const { return __sessionId;}
         std::uint64_t           getMaxPendingAllowed()const { return __maxPendingAllowed;}
@@ -111,6 +133,10 @@ class MessageManager
         std::uint64_t           getPendingAckCount()const { return __pendingAckCount;}
         MessageQueue_t&         getMessages() { return __messages;}
         const GroupMap_t&       getGroupsMap()const { return __groups;}
+        const AckDeadlineMap_t& getAckDeadlines()const { return __ackDeadlines;}
+        const CollapseKeyMap_t& getCollapseKeyMap()const { return __collapseKeys;}
+        const ConnectionIndex_t& getConnectionIndex()const { return __inFlightByConnection;}
+        const HeldQueueMap_t&   getHeldQueueMap()const { return __heldByRecipient;}
 
 
 
@@ -125,6 +151,25 @@ class MessageManager
         //convenience functions.
         const MessagePtr_t  findMessageWithFcmMsgId(FcmMessageId_t fcm_msgid)const;
         void                removeMessageWithFcmMsgId(FcmMessageId_t fcm_msgid);
+        // window slot/ack deadline tracking.
+        void                markPendingAck(const MessagePtr_t& msg, std::int64_t deadline);
+        void                setAckDeadline(const SequenceId_t& seqid, std::int64_t deadline);
+        bool                reclaimPendingAck(const MessagePtr_t& msg);
+        std::size_t         collectExpiredAcks(std::int64_t now, std::vector<MessagePtr_t>& out)const;
+        // carrying connection tracking.
+        void                assignConnection(const MessagePtr_t& msg, int id);
+        void                releaseConnection(const MessagePtr_t& msg);
+        std::size_t         takeConnectionMessages(int id, std::vector<MessagePtr_t>& out);
+        // time to live tracking.
+        std::size_t         collectExpired(std::int64_t now_msec,
+                                           std::vector<MessagePtr_t>& out,
+                                           const std::function<bool(int)>& is_healthy)const;
+        // collapse key coalescing.
+        MessagePtr_t        findSupersededMessage(const MessagePtr_t& msg)const;
+        // per recipient rate limit holds.
+        bool                holdMessage(const MessagePtr_t& msg);
+        MessagePtr_t        takeHeldMessage(const std::string& to);
+        bool                hasHeldMessages(const std::string& to)const;
 
     private:
         void                addToGroups(const MessagePtr_t& msg);
@@ -133,6 +178,7 @@ class MessageManager
         void                removeFromGroups(const GroupId_t& gid, const SequenceId_t& seqid);
         void                removeFromSessions(const SessionId_t& sessid, const SequenceId_t& seqid);
         SequenceId_t        findSequenceId(const FcmMessageId_t& msgid) const;
+        void                removeFromHeld(const MessagePtr_t& msg);
 };
 
 #endif // MESSAGEMANAGER_H
@@ -0,0 +1,158 @@
+#include "recipientratelimiter.h"
+
+#include <algorithm>
+
+
+/*!
+ * \brief RecipientRateLimiter::RecipientRateLimiter
+ * \param capacity              max # of limited recipients, 0 turns it off.
+ * \param initial_interval_msec interval after the first nack.
+ */
+RecipientRateLimiter::RecipientRateLimiter(std::size_t capacity,
+                                           std::int64_t initial_interval_msec)
+    :__capacity(capacity),
+     __initialInterval(initial_interval_msec),
+     __rateExceeded(0),
+     __evictions(0)
+{
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::setCapacity
+ * \param capacity
+ */
+void RecipientRateLimiter::setCapacity(std::size_t capacity)
+{
+    __capacity = capacity;
+    evict();
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::findInterval
+ * \param to
+ * \return current interval of 'to' or -1 if it isn't limited.
+ */
+double RecipientRateLimiter::findInterval(const std::string& to) const
+{
+    auto it = __entries.find(to);
+    if (it == __entries.end())
+        return -1;
+    return it->second.bucket.getInterval();
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::readyAt
+ * \param to
+ * \param now
+ * \return 'now' if a message to 'to' can go out, else when it can.
+ */
+std::int64_t RecipientRateLimiter::readyAt(const std::string& to, std::int64_t now) const
+{
+    auto it = __entries.find(to);
+    if (it == __entries.end())
+        return now;
+    return it->second.bucket.readyAt(now);
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::onSent
+ * \param to
+ * \param now
+ */
+void RecipientRateLimiter::onSent(const std::string& to, std::int64_t now)
+{
+    auto it = __entries.find(to);
+    if (it == __entries.end())
+        return;
+    it->second.bucket.take(now);
+    touch(it->second);
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::onRateExceeded
+ * FCM nacked a message to 'to' for sending too fast.
+ * \param to
+ * \param now
+ */
+void RecipientRateLimiter::onRateExceeded(const std::string& to, std::int64_t now)
+{
+    if (__capacity == 0 || to.empty())
+        return;
+
+    __rateExceeded++;
+    auto it = __entries.find(to);
+    if (it == __entries.end())
+    {
+        __lru.push_front(to);
+        Entry entry;
+        entry.bucket    = TokenBucket((double)__initialInterval, 1, now);
+        entry.delivered = 0;
+        entry.lru       = __lru.begin();
+        it = __entries.emplace(to, entry).first;
+        evict();
+    }
+    else
+    {
+        TokenBucket& bucket = it->second.bucket;
+        bucket.setInterval(std::min(bucket.getInterval() * 2, (double)MAX_RATE_LIMIT_INTERVAL));
+        it->second.delivered = 0;
+        touch(it->second);
+    }
+    it->second.bucket.drain(now);
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::onDelivered
+ * FCM acked a message to 'to'.
+ * \param to
+ */
+void RecipientRateLimiter::onDelivered(const std::string& to)
+{
+    auto it = __entries.find(to);
+    if (it == __entries.end())
+        return;
+
+    Entry& entry = it->second;
+    double interval = entry.bucket.getInterval();
+    if (interval > __initialInterval)
+    {
+        entry.bucket.setInterval(std::max(interval * RATE_LIMIT_RELAX, (double)__initialInterval));
+        return;
+    }
+    if (++entry.delivered >= RATE_LIMIT_FORGET_AFTER)
+    {
+        __lru.erase(entry.lru);
+        __entries.erase(it);
+    }
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::touch
+ * \param entry
+ */
+void RecipientRateLimiter::touch(Entry& entry)
+{
+    __lru.splice(__lru.begin(), __lru, entry.lru);
+}
+
+
+/*!
+ * \brief RecipientRateLimiter::evict
+ * Drops the least recently used entries over capacity.
+ */
+void RecipientRateLimiter::evict()
+{
+    while (__entries.size() > __capacity)
+    {
+        __entries.erase(__lru.back());
+        __lru.pop_back();
+        __evictions++;
+    }
+}
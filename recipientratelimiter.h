@@ -0,0 +1,71 @@
+#ifndef RECIPIENTRATELIMITER_H
+#define RECIPIENTRATELIMITER_H
+
+#include "tokenbucket.h"
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+
+#define DEFAULT_RATE_LIMIT_ENTRIES          10000
+#define DEFAULT_RATE_LIMIT_INTERVAL         1000    // msec between messages to a limited recipient.
+#define MAX_RATE_LIMIT_INTERVAL             300000  // msec
+#define RATE_LIMIT_RELAX                    0.75    // interval kept per delivered message.
+#define RATE_LIMIT_FORGET_AFTER             16      // deliveries at the initial interval.
+
+
+/*!
+ * \brief The RecipientRateLimiter class
+ * Send rate limits of individual devices/topics ('to'), learned from
+ * DEVICE_MESSAGE_RATE_EXCEEDED / TOPICS_MESSAGE_RATE_EXCEEDED nacks. FCM
+ * doesn't publish those limits, so a recipient isn't limited until it is
+ * nacked. Each further nack doubles its interval, each delivery relaxes it
+ * again, and a recipient delivering steadily at the initial interval is
+ * forgotten.
+ *
+ * Only hot recipients have an entry; the table is bounded and the least
+ * recently used entry makes room for a new one.
+ */
+class RecipientRateLimiter
+{
+        struct Entry
+        {
+            TokenBucket                         bucket;
+            std::uint32_t                       delivered;
+            std::list<std::string>::iterator    lru;
+        };
+
+        std::size_t                             __capacity;
+        std::int64_t                            __initialInterval;
+        std::unordered_map<std::string, Entry>  __entries;
+        std::list<std::string>                  __lru;  // most recently used first.
+        std::uint64_t                           __rateExceeded;
+        std::uint64_t                           __evictions;
+    public:
+        RecipientRateLimiter(std::size_t capacity = DEFAULT_RATE_LIMIT_ENTRIES,
+                             std::int64_t initial_interval_msec = DEFAULT_RATE_LIMIT_INTERVAL);
+
+        //setters
+        void            setCapacity(std::size_t capacity);
+        void            setInitialInterval(std::int64_t msec) { __initialInterval = msec;}
+
+        //getters
+        std::size_t     getCapacity() const { return __capacity;}
+        std::int64_t    getInitialInterval() const { return __initialInterval;}
+        std::size_t     size() const { return __entries.size();}
+        std::uint64_t   getRateExceeded() const { return __rateExceeded;}
+        std::uint64_t   getEvictions() const { return __evictions;}
+        double          findInterval(const std::string& to) const;
+
+        std::int64_t    readyAt(const std::string& to, std::int64_t now) const;
+        void            onSent(const std::string& to, std::int64_t now);
+        void            onRateExceeded(const std::string& to, std::int64_t now);
+        void            onDelivered(const std::string& to);
+    private:
+        void            touch(Entry& entry);
+        void            evict();
+};
+
+#endif // RECIPIENTRATELIMITER_H
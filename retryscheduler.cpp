@@ -0,0 +1,193 @@
+#include "retryscheduler.h"
+
+#include <algorithm>
+#include <sstream>
+
+
+/*!
+ * \brief heap_order
+ * std heap algorithms build a max heap; invert the comparison so that the
+ * entry due first sits at the front.
+ */
+static bool heap_order(const RetryEntry& lhs, const RetryEntry& rhs)
+{
+    if (lhs.due != rhs.due)
+        return lhs.due > rhs.due;
+    return lhs.sequenceId > rhs.sequenceId;
+}
+
+
+/*!
+ * \brief RetryPolicy::jitterFromString
+ * \param name none|full|equal
+ * \return
+ */
+JitterType RetryPolicy::jitterFromString(const std::string& name)
+{
+    if (name == "none")
+        return JitterType::NONE;
+    else if (name == "full")
+        return JitterType::FULL;
+    else if (name == "equal")
+        return JitterType::EQUAL;
+
+    std::stringstream err;
+    err << "Unknown jitter type[" << name << "]";
+    THROW_INVALID_ARGUMENT_EXCEPTION(err.str());
+}
+
+
+/*!
+ * \brief RetryScheduler::RetryScheduler
+ * \param policy
+ */
+RetryScheduler::RetryScheduler(const RetryPolicy& policy)
+    :__policy(policy),
+     __epoch(-1),
+     __engine(std::random_device()())
+{
+}
+
+
+/*!
+ * \brief RetryScheduler::getDelay
+ * \param attempt 1 based retry attempt.
+ * \return delay in msec or -1 if 'attempt' exceeds the policy max attempts.
+ */
+std::int64_t RetryScheduler::getDelay(int attempt)
+{
+    if (attempt < 1)
+        attempt = 1;
+
+    if (__policy.maxAttempts != NO_MAX_RETRY &&
+            attempt > __policy.maxAttempts)
+    {
+        return -1;
+    }
+
+    // base * 2^(attempt - 1) without overflowing for large attempts.
+    std::int64_t delay = __policy.baseMsec;
+    for (int i = 1; i < attempt && delay < __policy.capMsec; i++)
+        delay *= 2;
+    delay = std::min(delay, __policy.capMsec);
+
+    switch (__policy.jitter)
+    {
+        case JitterType::FULL:
+        {
+            std::uniform_int_distribution<std::int64_t> dist(0, delay);
+            delay = dist(__engine);
+            break;
+        }
+        case JitterType::EQUAL:
+        {
+            std::uniform_int_distribution<std::int64_t> dist(0, delay / 2);
+            delay = delay / 2 + dist(__engine);
+            break;
+        }
+        case JitterType::NONE:
+        default:
+            break;
+    }
+    return delay;
+}
+
+
+/*!
+ * \brief RetryScheduler::schedule
+ * \param seqid     message to retry.
+ * \param attempt   1 based retry attempt.
+ * \param now_msec  current time.
+ * \return delay in msec or -1 if the max attempts for the policy was reached
+ *         in which case nothing is scheduled.
+ */
+std::int64_t RetryScheduler::schedule(
+        SequenceId_t seqid,
+        int attempt,
+        std::int64_t now_msec)
+{
+    std::int64_t delay = getDelay(attempt);
+    if (delay == -1)
+        return -1;
+
+    scheduleAt(seqid, attempt, now_msec + delay, now_msec);
+    return delay;
+}
+
+
+/*!
+ * \brief RetryScheduler::scheduleAt
+ * Schedules 'seqid' for a given time regardless of the policy e.g to hold a
+ * message until a rate limit allows it.
+ * \param seqid
+ * \param attempt   reported back as is.
+ * \param due_msec
+ * \param now_msec  current time.
+ */
+void RetryScheduler::scheduleAt(
+        SequenceId_t seqid,
+        int attempt,
+        std::int64_t due_msec,
+        std::int64_t now_msec)
+{
+    if (__epoch == -1 || __heap.empty())
+        __epoch = now_msec;
+
+    std::int64_t due = std::max<std::int64_t>(due_msec - __epoch, 0);
+    due = std::min<std::int64_t>(due, UINT32_MAX);
+
+    RetryEntry entry;
+    entry.sequenceId    = seqid;
+    entry.due           = (std::uint32_t)due;
+    entry.attempt       = (std::uint16_t)std::min(std::max(attempt, 0), (int)UINT16_MAX);
+
+    __heap.push_back(entry);
+    std::push_heap(__heap.begin(), __heap.end(), heap_order);
+}
+
+
+/*!
+ * \brief RetryScheduler::takeDue
+ * Moves every entry due at or before 'now_msec' into 'out' in due order.
+ * \param now_msec
+ * \param out
+ * \param max_batch 0 = no limit.
+ * \return # of entries moved.
+ */
+std::size_t RetryScheduler::takeDue(
+        std::int64_t now_msec,
+        std::vector<RetryEntry>& out,
+        std::size_t max_batch)
+{
+    std::size_t n = 0;
+    while (!__heap.empty())
+    {
+        if (max_batch != 0 && n >= max_batch)
+            break;
+
+        const RetryEntry& front = __heap.front();
+        if (__epoch + (std::int64_t)front.due > now_msec)
+            break;
+
+        std::pop_heap(__heap.begin(), __heap.end(), heap_order);
+        out.push_back(__heap.back());
+        __heap.pop_back();
+        n++;
+    }
+    // give the memory back once a retry storm is over.
+    if (__heap.empty() && __heap.capacity() > 1024)
+        std::vector<RetryEntry>().swap(__heap);
+    return n;
+}
+
+
+/*!
+ * \brief RetryScheduler::nextDueTime
+ * \return absolute time of the earliest retry or -1 if nothing is scheduled.
+ */
+std::int64_t RetryScheduler::nextDueTime() const
+{
+    if (__heap.empty())
+        return -1;
+    return __epoch + (std::int64_t)__heap.front().due;
+}
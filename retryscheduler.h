@@ -0,0 +1,103 @@
+#ifndef RETRYSCHEDULER_H
+#define RETRYSCHEDULER_H
+
+#include "message.h"
+#include "exponentialbackoff.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+
+/*!
+ * \brief The JitterType enum
+ * How much randomness is mixed into a computed backoff delay.
+ * NONE  : delay = min(cap, base * 2^(attempt - 1))
+ * FULL  : delay = random(0, NONE delay)
+ * EQUAL : delay = NONE delay / 2 + random(0, NONE delay / 2)
+ */
+enum class JitterType: char
+{
+    NONE    = 'N',
+    FULL    = 'F',
+    EQUAL   = 'E'
+};
+
+
+/*!
+ * \brief The RetryPolicy struct
+ */
+struct RetryPolicy
+{
+    std::int64_t    baseMsec;
+    std::int64_t    capMsec;
+    int             maxAttempts;
+    JitterType      jitter;
+
+    RetryPolicy(std::int64_t base_msec = 1000,
+                std::int64_t cap_msec = 300000,
+                int max_attempts = MAX_DOWNSTREAM_UPLOAD_RETRY,
+                JitterType jitter_type = JitterType::EQUAL)
+        :baseMsec(base_msec),
+         capMsec(cap_msec),
+         maxAttempts(max_attempts),
+         jitter(jitter_type)
+    {}
+
+    static JitterType jitterFromString(const std::string& name);
+};
+
+
+/*!
+ * \brief The RetryEntry struct
+ * One pending retry. 'due' is stored relative to the scheduler epoch so that
+ * an entry packs into 16 bytes.
+ */
+struct RetryEntry
+{
+    SequenceId_t    sequenceId;
+    std::uint32_t   due;     // msec since scheduler epoch.
+    std::uint16_t   attempt;
+};
+
+
+/*!
+ * \brief The RetryScheduler class
+ * Central store for every message that is waiting to be retried. Instead of
+ * arming one timer per message, due retries are kept in a binary min heap
+ * ordered by due time and handed back in batches by 'takeDue'. The owner only
+ * needs a single timer armed for 'nextDueTime'.
+ *
+ * Entries are never removed from the heap on ack/nack; the owner is expected
+ * to ignore a fired entry whose message no longer exists.
+ */
+class RetryScheduler
+{
+        RetryPolicy                 __policy;
+        std::vector<RetryEntry>     __heap;
+        std::int64_t                __epoch;
+        std::mt19937                __engine;
+    public:
+        RetryScheduler(const RetryPolicy& policy = RetryPolicy());
+
+        //setters
+        void                setPolicy(const RetryPolicy& policy) { __policy = policy;}
+
+        //getters
+        const RetryPolicy&  getPolicy() const { return __policy;}
+        std::size_t         size() const { return __heap.size();}
+        bool                empty() const { return __heap.empty();}
+
+        std::int64_t        getDelay(int attempt);
+        std::int64_t        schedule(SequenceId_t seqid, int attempt, std::int64_t now_msec);
+        void                scheduleAt(SequenceId_t seqid, int attempt,
+                                       std::int64_t due_msec, std::int64_t now_msec);
+        std::size_t         takeDue(std::int64_t now_msec,
+                                    std::vector<RetryEntry>& out,
+                                    std::size_t max_batch = 0);
+        std::int64_t        nextDueTime() const;
+        void                clear() { __heap.clear();}
+};
+
+#endif // RETRYSCHEDULER_H
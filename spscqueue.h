@@ -0,0 +1,99 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+#define SPSC_CACHE_LINE 64  // bytes.
+
+
+/*!
+ * \brief The SpscQueue class
+ * Unbounded lock free queue for exactly one producer thread and one consumer
+ * thread. 'push' is only ever called by the producer and 'pop' only by the
+ * consumer; neither blocks.
+ *
+ * Nodes are linked through an atomic 'next' pointer behind a dummy head, so
+ * the producer only touches '__tail' and the consumer only '__head'. Both are
+ * kept on separate cache lines to avoid false sharing between the two threads.
+ */
+template <typename T>
+class SpscQueue
+{
+        struct Node
+        {
+            T                   value;
+            std::atomic<Node*>  next;
+
+            Node():next(nullptr) {}
+        };
+
+        // explicit padding, not alignas: an over-aligned member would make
+        // every owner need aligned 'new' (C++17). Fields SPSC_CACHE_LINE
+        // bytes apart never share a line, however the queue is aligned.
+        Node*                       __head;     // consumer side; dummy node.
+        char                        __headPad[SPSC_CACHE_LINE - sizeof(Node*)];
+        Node*                       __tail;     // producer side.
+        char                        __tailPad[SPSC_CACHE_LINE - sizeof(Node*)];
+        std::atomic<std::size_t>    __size;
+        char                        __sizePad[SPSC_CACHE_LINE - sizeof(std::atomic<std::size_t>)];
+    public:
+        SpscQueue()
+            :__head(new Node()),
+             __tail(__head),
+             __size(0)
+        {}
+
+        ~SpscQueue()
+        {
+            while (__head)
+            {
+                Node* next = __head->next.load(std::memory_order_relaxed);
+                delete __head;
+                __head = next;
+            }
+        }
+
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+
+        //getters
+        // approximate when read while the other side is active.
+        std::size_t size() const { return __size.load(std::memory_order_relaxed);}
+        bool        empty() const { return size() == 0;}
+
+        /*!
+         * \brief push producer only.
+         * \param value
+         */
+        void push(T value)
+        {
+            Node* node = new Node();
+            node->value = std::move(value);
+            __size.fetch_add(1, std::memory_order_relaxed);
+            // publish the node only once its value is in place.
+            __tail->next.store(node, std::memory_order_release);
+            __tail = node;
+        }
+
+        /*!
+         * \brief pop consumer only.
+         * \param value set to the oldest element on success.
+         * \return false if the queue is empty.
+         */
+        bool pop(T& value)
+        {
+            Node* next = __head->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                return false;
+
+            value = std::move(next->value);
+            delete __head;
+            __head = next;  // 'next' becomes the new dummy.
+            __size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+};
+
+#endif // SPSCQUEUE_H
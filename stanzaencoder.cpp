@@ -0,0 +1,151 @@
+#include "stanzaencoder.h"
+
+
+static const char STANZA_HEAD[] = "<message id=\"\"><gcm xmlns=\"google:mobile:data\">";
+static const char STANZA_TAIL[] = "</gcm></message>";
+static const char ACK_HEAD[]    = "<message><gcm xmlns=\"google:mobile:data\">{\"to\":\"";
+static const char ACK_MID[]     = "\",\"message_id\":\"";
+static const char ACK_TAIL[]    = "\",\"message_type\":\"ack\"}</gcm></message>";
+
+
+/*!
+ * \brief StanzaEncoder::StanzaEncoder
+ */
+StanzaEncoder::StanzaEncoder()
+    :__count(0)
+{
+}
+
+
+/*!
+ * \brief StanzaEncoder::appendGcmMessage
+ * \param json compact UTF-8 JSON of a fully formed FCM message.
+ * \param size
+ */
+void StanzaEncoder::appendGcmMessage(const char* json, std::size_t size)
+{
+    __buffer.append(STANZA_HEAD, sizeof(STANZA_HEAD) - 1);
+    escape(json, size, __buffer);
+    __buffer.append(STANZA_TAIL, sizeof(STANZA_TAIL) - 1);
+    __count++;
+}
+
+
+/*!
+ * \brief StanzaEncoder::appendAck
+ * Ack of an upstream message in its minimal form: no stanza id and only the
+ * three fields FCM looks at, written without a JSON document in between.
+ * \param to          'from' of the upstream message.
+ * \param message_id  'message_id' of the upstream message.
+ */
+void StanzaEncoder::appendAck(const std::string& to, const std::string& message_id)
+{
+    __buffer.append(ACK_HEAD, sizeof(ACK_HEAD) - 1);
+    escapeJsonString(to, __buffer);
+    __buffer.append(ACK_MID, sizeof(ACK_MID) - 1);
+    escapeJsonString(message_id, __buffer);
+    __buffer.append(ACK_TAIL, sizeof(ACK_TAIL) - 1);
+    __count++;
+}
+
+
+/*!
+ * \brief StanzaEncoder::appendRaw
+ * \param stanzas complete stanzas encoded elsewhere e.g by 'take'.
+ * \param size
+ * \param count   # of stanzas in 'stanzas'.
+ */
+void StanzaEncoder::appendRaw(const char* stanzas, std::size_t size, std::size_t count)
+{
+    __buffer.append(stanzas, size);
+    __count += count;
+}
+
+
+/*!
+ * \brief StanzaEncoder::clear
+ * Empties the buffer but keeps its capacity for the next batch.
+ */
+void StanzaEncoder::clear()
+{
+    __buffer.clear();
+    __count = 0;
+}
+
+
+/*!
+ * \brief StanzaEncoder::take
+ * Hands the encoded stanzas over, e.g to another thread, and starts empty.
+ * \return
+ */
+std::string StanzaEncoder::take()
+{
+    std::string out;
+    out.swap(__buffer);
+    __count = 0;
+    return out;
+}
+
+
+/*!
+ * \brief StanzaEncoder::escape
+ * Appends 'text' to 'out' with the characters that are special in XML
+ * character data replaced. Runs without special characters are copied whole.
+ * \param text
+ * \param size
+ * \param out
+ */
+void StanzaEncoder::escape(const char* text, std::size_t size, std::string& out)
+{
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < size; i++)
+    {
+        const char* entity;
+        switch (text[i])
+        {
+            case '<': entity = "&lt;";  break;
+            case '>': entity = "&gt;";  break;
+            case '&': entity = "&amp;"; break;
+            default:  continue;
+        }
+        out.append(text + run, i - run);
+        out.append(entity);
+        run = i + 1;
+    }
+    out.append(text + run, size - run);
+}
+
+
+/*!
+ * \brief StanzaEncoder::escapeJsonString
+ * Appends 'text' to 'out' as the inside of a JSON string that is also valid
+ * XML character data.
+ * \param text
+ * \param out
+ */
+void StanzaEncoder::escapeJsonString(const std::string& text, std::string& out)
+{
+    static const char HEX[] = "0123456789abcdef";
+    for (unsigned char c : text)
+    {
+        switch (c)
+        {
+            case '"':  out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '<':  out.append("&lt;");  break;
+            case '>':  out.append("&gt;");  break;
+            case '&':  out.append("&amp;"); break;
+            default:
+                if (c < 0x20)
+                {
+                    out.append("\\u00");
+                    out.push_back(HEX[c >> 4]);
+                    out.push_back(HEX[c & 0xf]);
+                }
+                else
+                {
+                    out.push_back((char)c);
+                }
+        }
+    }
+}
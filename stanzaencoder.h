@@ -0,0 +1,37 @@
+#ifndef STANZAENCODER_H
+#define STANZAENCODER_H
+
+#include <cstddef>
+#include <string>
+
+
+/*!
+ * \brief The StanzaEncoder class
+ * Builds outbound <message><gcm> stanzas straight into one reusable buffer so
+ * that everything encoded in one event loop iteration goes out with a single
+ * socket (and so TLS) write. The JSON is XML escaped in the same pass.
+ */
+class StanzaEncoder
+{
+        std::string     __buffer;
+        std::size_t     __count;    // stanzas in '__buffer'.
+    public:
+        StanzaEncoder();
+
+        //getters
+        const char*     data() const { return __buffer.data();}
+        std::size_t     size() const { return __buffer.size();}
+        std::size_t     count() const { return __count;}
+        bool            empty() const { return __buffer.empty();}
+
+        void            appendGcmMessage(const char* json, std::size_t size);
+        void            appendAck(const std::string& to, const std::string& message_id);
+        void            appendRaw(const char* stanzas, std::size_t size, std::size_t count);
+        void            clear();
+        std::string     take();
+
+        static void     escape(const char* text, std::size_t size, std::string& out);
+        static void     escapeJsonString(const std::string& text, std::string& out);
+};
+
+#endif // STANZAENCODER_H
@@ -0,0 +1,439 @@
+#include "stanzascanner.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+
+static const char* GCM_NAMESPACE = "google:mobile:data";
+static const char* STREAM_TAG    = "stream:stream";
+
+
+/*!
+ * \brief is_space
+ */
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+/*!
+ * \brief append_utf8
+ * \param out
+ * \param cp unicode code point.
+ */
+static void append_utf8(std::string& out, unsigned long cp)
+{
+    if (cp < 0x80)
+    {
+        out += (char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+
+/*!
+ * \brief StanzaScanner::StanzaScanner
+ */
+StanzaScanner::StanzaScanner()
+    :__start(0),
+     __pos(0),
+     __end(0),
+     __peakBuffered(0),
+     __depth(0),
+     __baseDepth(0),
+     __fastPath(false)
+{
+}
+
+
+/*!
+ * \brief StanzaScanner::reset
+ * Forgets everything buffered; call whenever a new stream starts.
+ */
+void StanzaScanner::reset()
+{
+    // keeps the memory; the next stream is likely to need as much.
+    __scratch.clear();
+    __start     = 0;
+    __pos       = 0;
+    __end       = 0;
+    __depth     = 0;
+    __baseDepth = 0;
+}
+
+
+/*!
+ * \brief StanzaScanner::prepare
+ * \param size # of bytes about to be received.
+ * \return where to write them; follow up with 'commit'.
+ */
+char* StanzaScanner::prepare(std::size_t size)
+{
+    // drop what was already handed out; only a partial stanza is left.
+    if (__start > 0)
+    {
+        std::size_t left = __end - __start;
+        if (left > 0)
+            memmove(&__buffer[0], __buffer.data() + __start, left);
+        __pos  -= __start;
+        __end   = left;
+        __start = 0;
+    }
+    if (__end + size > __buffer.size())
+        __buffer.resize(std::max(__buffer.size() * 2, __end + size));
+    return &__buffer[__end];
+}
+
+
+/*!
+ * \brief StanzaScanner::commit
+ * \param size # of bytes actually written at 'prepare'.
+ */
+void StanzaScanner::commit(std::size_t size)
+{
+    __end += size;
+    __peakBuffered = std::max(__peakBuffered, __end - __start);
+}
+
+
+/*!
+ * \brief StanzaScanner::feed
+ * \param data
+ * \param size
+ */
+void StanzaScanner::feed(const char* data, std::size_t size)
+{
+    memcpy(prepare(size), data, size);
+    commit(size);
+}
+
+
+/*!
+ * \brief StanzaScanner::next
+ * \param out
+ * \return false if no complete stanza is buffered.
+ */
+bool StanzaScanner::next(StanzaSlice& out)
+{
+    const std::size_t end = __end;
+    while (__pos < end)
+    {
+        if (__pos == __start && __depth == __baseDepth)
+        {
+            // between stanzas; white space is keepalive/padding.
+            __pos = skipSpace(__pos, end);
+            __start = __pos;
+            if (__pos == end)
+                return false;
+        }
+
+        if (__buffer[__pos] != '<')
+        {
+            // character data, scanned once.
+            std::size_t lt = find('<', __pos);
+            if (lt == std::string::npos)
+            {
+                __pos = end;
+                return false;
+            }
+            __pos = lt;
+            continue;
+        }
+
+        std::size_t tag_end = findTagEnd(__pos);
+        if (tag_end == std::string::npos)
+            return false; // partial tag, wait for more.
+
+        char c = __buffer[__pos + 1];
+        if (c == '/')
+        {
+            bool stream = tagName(__pos) == STREAM_TAG;
+            if (__depth > 0)
+                __depth--;
+            if (stream || __depth < __baseDepth)
+                __baseDepth = __depth;
+        }
+        else if (c != '?' && c != '!' && __buffer[tag_end - 2] != '/')
+        {
+            __depth++;
+            // a (re)started stream; its children are the stanzas.
+            if (tagName(__pos) == STREAM_TAG)
+                __baseDepth = __depth;
+        }
+        __pos = tag_end;
+
+        if (__depth == __baseDepth)
+        {
+            std::size_t begin = __start;
+            __start = __pos;
+            if (!__fastPath || !matchGcm(begin, __pos, out))
+            {
+                out.kind = StanzaKind::XML;
+                out.data = __buffer.data() + begin;
+                out.size = __pos - begin;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*!
+ * \brief StanzaScanner::findTagEnd
+ * \param pos position of '<'.
+ * \return position just past the tag or npos if it isn't complete yet.
+ */
+std::size_t StanzaScanner::findTagEnd(std::size_t pos) const
+{
+    const std::size_t end = __end;
+    static const char* COMMENT = "<!--";
+    static const char* CDATA   = "<![CDATA[";
+
+    std::size_t avail = end - pos;
+    if (avail < 2)
+        return std::string::npos;
+
+    if (__buffer[pos + 1] == '!')
+    {
+        std::size_t n = std::min(avail, strlen(CDATA));
+        if (__buffer.compare(pos, n, CDATA, n) == 0)
+        {
+            if (n < strlen(CDATA))
+                return std::string::npos;
+            std::size_t close = find("]]>", pos + 9);
+            return close == std::string::npos ? close : close + 3;
+        }
+        n = std::min(avail, strlen(COMMENT));
+        if (__buffer.compare(pos, n, COMMENT, n) == 0)
+        {
+            if (n < strlen(COMMENT))
+                return std::string::npos;
+            std::size_t close = find("-->", pos + 4);
+            return close == std::string::npos ? close : close + 3;
+        }
+    }
+    else if (__buffer[pos + 1] == '?')
+    {
+        std::size_t close = find("?>", pos + 2);
+        return close == std::string::npos ? close : close + 2;
+    }
+
+    // '>' is legal inside attribute values.
+    char quote = 0;
+    for (std::size_t i = pos + 1; i < end; i++)
+    {
+        char c = __buffer[i];
+        if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '>')
+            return i + 1;
+    }
+    return std::string::npos;
+}
+
+
+/*!
+ * \brief StanzaScanner::tagName
+ * \param pos position of '<'.
+ * \return qualified name of the tag.
+ */
+std::string StanzaScanner::tagName(std::size_t pos) const
+{
+    std::size_t begin = pos + 1;
+    if (begin < __end && __buffer[begin] == '/')
+        begin++;
+    std::size_t i = begin;
+    while (i < __end && !is_space(__buffer[i]) &&
+           __buffer[i] != '/' && __buffer[i] != '>')
+    {
+        i++;
+    }
+    return __buffer.substr(begin, i - begin);
+}
+
+
+/*!
+ * \brief StanzaScanner::skipSpace
+ */
+std::size_t StanzaScanner::skipSpace(std::size_t pos, std::size_t end) const
+{
+    while (pos < end && is_space(__buffer[pos]))
+        pos++;
+    return pos;
+}
+
+
+/*!
+ * \brief StanzaScanner::find
+ * \return position of 'c' at or after 'pos' among the received bytes, or npos.
+ */
+std::size_t StanzaScanner::find(char c, std::size_t pos) const
+{
+    if (pos >= __end)
+        return std::string::npos;
+    const char* p = (const char*)memchr(__buffer.data() + pos, c, __end - pos);
+    return p == nullptr ? std::string::npos : p - __buffer.data();
+}
+
+
+/*!
+ * \brief StanzaScanner::find
+ * \return position of 'str' at or after 'pos' among the received bytes, or npos.
+ */
+std::size_t StanzaScanner::find(const char* str, std::size_t pos) const
+{
+    if (pos >= __end)
+        return std::string::npos;
+    const char* begin = __buffer.data() + pos;
+    const char* end   = __buffer.data() + __end;
+    const char* p = std::search(begin, end, str, str + strlen(str));
+    return p == end ? std::string::npos : p - __buffer.data();
+}
+
+
+/*!
+ * \brief StanzaScanner::startsWith
+ */
+bool StanzaScanner::startsWith(std::size_t pos, std::size_t end, const char* str) const
+{
+    std::size_t n = strlen(str);
+    return pos + n <= end && __buffer.compare(pos, n, str) == 0;
+}
+
+
+/*!
+ * \brief StanzaScanner::matchGcm
+ * \param begin first byte of a complete stanza.
+ * \param end   one past its last byte.
+ * \param out   set to the JSON payload on success.
+ * \return false if the stanza isn't a plain <message><gcm> stanza.
+ */
+bool StanzaScanner::matchGcm(std::size_t begin, std::size_t end, StanzaSlice& out)
+{
+    // <message ...>
+    if (!startsWith(begin, end, "<message") || begin + 8 >= end ||
+            !(is_space(__buffer[begin + 8]) || __buffer[begin + 8] == '>'))
+    {
+        return false;
+    }
+    std::size_t p = findTagEnd(begin);
+    if (p > end || __buffer[p - 2] == '/')
+        return false;
+
+    // <gcm xmlns="google:mobile:data"> or <prefix:gcm xmlns:prefix=...>
+    p = skipSpace(p, end);
+    if (p >= end || __buffer[p] != '<')
+        return false;
+    std::string name = tagName(p);
+    std::size_t colon = name.find(':');
+    if (name.compare(colon == std::string::npos ? 0 : colon + 1, std::string::npos, "gcm") != 0)
+        return false;
+    std::size_t text_begin = findTagEnd(p);
+    if (text_begin > end || __buffer[text_begin - 2] == '/')
+        return false;
+    std::size_t ns = find(GCM_NAMESPACE, p);
+    if (ns == std::string::npos || ns >= text_begin)
+        return false;
+
+    // JSON up to </gcm>; any markup inside (CDATA included) falls back.
+    std::size_t text_end = find('<', text_begin);
+    if (text_end == std::string::npos || text_end >= end)
+        return false;
+    std::string close = "</" + name + ">";
+    if (!startsWith(text_end, end, close.c_str()))
+        return false;
+    p = skipSpace(text_end + close.size(), end);
+    if (!startsWith(p, end, "</message>") || p + 10 != end)
+        return false;
+
+    out.kind = StanzaKind::GCM_JSON;
+    if (memchr(__buffer.data() + text_begin, '&', text_end - text_begin) == nullptr)
+    {
+        out.data = __buffer.data() + text_begin;
+        out.size = text_end - text_begin;
+        return true;
+    }
+    if (!unescape(text_begin, text_end))
+        return false;
+    out.data = __scratch.data();
+    out.size = __scratch.size();
+    return true;
+}
+
+
+/*!
+ * \brief StanzaScanner::unescape
+ * Resolves the predefined and numeric character references into '__scratch'.
+ * \return false on anything else.
+ */
+bool StanzaScanner::unescape(std::size_t begin, std::size_t end)
+{
+    __scratch.clear();
+    std::size_t i = begin;
+    while (i < end)
+    {
+        std::size_t amp = find('&', i);
+        if (amp == std::string::npos || amp >= end)
+            amp = end;
+        __scratch.append(__buffer, i, amp - i);
+        if (amp == end)
+            break;
+
+        std::size_t semi = find(';', amp);
+        if (semi == std::string::npos || semi >= end)
+            return false;
+        std::string ref = __buffer.substr(amp + 1, semi - amp - 1);
+        if (ref == "quot")
+            __scratch += '"';
+        else if (ref == "amp")
+            __scratch += '&';
+        else if (ref == "lt")
+            __scratch += '<';
+        else if (ref == "gt")
+            __scratch += '>';
+        else if (ref == "apos")
+            __scratch += '\'';
+        else if (ref.size() > 1 && ref[0] == '#')
+        {
+            bool hex = ref[1] == 'x' || ref[1] == 'X';
+            const char* digits = ref.c_str() + (hex ? 2 : 1);
+            if (*digits == '\0')
+                return false;
+            char* stop = nullptr;
+            unsigned long cp = strtoul(digits, &stop, hex ? 16 : 10);
+            if (*stop != '\0' || cp == 0 || cp > 0x10FFFF)
+                return false;
+            append_utf8(__scratch, cp);
+        }
+        else
+            return false;
+        i = semi + 1;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef STANZASCANNER_H
+#define STANZASCANNER_H
+
+#include <cstddef>
+#include <string>
+
+
+/*!
+ * \brief The StanzaKind enum
+ * XML      : a complete stanza (or stream level tag) for the generic parser.
+ * GCM_JSON : the JSON payload of a <message><gcm>..</gcm></message> stanza.
+ */
+enum class StanzaKind:char
+{
+    XML         = 'X',
+    GCM_JSON    = 'J'
+};
+
+
+/*!
+ * \brief The StanzaSlice struct
+ * Points into the scanner; valid until the next 'feed'/'prepare'/'next'/'reset'.
+ */
+struct StanzaSlice
+{
+    StanzaKind      kind;
+    const char*     data;
+    std::size_t     size;
+};
+
+
+/*!
+ * \brief The StanzaScanner class
+ * Incremental byte level framer for the FCM XMPP stream. Incoming bytes are
+ * split into complete top level stanzas by tracking the element depth only;
+ * nothing is decoded. Stream headers and trailers are handed out on their own
+ * so that the generic parser always sees whole stanzas.
+ *
+ * With the fast path on (post handshake), stanzas shaped exactly like
+ * <message ..><gcm xmlns="google:mobile:data">JSON</gcm></message> (any prefix
+ * on 'gcm') are handed out as the JSON bytes, with the predefined and numeric
+ * entities resolved. Anything else comes out as XML.
+ *
+ * The buffer is reused for the lifetime of the scanner: the socket reads
+ * straight into it ('prepare'/'commit') and stanzas are handed out in place.
+ * Only the partial stanza left at the end of a read is moved to the front
+ * when more room is needed, so the buffer grows to the largest burst seen
+ * and then stays put.
+ */
+class StanzaScanner
+{
+        std::string     __buffer;   // only [0, __end) holds data.
+        std::string     __scratch;  // unescaped JSON.
+        std::size_t     __start;    // first byte of the current stanza.
+        std::size_t     __pos;      // next byte to scan.
+        std::size_t     __end;      // one past the last byte received.
+        std::size_t     __peakBuffered; // high water mark of 'getBufferedSize'.
+        int             __depth;
+        int             __baseDepth;// depth at which stanzas start/end.
+        bool            __fastPath;
+    public:
+        StanzaScanner();
+
+        //setters
+        void            setFastPath(bool enable) { __fastPath = enable;}
+
+        //getters
+        bool            getFastPath() const { return __fastPath;}
+        std::size_t     getBufferedSize() const { return __end - __start;}
+        std::size_t     getPeakBufferedSize() const { return __peakBuffered;}
+        std::size_t     getCapacity() const { return __buffer.size();}
+
+        char*           prepare(std::size_t size);
+        void            commit(std::size_t size);
+        void            feed(const char* data, std::size_t size);
+        bool            next(StanzaSlice& out);
+        void            reset();
+    private:
+        std::size_t     findTagEnd(std::size_t pos) const;
+        std::string     tagName(std::size_t pos) const;
+        std::size_t     skipSpace(std::size_t pos, std::size_t end) const;
+        std::size_t     find(char c, std::size_t pos) const;
+        std::size_t     find(const char* str, std::size_t pos) const;
+        bool            startsWith(std::size_t pos, std::size_t end, const char* str) const;
+        bool            matchGcm(std::size_t begin, std::size_t end, StanzaSlice& out);
+        bool            unescape(std::size_t begin, std::size_t end);
+};
+
+#endif // STANZASCANNER_H
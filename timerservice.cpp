@@ -0,0 +1,61 @@
+#include "timerservice.h"
+
+
+/*!
+ * \brief TimerService::TimerService
+ * \param tick_msec
+ * \param parent
+ */
+TimerService::TimerService(std::int64_t tick_msec, QObject* parent)
+    :QObject(parent),
+     __wheel(tick_msec, 0),
+     __tickTimer(this)
+{
+    __clock.start();
+    __tickTimer.setTimerType(Qt::TimerType::PreciseTimer);
+    __tickTimer.setInterval((int)__wheel.getTickMsec());
+    connect(&__tickTimer, &QTimer::timeout, this, &TimerService::handleTick);
+}
+
+
+/*!
+ * \brief TimerService::schedule
+ * \param delay_msec
+ * \param callback
+ * \return
+ */
+TimerHandle_t TimerService::schedule(std::int64_t delay_msec, TimerCallback_t callback)
+{
+    return scheduleAt(now() + delay_msec, std::move(callback));
+}
+
+
+/*!
+ * \brief TimerService::scheduleAt
+ * \param expiry_msec absolute time on the 'now()' clock.
+ * \param callback
+ * \return
+ */
+TimerHandle_t TimerService::scheduleAt(std::int64_t expiry_msec, TimerCallback_t callback)
+{
+    // An idle wheel may lag behind; catch it up (nothing can fire) so that the
+    // new timer is placed relative to 'now'.
+    if (__wheel.empty())
+        __wheel.advance(now());
+
+    TimerHandle_t handle = __wheel.schedule(expiry_msec, std::move(callback));
+    if (!__tickTimer.isActive())
+        __tickTimer.start();
+    return handle;
+}
+
+
+/*!
+ * \brief TimerService::handleTick
+ */
+void TimerService::handleTick()
+{
+    __wheel.advance(now());
+    if (__wheel.empty())
+        __tickTimer.stop();
+}
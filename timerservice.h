@@ -0,0 +1,39 @@
+#ifndef TIMERSERVICE_H
+#define TIMERSERVICE_H
+
+#include "timingwheel.h"
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+
+/*!
+ * \brief The TimerService class
+ * Drives a 'TimingWheel' from a single Qt timer. The tick timer only runs
+ * while at least one timer is pending, so an idle process doesn't wake up.
+ * A TimerService is not thread safe; use it from the thread it lives in.
+ */
+class TimerService: public QObject
+{
+        Q_OBJECT
+        QElapsedTimer               __clock;    // monotonic time source.
+        TimingWheel                 __wheel;
+        QTimer                      __tickTimer;
+    public:
+        TimerService(std::int64_t tick_msec = DEFAULT_TIMER_TICK_MSEC,
+                     QObject* parent = 0);
+
+        //getters
+        std::int64_t    now() const { return __clock.elapsed();}
+        std::size_t     size() const { return __wheel.size();}
+
+        TimerHandle_t   schedule(std::int64_t delay_msec, TimerCallback_t callback);
+        TimerHandle_t   scheduleAt(std::int64_t expiry_msec, TimerCallback_t callback);
+        bool            cancel(TimerHandle_t& handle) { return __wheel.cancel(handle);}
+        bool            isActive(TimerHandle_t handle) const { return __wheel.isActive(handle);}
+    public slots:
+        void            handleTick();
+};
+
+#endif // TIMERSERVICE_H
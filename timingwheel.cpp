@@ -0,0 +1,299 @@
+#include "timingwheel.h"
+
+#include <utility>
+
+
+/*!
+ * \brief TimingWheel::TimingWheel
+ * \param tick_msec     resolution of the wheel.
+ * \param start_msec    time corresponding to tick 0.
+ */
+TimingWheel::TimingWheel(std::int64_t tick_msec, std::int64_t start_msec)
+    :__tickMsec(tick_msec > 0 ? tick_msec : DEFAULT_TIMER_TICK_MSEC),
+     __startMsec(start_msec),
+     __currentTick(0),
+     __count(0)
+{
+    for (int i = 0; i <= FIRING_LIST; i++)
+        __lists[i] = __tails[i] = NO_NODE;
+}
+
+
+/*!
+ * \brief TimingWheel::schedule
+ * \param expiry_msec   absolute time at which 'callback' is due. The callback
+ *                      is never run before this time but may run up to one
+ *                      tick after it.
+ * \param callback
+ * \return handle for 'cancel'/'isActive'.
+ */
+TimerHandle_t TimingWheel::schedule(std::int64_t expiry_msec, TimerCallback_t callback)
+{
+    std::int64_t delta = expiry_msec - __startMsec;
+    std::uint64_t expiry = 0;
+    if (delta > 0)
+        expiry = (delta + __tickMsec - 1) / __tickMsec;
+    if (expiry < __currentTick)
+        expiry = __currentTick;
+
+    std::int32_t n = allocNode();
+    Node& node      = __nodes[n];
+    node.callback   = std::move(callback);
+    node.expiry     = expiry;
+    place(n);
+    __count++;
+
+    return ((TimerHandle_t)node.generation << 32) | (std::uint32_t)(n + 1);
+}
+
+
+/*!
+ * \brief TimingWheel::cancel
+ * \param handle reset to INVALID_TIMER_HANDLE on return.
+ * \return true if a pending timer was cancelled.
+ */
+bool TimingWheel::cancel(TimerHandle_t& handle)
+{
+    std::int32_t n = nodeFromHandle(handle);
+    handle = INVALID_TIMER_HANDLE;
+    if (n == NO_NODE)
+        return false;
+
+    unlink(n);
+    freeNode(n);
+    __count--;
+    return true;
+}
+
+
+/*!
+ * \brief TimingWheel::isActive
+ * \param handle
+ * \return true if 'handle' refers to a timer that hasn't fired yet.
+ */
+bool TimingWheel::isActive(TimerHandle_t handle) const
+{
+    return nodeFromHandle(handle) != NO_NODE;
+}
+
+
+/*!
+ * \brief TimingWheel::advance
+ * Runs every tick up to 'now_msec' and fires the timers that expired.
+ * \param now_msec
+ * \return # of timers fired.
+ */
+std::size_t TimingWheel::advance(std::int64_t now_msec)
+{
+    if (now_msec < __startMsec)
+        return 0;
+
+    std::uint64_t target = (now_msec - __startMsec) / __tickMsec;
+    std::size_t fired = 0;
+    while (__currentTick <= target)
+    {
+        // nothing pending, jump straight to 'now'.
+        if (__count == 0)
+        {
+            __currentTick = target + 1;
+            break;
+        }
+        fired += runTick();
+    }
+    return fired;
+}
+
+
+/*!
+ * \brief TimingWheel::runTick
+ * Processes '__currentTick'. Whenever the level 0 index wraps, the matching
+ * slot of the next level is cascaded down (and so on up the hierarchy).
+ * \return # of timers fired.
+ */
+std::size_t TimingWheel::runTick()
+{
+    int index = __currentTick & (SLOTS - 1);
+    if (index == 0)
+    {
+        for (int level = 1; level < LEVELS; level++)
+        {
+            int i = (__currentTick >> (level * SLOT_BITS)) & (SLOTS - 1);
+            cascade(level, i);
+            if (i != 0)
+                break;
+        }
+    }
+    __currentTick++;
+
+    // move the due slot to the firing list so that callbacks are free to
+    // schedule/cancel anything, including other timers due in this tick.
+    std::int32_t head = __lists[index];
+    __lists[FIRING_LIST] = head;
+    __tails[FIRING_LIST] = __tails[index];
+    __lists[index] = __tails[index] = NO_NODE;
+    for (std::int32_t n = head; n != NO_NODE; n = __nodes[n].next)
+        __nodes[n].list = FIRING_LIST;
+
+    std::size_t fired = 0;
+    while (__lists[FIRING_LIST] != NO_NODE)
+    {
+        std::int32_t n = __lists[FIRING_LIST];
+        TimerCallback_t callback = std::move(__nodes[n].callback);
+        unlink(n);
+        freeNode(n);
+        __count--;
+        fired++;
+        if (callback)
+            callback();
+    }
+    return fired;
+}
+
+
+/*!
+ * \brief TimingWheel::cascade
+ * Re-places every node of slot 'index' at 'level' relative to the current tick.
+ * \param level
+ * \param index
+ */
+void TimingWheel::cascade(int level, int index)
+{
+    std::int32_t list = level * SLOTS + index;
+    std::int32_t n = __lists[list];
+    __lists[list] = __tails[list] = NO_NODE;
+    while (n != NO_NODE)
+    {
+        std::int32_t next = __nodes[n].next;
+        place(n);
+        n = next;
+    }
+}
+
+
+/*!
+ * \brief TimingWheel::place
+ * Links node 'n' into the slot matching its expiry.
+ * \param n
+ */
+void TimingWheel::place(std::int32_t n)
+{
+    std::uint64_t expiry = __nodes[n].expiry;
+    if (expiry < __currentTick)
+        expiry = __currentTick;
+
+    // too far out; park it in the last level, it will be cascaded again.
+    std::uint64_t max_span = (std::uint64_t)1 << (LEVELS * SLOT_BITS);
+    if (expiry - __currentTick >= max_span)
+        expiry = __currentTick + max_span - 1;
+
+    std::uint64_t diff = expiry - __currentTick;
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           diff >= ((std::uint64_t)1 << ((level + 1) * SLOT_BITS)))
+    {
+        level++;
+    }
+    int index = (expiry >> (level * SLOT_BITS)) & (SLOTS - 1);
+    link(n, level * SLOTS + index);
+}
+
+
+/*!
+ * \brief TimingWheel::link
+ * \param n
+ * \param list
+ */
+void TimingWheel::link(std::int32_t n, std::int32_t list)
+{
+    Node& node  = __nodes[n];
+    node.list   = list;
+    node.prev   = __tails[list];
+    node.next   = NO_NODE;
+    if (node.prev != NO_NODE)
+        __nodes[node.prev].next = n;
+    else
+        __lists[list] = n;
+    __tails[list] = n;
+}
+
+
+/*!
+ * \brief TimingWheel::unlink
+ * \param n
+ */
+void TimingWheel::unlink(std::int32_t n)
+{
+    Node& node = __nodes[n];
+    if (node.prev != NO_NODE)
+        __nodes[node.prev].next = node.next;
+    else
+        __lists[node.list] = node.next;
+
+    if (node.next != NO_NODE)
+        __nodes[node.next].prev = node.prev;
+    else
+        __tails[node.list] = node.prev;
+
+    node.prev = node.next = NO_NODE;
+}
+
+
+/*!
+ * \brief TimingWheel::allocNode
+ * \return index of a free node.
+ */
+std::int32_t TimingWheel::allocNode()
+{
+    if (!__freeNodes.empty())
+    {
+        std::int32_t n = __freeNodes.back();
+        __freeNodes.pop_back();
+        return n;
+    }
+    Node node;
+    node.expiry     = 0;
+    node.prev       = NO_NODE;
+    node.next       = NO_NODE;
+    node.list       = NO_NODE;
+    node.generation = 1;
+    __nodes.push_back(std::move(node));
+    return (std::int32_t)__nodes.size() - 1;
+}
+
+
+/*!
+ * \brief TimingWheel::freeNode
+ * \param n
+ */
+void TimingWheel::freeNode(std::int32_t n)
+{
+    Node& node = __nodes[n];
+    node.callback = nullptr;
+    node.list = NO_NODE;
+    // bump the generation so that outstanding handles go stale.
+    if (++node.generation == 0)
+        node.generation = 1;
+    __freeNodes.push_back(n);
+}
+
+
+/*!
+ * \brief TimingWheel::nodeFromHandle
+ * \param handle
+ * \return node index or NO_NODE if 'handle' is stale/invalid.
+ */
+std::int32_t TimingWheel::nodeFromHandle(TimerHandle_t handle) const
+{
+    if (handle == INVALID_TIMER_HANDLE)
+        return NO_NODE;
+
+    std::int64_t n = (std::int64_t)(handle & 0xFFFFFFFF) - 1;
+    std::uint32_t generation = (std::uint32_t)(handle >> 32);
+    if (n < 0 || n >= (std::int64_t)__nodes.size())
+        return NO_NODE;
+
+    const Node& node = __nodes[n];
+    if (node.list == NO_NODE || node.generation != generation)
+        return NO_NODE;
+    return (std::int32_t)n;
+}
@@ -0,0 +1,81 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+#define INVALID_TIMER_HANDLE        0
+#define DEFAULT_TIMER_TICK_MSEC     10
+
+/*!
+ * \brief TimerHandle_t
+ * Opaque handle returned by 'TimingWheel::schedule'. Encodes the node slot and
+ * its generation so that a stale handle can never cancel a recycled node.
+ */
+typedef std::uint64_t TimerHandle_t;
+typedef std::function<void()> TimerCallback_t;
+
+
+/*!
+ * \brief The TimingWheel class
+ * Hierarchical timing wheel (4 levels x 64 slots). With the default 10 msec
+ * tick, level 0 covers 640 msec, level 1 ~41 sec, level 2 ~44 min and level 3
+ * ~46 hrs; anything further out is parked in level 3 and re-cascaded.
+ *
+ * Timer nodes live in a slab with a free list and are linked into their slot
+ * with intrusive prev/next indices, so schedule and cancel are O(1). The wheel
+ * has no clock of its own; the owner drives it with 'advance'.
+ */
+class TimingWheel
+{
+        static const int        SLOT_BITS   = 6;
+        static const int        SLOTS       = 1 << SLOT_BITS;
+        static const int        LEVELS      = 4;
+        static const int        FIRING_LIST = LEVELS * SLOTS;
+        static const int        NO_NODE     = -1;
+
+        struct Node
+        {
+            TimerCallback_t     callback;
+            std::uint64_t       expiry;     // in ticks.
+            std::int32_t        prev;
+            std::int32_t        next;
+            std::int32_t        list;       // slot list this node is linked into, NO_NODE if free.
+            std::uint32_t       generation;
+        };
+
+        std::int64_t            __tickMsec;
+        std::int64_t            __startMsec;
+        std::uint64_t           __currentTick; // next tick to be processed.
+        std::vector<Node>       __nodes;
+        std::vector<std::int32_t> __freeNodes;
+        std::int32_t            __lists[FIRING_LIST + 1]; // list heads.
+        std::int32_t            __tails[FIRING_LIST + 1]; // list tails; timers of a slot fire in FIFO order.
+        std::size_t             __count;
+    public:
+        TimingWheel(std::int64_t tick_msec = DEFAULT_TIMER_TICK_MSEC,
+                    std::int64_t start_msec = 0);
+
+        //getters
+        std::int64_t    getTickMsec() const { return __tickMsec;}
+        std::size_t     size() const { return __count;}
+        bool            empty() const { return __count == 0;}
+
+        TimerHandle_t   schedule(std::int64_t expiry_msec, TimerCallback_t callback);
+        bool            cancel(TimerHandle_t& handle);
+        bool            isActive(TimerHandle_t handle) const;
+        std::size_t     advance(std::int64_t now_msec);
+    private:
+        std::int32_t    allocNode();
+        void            freeNode(std::int32_t n);
+        void            link(std::int32_t n, std::int32_t list);
+        void            unlink(std::int32_t n);
+        void            place(std::int32_t n);
+        void            cascade(int level, int index);
+        std::size_t     runTick();
+        std::int32_t    nodeFromHandle(TimerHandle_t handle) const;
+};
+
+#endif // TIMINGWHEEL_H
@@ -0,0 +1,120 @@
+#include "tlssessioncache.h"
+
+
+/*!
+ * \brief TlsSessionCache::TlsSessionCache
+ */
+TlsSessionCache::TlsSessionCache()
+    :__stores(0),
+     __hits(0),
+     __misses(0)
+{
+}
+
+
+/*!
+ * \brief TlsSessionCache::size
+ * \return # of servers with a ticket, expired ones included.
+ */
+std::size_t TlsSessionCache::size() const
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    return __entries.size();
+}
+
+
+std::uint64_t TlsSessionCache::getStores() const
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    return __stores;
+}
+
+
+std::uint64_t TlsSessionCache::getHits() const
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    return __hits;
+}
+
+
+std::uint64_t TlsSessionCache::getMisses() const
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    return __misses;
+}
+
+
+/*!
+ * \brief TlsSessionCache::store
+ * Replaces the ticket of 'server'; the newest one is the most likely to be
+ * accepted.
+ * \param server            see 'serverKey'.
+ * \param ticket            serialized session as handed out by the socket.
+ * \param lifetime_hint_sec server's hint, 0 or less if none was given.
+ * \param now_msec
+ */
+void TlsSessionCache::store(const std::string& server,
+                            const QByteArray& ticket,
+                            int lifetime_hint_sec,
+                            std::int64_t now_msec)
+{
+    if (ticket.isEmpty())
+        return;
+
+    std::int64_t lifetime = lifetime_hint_sec > 0 ? lifetime_hint_sec : DEFAULT_TLS_TICKET_LIFETIME_SEC;
+    std::lock_guard<std::mutex> guard(__lock);
+    Entry& entry    = __entries[server];
+    entry.ticket    = ticket;
+    entry.expiresAt = now_msec + lifetime * 1000;
+    __stores++;
+}
+
+
+/*!
+ * \brief TlsSessionCache::find
+ * \param server
+ * \param now_msec
+ * \return the ticket to offer or an empty one if there is none (or it expired).
+ */
+QByteArray TlsSessionCache::find(const std::string& server, std::int64_t now_msec)
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    auto it = __entries.find(server);
+    if (it == __entries.end())
+    {
+        __misses++;
+        return QByteArray();
+    }
+    if (it->second.expiresAt <= now_msec)
+    {
+        __entries.erase(it);
+        __misses++;
+        return QByteArray();
+    }
+    __hits++;
+    return it->second.ticket;
+}
+
+
+/*!
+ * \brief TlsSessionCache::remove
+ * Forgets the ticket of 'server' e.g after a handshake offering it failed.
+ * \param server
+ */
+void TlsSessionCache::remove(const std::string& server)
+{
+    std::lock_guard<std::mutex> guard(__lock);
+    __entries.erase(server);
+}
+
+
+/*!
+ * \brief TlsSessionCache::serverKey
+ * \param host
+ * \param port
+ * \return "host:port"
+ */
+std::string TlsSessionCache::serverKey(const std::string& host, std::uint16_t port)
+{
+    return host + ":" + std::to_string(port);
+}
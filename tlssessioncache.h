@@ -0,0 +1,59 @@
+#ifndef TLSSESSIONCACHE_H
+#define TLSSESSIONCACHE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <QByteArray>
+
+
+#define DEFAULT_TLS_TICKET_LIFETIME_SEC  3600 // used when the server gives no hint.
+
+
+/*!
+ * \brief The TlsSessionCache class
+ * Resumption state (session ticket) of the last full TLS handshake with each
+ * server, shared by every connection of the pool. A connection that offers
+ * a cached ticket skips the certificate exchange and the asymmetric crypto,
+ * which is what makes reconnects and pool growth cheap.
+ *
+ * Connections store/look up from their own threads, hence the lock.
+ */
+class TlsSessionCache
+{
+        struct Entry
+        {
+            QByteArray      ticket;
+            std::int64_t    expiresAt;  // msec.
+        };
+
+        mutable std::mutex              __lock;
+        std::map<std::string, Entry>    __entries;  // "host:port" --> ticket.
+        std::uint64_t                   __stores;
+        std::uint64_t                   __hits;
+        std::uint64_t                   __misses;
+    public:
+        TlsSessionCache();
+
+        //getters
+        std::size_t     size() const;
+        std::uint64_t   getStores() const;
+        std::uint64_t   getHits() const;
+        std::uint64_t   getMisses() const;
+
+        void            store(const std::string& server,
+                              const QByteArray& ticket,
+                              int lifetime_hint_sec,
+                              std::int64_t now_msec);
+        QByteArray      find(const std::string& server, std::int64_t now_msec);
+        void            remove(const std::string& server);
+
+        static std::string serverKey(const std::string& host, std::uint16_t port);
+};
+
+typedef std::shared_ptr<TlsSessionCache> TlsSessionCachePtr_t;
+
+#endif // TLSSESSIONCACHE_H
@@ -0,0 +1,71 @@
+#include "tokenbucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+/*!
+ * \brief TokenBucket::TokenBucket
+ * Starts full.
+ * \param interval_msec refill time of one token.
+ * \param burst         tokens that can be saved up, at least 1.
+ * \param now
+ */
+TokenBucket::TokenBucket(double interval_msec, double burst, std::int64_t now)
+    :__interval(interval_msec),
+     __burst(std::max(burst, 1.0)),
+     __tokens(__burst),
+     __last(now)
+{
+}
+
+
+/*!
+ * \brief TokenBucket::getTokens
+ * \param now
+ * \return tokens available at 'now', negative while in debt.
+ */
+double TokenBucket::getTokens(std::int64_t now) const
+{
+    if (__interval <= 0)
+        return __burst;
+    double refill = (double)std::max<std::int64_t>(now - __last, 0) / __interval;
+    return std::min(__burst, __tokens + refill);
+}
+
+
+/*!
+ * \brief TokenBucket::readyAt
+ * \param now
+ * \return 'now' if a token is available, else when the next one will be.
+ */
+std::int64_t TokenBucket::readyAt(std::int64_t now) const
+{
+    double tokens = getTokens(now);
+    if (tokens >= 1)
+        return now;
+    return now + (std::int64_t)std::ceil((1 - tokens) * __interval);
+}
+
+
+/*!
+ * \brief TokenBucket::take
+ * \param now
+ */
+void TokenBucket::take(std::int64_t now)
+{
+    __tokens = std::max(getTokens(now) - 1, -__burst);
+    __last   = std::max(now, __last);
+}
+
+
+/*!
+ * \brief TokenBucket::drain
+ * Nothing left to spend as of 'now'.
+ * \param now
+ */
+void TokenBucket::drain(std::int64_t now)
+{
+    __tokens = std::min(getTokens(now), 0.0);
+    __last   = std::max(now, __last);
+}
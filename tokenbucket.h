@@ -0,0 +1,37 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <cstdint>
+
+
+/*!
+ * \brief The TokenBucket class
+ * One token per 'interval' msec, at most 'burst' of them saved up. A send
+ * takes a token; a send that went out without one (e.g a resend after a
+ * reconnect) leaves the bucket in debt, down to -burst, so the next ones wait
+ * for it. Times are in msec on any monotonic clock.
+ */
+class TokenBucket
+{
+        double          __interval; // msec per token.
+        double          __burst;
+        double          __tokens;   // as of '__last'.
+        std::int64_t    __last;
+    public:
+        TokenBucket(double interval_msec = 1000, double burst = 1, std::int64_t now = 0);
+
+        //setters
+        void            setInterval(double msec) { __interval = msec;}
+
+        //getters
+        double          getInterval() const { return __interval;}
+        double          getBurst() const { return __burst;}
+        double          getTokens(std::int64_t now) const;
+        std::int64_t    readyAt(std::int64_t now) const;
+        bool            isReady(std::int64_t now) const { return readyAt(now) <= now;}
+
+        void            take(std::int64_t now);
+        void            drain(std::int64_t now);
+};
+
+#endif // TOKENBUCKET_H
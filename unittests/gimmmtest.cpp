@@ -2,8 +2,30 @@
 #include "balsession.h"
 #include "messagemanager.h"
 #include "exponentialbackoff.h"
+#include "retryscheduler.h"
+#include "timingwheel.h"
+#include "fcmdispatcher.h"
+#include "spscqueue.h"
+#include "stanzascanner.h"
+#include "fcmenvelope.h"
+#include "tlssessioncache.h"
+#include "keepalivetracker.h"
+#include "congestionwindow.h"
+#include "tokenbucket.h"
+#include "recipientratelimiter.h"
+#include "dedupindex.h"
+#include "fcmproject.h"
+#include "stanzaencoder.h"
+#include "fcmconnection.h"
 
 #include <QString>
+#include <QSslConfiguration>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+
 void GimmmTest::initTestCase()
 {
 
@@ -609,3 +631,1320 @@ void GimmmTest::testMessageManager_removeMessageWithFcmMsgId()
     }
     QVERIFY( found == true);
 }
+
+
+void GimmmTest::testMessageManager_ackDeadlines()
+{
+    MessageManager msgmanager("sessionid");
+
+    PayloadPtr_t payload1(new QJsonDocument());
+    MessagePtr_t msg1( new Message(1,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid1",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload1));
+
+    PayloadPtr_t payload2(new QJsonDocument());
+    MessagePtr_t msg2( new Message(2,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid2",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload2));
+
+    msgmanager.addMessage(1, msg1);
+    msgmanager.addMessage(2, msg2);
+
+    msgmanager.markPendingAck(msg1, 1000);
+    msgmanager.markPendingAck(msg2, 2000);
+    QVERIFY(msg1->getState() == MessageState::PENDING_ACK);
+    QVERIFY(msgmanager.getPendingAckCount() == 2);
+
+    // resend only refreshes the deadline, it doesn't take another slot.
+    msgmanager.markPendingAck(msg1, 1500);
+    QVERIFY(msgmanager.getPendingAckCount() == 2);
+
+    std::vector<MessagePtr_t> expired;
+    QVERIFY(msgmanager.collectExpiredAcks(1499, expired) == 0);
+    QVERIFY(msgmanager.collectExpiredAcks(1500, expired) == 1);
+    QVERIFY(expired[0] == msg1);
+
+    // a message waiting for a retry keeps its slot but never expires.
+    msgmanager.setAckDeadline(2, NO_ACK_DEADLINE);
+    expired.clear();
+    QVERIFY(msgmanager.collectExpiredAcks(5000, expired) == 1);
+    QVERIFY(expired[0] == msg1);
+
+    // reclaim gives the slot back.
+    QVERIFY(msgmanager.reclaimPendingAck(msg1) == true);
+    QVERIFY(msg1->getState() == MessageState::NEW);
+    QVERIFY(msgmanager.getPendingAckCount() == 1);
+    QVERIFY(msgmanager.reclaimPendingAck(msg1) == false);
+    QVERIFY(msgmanager.getPendingAckCount() == 1);
+
+    // not sendable while a retry is scheduled.
+    msg1->setRetryInProgress(true);
+    QVERIFY(msgmanager.canSendMessage(msg1) == 4);
+    QVERIFY(!msgmanager.getNext());
+    msg1->setRetryInProgress(false);
+    QVERIFY(msgmanager.getNext() == msg1);
+
+    // removing an in flight message frees its slot.
+    msgmanager.removeMessage(2);
+    QVERIFY(msgmanager.getPendingAckCount() == 0);
+    QVERIFY(msgmanager.getAckDeadlines().empty());
+}
+
+
+void GimmmTest::testMessageManager_collectExpired()
+{
+    MessageManager msgmanager("sessionid");
+
+    PayloadPtr_t payload1(new QJsonDocument());
+    MessagePtr_t msg1( new Message(1,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid1",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload1));
+
+    PayloadPtr_t payload2(new QJsonDocument());
+    MessagePtr_t msg2( new Message(2,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid2",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload2));
+
+    PayloadPtr_t payload3(new QJsonDocument());
+    MessagePtr_t msg3( new Message(3,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid3",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload3));
+
+    QVERIFY(msg1->getExpiresAt() == NO_EXPIRY);
+    QVERIFY(msg1->isExpired(INT64_MAX) == false);
+
+    msg2->setExpiresAt(1000);
+    msg3->setExpiresAt(2000);
+    QVERIFY(msg2->isExpired(1000) == false);
+    QVERIFY(msg2->isExpired(1001) == true);
+
+    msgmanager.addMessage(1, msg1);
+    msgmanager.addMessage(2, msg2);
+    msgmanager.addMessage(3, msg3);
+
+    FcmDispatcher dispatcher;
+    auto is_healthy = [&dispatcher](int id){ return dispatcher.isHealthy(id);};
+    std::vector<MessagePtr_t> expired;
+    QVERIFY(msgmanager.collectExpired(1000, expired, is_healthy) == 0);
+    QVERIFY(msgmanager.collectExpired(1500, expired, is_healthy) == 1);
+    QVERIFY(expired[0] == msg2);
+    expired.clear();
+    QVERIFY(msgmanager.collectExpired(5000, expired, is_healthy) == 2);
+    QVERIFY(expired[0] == msg2 && expired[1] == msg3);
+
+    // in flight on a healthy connection FCM answers for it; it isn't expired.
+    dispatcher.addLink(7);
+    dispatcher.setAuthenticated(7, true);
+    msgmanager.markPendingAck(msg2, 1000);
+    msgmanager.assignConnection(msg2, 7);
+    expired.clear();
+    QVERIFY(msgmanager.collectExpired(5000, expired, is_healthy) == 1);
+    QVERIFY(expired[0] == msg3);
+
+    // once its connection is gone it has to be uploaded again, so it is.
+    dispatcher.removeLink(7);
+    expired.clear();
+    QVERIFY(msgmanager.collectExpired(5000, expired, is_healthy) == 2);
+    QVERIFY(expired[0] == msg2 && expired[1] == msg3);
+
+    // delivered or dropped ones aren't queued for upload.
+    msg3->setState(MessageState::DELIVERED);
+    expired.clear();
+    QVERIFY(msgmanager.collectExpired(5000, expired, is_healthy) == 1);
+    msg3->setState(MessageState::NEW);
+
+    // ttl is in secs and clamped to [MIN_TTL, MAX_TTL].
+    QJsonObject data;
+    QVERIFY(Message::computeExpiry(data, 1000) == 1000 + (std::int64_t)MAX_TTL * 1000);
+    data.insert(fcmfieldnames::TIME_TO_LIVE, 60);
+    QVERIFY(Message::computeExpiry(data, 1000) == 61000);
+    data.insert(fcmfieldnames::TIME_TO_LIVE, 0);
+    QVERIFY(Message::computeExpiry(data, 1000) == 1000 + ZERO_TTL_GRACE_MSEC);
+    data.insert(fcmfieldnames::TIME_TO_LIVE, -5);
+    QVERIFY(Message::computeExpiry(data, 1000) == 1000 + ZERO_TTL_GRACE_MSEC);
+
+    // ttl 0 is "send now": not expired at its first dispatch, only once the
+    // grace is over.
+    data.insert(fcmfieldnames::TIME_TO_LIVE, 0);
+    msg3->setExpiresAt(Message::computeExpiry(data, 1000));
+    QVERIFY(msg3->isExpired(1000) == false);
+    QVERIFY(msg3->isExpired(1000 + ZERO_TTL_GRACE_MSEC) == false);
+    QVERIFY(msg3->isExpired(1001 + ZERO_TTL_GRACE_MSEC) == true);
+    data.insert(fcmfieldnames::TIME_TO_LIVE, MAX_TTL + 1);
+    QVERIFY(Message::computeExpiry(data, 1000) == 1000 + (std::int64_t)MAX_TTL * 1000);
+
+    // the recipient doesn't depend on a collapse key.
+    QVERIFY(Message::toFromPayload(data).empty());
+    data.insert(fcmfieldnames::TO, "device1");
+    QVERIFY(Message::toFromPayload(data) == "device1");
+    QVERIFY(Message::collapseKeyFromPayload(data).second.empty());
+}
+
+
+void GimmmTest::testMessageManager_collapseKey()
+{
+    MessageManager msgmanager("sessionid");
+
+    PayloadPtr_t payload1(new QJsonDocument());
+    MessagePtr_t msg1( new Message(1,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid1",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload1));
+
+    PayloadPtr_t payload2(new QJsonDocument());
+    MessagePtr_t msg2( new Message(2,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid2",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload2));
+
+    PayloadPtr_t payload3(new QJsonDocument());
+    MessagePtr_t msg3( new Message(3,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid3",
+                                    "",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload3));
+
+    PayloadPtr_t payload4(new QJsonDocument());
+    MessagePtr_t msg4( new Message(4,
+                                     MessageType::DOWNSTREAM,
+                                    "msgid4",
+                                    "groupid",
+                                    "source_session_id",
+                                    "target_session_id",
+                                    payload4));
+
+    msg1->setCollapseKey(CollapseKey_t("device1", "badge"));
+    msg2->setCollapseKey(CollapseKey_t("device1", "badge"));
+    msg3->setCollapseKey(CollapseKey_t("device2", "badge"));
+    msg4->setCollapseKey(CollapseKey_t("device1", "badge"));
+    msg1->setTo("device1");
+    QVERIFY(msg1->getTo() == "device1");
+    QVERIFY(msg2->getTo().empty());
+
+    QVERIFY(!msgmanager.findSupersededMessage(msg1));
+    msgmanager.addMessage(1, msg1);
+    QVERIFY(msgmanager.getCollapseKeyMap().size() == 1);
+
+    // same device and key.
+    QVERIFY(msgmanager.findSupersededMessage(msg2) == msg1);
+    // different device.
+    QVERIFY(!msgmanager.findSupersededMessage(msg3));
+    // grouped messages are never collapsed.
+    QVERIFY(!msgmanager.findSupersededMessage(msg4));
+    msgmanager.addMessage(4, msg4);
+    QVERIFY(msgmanager.getCollapseKeyMap().size() == 1);
+
+    // already uploaded, too late to collapse.
+    msgmanager.markPendingAck(msg1, NO_ACK_DEADLINE);
+    QVERIFY(!msgmanager.findSupersededMessage(msg2));
+    msgmanager.reclaimPendingAck(msg1);
+
+    msgmanager.removeMessage(1);
+    msgmanager.addMessage(2, msg2);
+    QVERIFY(msgmanager.findSupersededMessage(msg1) == msg2);
+
+    // removing a message that's no longer the newest leaves the index alone.
+    msgmanager.addMessage(1, msg1);
+    msgmanager.removeMessage(2);
+    QVERIFY(msgmanager.findSupersededMessage(msg2) == msg1);
+    msgmanager.removeMessage(1);
+    QVERIFY(msgmanager.getCollapseKeyMap().empty());
+}
+
+
+void GimmmTest::testMessageManager_connectionIndex()
+{
+    MessageManager msgmanager("sessionid");
+
+    std::vector<MessagePtr_t> msgs;
+    for (int i = 1; i <= 3; i++)
+    {
+        PayloadPtr_t payload(new QJsonDocument());
+        MessagePtr_t msg( new Message(i,
+                                         MessageType::DOWNSTREAM,
+                                        "msgid" + std::to_string(i),
+                                        "",
+                                        "source_session_id",
+                                        "target_session_id",
+                                        payload));
+        msgmanager.addMessage(i, msg);
+        msgs.push_back(msg);
+    }
+
+    msgmanager.assignConnection(msgs[2], 1);
+    msgmanager.assignConnection(msgs[0], 1);
+    msgmanager.assignConnection(msgs[1], 2);
+    QVERIFY(msgs[0]->getConnectionId() == 1);
+    QVERIFY(msgmanager.getConnectionIndex().size() == 2);
+
+    // a resend moves the message to the new connection.
+    msgmanager.assignConnection(msgs[1], 1);
+    QVERIFY(msgmanager.getConnectionIndex().size() == 1);
+
+    // only the lost connection's set comes back, oldest first.
+    msgmanager.assignConnection(msgs[1], 2);
+    std::vector<MessagePtr_t> lost;
+    QVERIFY(msgmanager.takeConnectionMessages(1, lost) == 2);
+    QVERIFY(lost[0] == msgs[0] && lost[1] == msgs[2]);
+    QVERIFY(msgs[0]->getConnectionId() == NO_FCM_CONNECTION);
+    QVERIFY(msgs[1]->getConnectionId() == 2);
+    QVERIFY(msgmanager.takeConnectionMessages(1, lost) == 0);
+
+    // acked/removed messages leave the index.
+    msgmanager.releaseConnection(msgs[1]);
+    QVERIFY(msgmanager.getConnectionIndex().empty());
+    msgmanager.assignConnection(msgs[1], 2);
+    msgmanager.removeMessage(2);
+    QVERIFY(msgmanager.getConnectionIndex().empty());
+}
+
+
+void GimmmTest::testMessageManager_holdMessage()
+{
+    MessageManager msgmanager("sessionid");
+
+    std::vector<MessagePtr_t> msgs;
+    for (int i = 1; i <= 4; i++)
+    {
+        PayloadPtr_t payload(new QJsonDocument());
+        MessagePtr_t msg( new Message(i,
+                                         MessageType::DOWNSTREAM,
+                                        "msgid" + std::to_string(i),
+                                        "",
+                                        "source_session_id",
+                                        "target_session_id",
+                                        payload));
+        msg->setTo(i == 4 ? "device2" : "device1");
+        msgmanager.addMessage(i, msg);
+        msgs.push_back(msg);
+    }
+
+    // only the first one held for a recipient needs a timer.
+    QVERIFY(msgmanager.holdMessage(msgs[1]) == true);
+    QVERIFY(msgmanager.holdMessage(msgs[0]) == false);
+    QVERIFY(msgmanager.hasHeldMessages("device1"));
+    QVERIFY(!msgmanager.hasHeldMessages("device2"));
+    QVERIFY(msgmanager.canSendMessage(msgs[0]) == 5);
+    QVERIFY(msgmanager.canSendMessageOnReconnect(msgs[0]) == 5);
+    // held isn't waiting for a retry.
+    QVERIFY(msgs[0]->getHeld() && !msgs[0]->getRetryInProgress());
+
+    // held ones aren't handed out, the rest still is.
+    QVERIFY(msgmanager.getNext() == msgs[2]);
+    msgmanager.markPendingAck(msgs[2], 1000);
+    QVERIFY(msgmanager.getNext() == msgs[3]);
+    msgmanager.markPendingAck(msgs[3], 1000);
+    QVERIFY(!msgmanager.getNext());
+
+    // released one at a time, in the order they were held.
+    MessagePtr_t msg = msgmanager.takeHeldMessage("device1");
+    QVERIFY(msg == msgs[1]);
+    QVERIFY(!msg->getHeld());
+    QVERIFY(msgmanager.getNext() == msgs[1]);
+    QVERIFY(msgmanager.hasHeldMessages("device1"));
+
+    // a removed message leaves its recipient's queue.
+    msgmanager.removeMessage(1);
+    QVERIFY(!msgmanager.hasHeldMessages("device1"));
+    QVERIFY(msgmanager.getHeldQueueMap().empty());
+    QVERIFY(!msgmanager.takeHeldMessage("device1"));
+}
+
+void GimmmTest::testRetryScheduler()
+{
+    // delays without jitter double until they hit the cap.
+    RetryScheduler sched(RetryPolicy(100, 1000, 5, JitterType::NONE));
+    QVERIFY(sched.empty());
+    QVERIFY(sched.nextDueTime() == -1);
+    QVERIFY(sched.getDelay(1) == 100);
+    QVERIFY(sched.getDelay(2) == 200);
+    QVERIFY(sched.getDelay(4) == 800);
+    QVERIFY(sched.getDelay(5) == 1000);
+    QVERIFY(sched.getDelay(6) == -1);
+
+    // nothing is scheduled once max attempts is breached.
+    QVERIFY(sched.schedule(1, 6, 0) == -1);
+    QVERIFY(sched.empty());
+
+    QVERIFY(sched.schedule(1, 3, 1000) == 400); // due @1400
+    QVERIFY(sched.schedule(2, 1, 1000) == 100); // due @1100
+    QVERIFY(sched.schedule(3, 2, 1050) == 200); // due @1250
+    QVERIFY(sched.size() == 3);
+    QVERIFY(sched.nextDueTime() == 1100);
+
+    std::vector<RetryEntry> due;
+    QVERIFY(sched.takeDue(1099, due) == 0);
+    QVERIFY(sched.takeDue(1300, due) == 2);
+    QVERIFY(due.size() == 2);
+    QVERIFY(due[0].sequenceId == 2);
+    QVERIFY(due[0].attempt == 1);
+    QVERIFY(due[1].sequenceId == 3);
+    QVERIFY(sched.nextDueTime() == 1400);
+
+    // batch size limits how many entries are fired at once.
+    for (SequenceId_t i = 10; i < 20; i++)
+        sched.schedule(i, 1, 1400);
+    due.clear();
+    QVERIFY(sched.takeDue(5000, due, 4) == 4);
+    QVERIFY(sched.takeDue(5000, due) == 7);
+    QVERIFY(sched.empty());
+
+    // explicit due times bypass the policy, max attempts included.
+    sched.scheduleAt(30, 0, 7000, 5000);
+    sched.scheduleAt(31, 9, 6000, 5000);
+    QVERIFY(sched.nextDueTime() == 6000);
+    due.clear();
+    QVERIFY(sched.takeDue(7000, due) == 2);
+    QVERIFY(due[0].sequenceId == 31);
+    QVERIFY(due[0].attempt == 9);
+
+    // jitter stays within bounds.
+    RetryScheduler full(RetryPolicy(1000, 8000, NO_MAX_RETRY, JitterType::FULL));
+    RetryScheduler equal(RetryPolicy(1000, 8000, NO_MAX_RETRY, JitterType::EQUAL));
+    for (int attempt = 1; attempt <= 100; attempt++)
+    {
+        std::int64_t f = full.getDelay(attempt);
+        std::int64_t e = equal.getDelay(attempt);
+        std::int64_t cap = std::min<std::int64_t>(8000, attempt < 5 ? 1000 << (attempt - 1) : 8000);
+        QVERIFY(f >= 0 && f <= cap);
+        QVERIFY(e >= cap / 2 && e <= cap);
+    }
+    QVERIFY(sizeof(RetryEntry) <= 16);
+}
+
+
+void GimmmTest::testTimingWheel()
+{
+    TimingWheel wheel(10, 0);
+    std::vector<int> fired;
+
+    QVERIFY(wheel.empty());
+    TimerHandle_t h1 = wheel.schedule(25, [&fired]{ fired.push_back(1);});
+    TimerHandle_t h2 = wheel.schedule(5, [&fired]{ fired.push_back(2);});
+    TimerHandle_t h3 = wheel.schedule(10000, [&fired]{ fired.push_back(3);}); // level 1
+    TimerHandle_t h4 = wheel.schedule(3600000, [&fired]{ fired.push_back(4);}); // level 3
+    QVERIFY(wheel.size() == 4);
+    QVERIFY(wheel.isActive(h1));
+
+    // never early.
+    QVERIFY(wheel.advance(9) == 0);
+    QVERIFY(wheel.advance(10) == 1);
+    QVERIFY(fired.size() == 1 && fired[0] == 2);
+    QVERIFY(!wheel.isActive(h2));
+    QVERIFY(wheel.advance(29) == 0);
+    QVERIFY(wheel.advance(30) == 1);
+    QVERIFY(fired.back() == 1);
+
+    // cancel is idempotent and resets the handle.
+    QVERIFY(wheel.cancel(h3) == true);
+    QVERIFY(h3 == INVALID_TIMER_HANDLE);
+    QVERIFY(wheel.cancel(h3) == false);
+    QVERIFY(wheel.advance(20000) == 0);
+
+    // cascades down from the last level.
+    QVERIFY(wheel.advance(3599990) == 0);
+    QVERIFY(wheel.advance(3600000) == 1);
+    QVERIFY(fired.back() == 4);
+    QVERIFY(!wheel.isActive(h4));
+    QVERIFY(wheel.empty());
+
+    // a stale handle doesn't cancel a recycled node.
+    TimerHandle_t stale = h1;
+    TimerHandle_t h5 = wheel.schedule(3600100, [&fired]{ fired.push_back(5);});
+    QVERIFY(wheel.cancel(stale) == false);
+    QVERIFY(wheel.isActive(h5));
+
+    // callbacks may schedule and cancel timers of the same tick.
+    TimerHandle_t h7 = INVALID_TIMER_HANDLE;
+    wheel.schedule(3600200, [&]{
+        fired.push_back(6);
+        wheel.cancel(h7);
+        wheel.schedule(3600200, [&fired]{ fired.push_back(8);});
+    });
+    h7 = wheel.schedule(3600200, [&fired]{ fired.push_back(7);});
+    QVERIFY(wheel.advance(3600210) == 3);
+    QVERIFY(fired[fired.size() - 3] == 5);
+    QVERIFY(fired[fired.size() - 2] == 6);
+    QVERIFY(fired.back() == 8);
+    QVERIFY(wheel.empty());
+
+    // many timers across levels fire in order and exactly once.
+    std::vector<std::int64_t> when;
+    std::int64_t now = 4000000;
+    wheel.advance(now);
+    for (int i = 0; i < 1000; i++)
+    {
+        std::int64_t expiry = now + (i * 7919) % 200000;
+        wheel.schedule(expiry, [&when, &now, expiry]{ QVERIFY(now >= expiry); when.push_back(expiry);});
+    }
+    for (; now <= 4000000 + 200010; now += 10)
+        wheel.advance(now);
+    QVERIFY(when.size() == 1000);
+    QVERIFY(std::is_sorted(when.begin(), when.end()));
+}
+
+
+void GimmmTest::testFcmDispatcher()
+{
+    FcmDispatcher dispatcher(DispatchPolicy::FREE_WINDOW, 2);
+    QVERIFY(dispatcher.pick("token") == NO_FCM_CONNECTION);
+
+    dispatcher.addLink(1);
+    dispatcher.addLink(2);
+    // not authenticated yet.
+    QVERIFY(dispatcher.pick("token") == NO_FCM_CONNECTION);
+    QVERIFY(dispatcher.getFreeSlots() == 0);
+
+    dispatcher.setAuthenticated(1, true);
+    dispatcher.setAuthenticated(2, true);
+    QVERIFY(dispatcher.getFreeSlots() == 4);
+
+    // free window: spread over the links.
+    int id = dispatcher.pick("token");
+    QVERIFY(id == 1);
+    dispatcher.onSent(id);
+    QVERIFY(dispatcher.pick("token") == 2);
+    dispatcher.onSent(2);
+    dispatcher.onSent(1);
+    dispatcher.onSent(2);
+    QVERIFY(dispatcher.getFreeSlots() == 0);
+    QVERIFY(dispatcher.pick("token") == NO_FCM_CONNECTION);
+
+    // ack frees a slot and feeds the rtt.
+    dispatcher.onCompleted(2, 100);
+    QVERIFY(dispatcher.pick("token") == 2);
+    QVERIFY(dispatcher.findLink(2)->ackRttMsec == 100);
+    dispatcher.onCompleted(2, 20);
+    QVERIFY(dispatcher.findLink(2)->ackRttMsec == 90);
+    QVERIFY(dispatcher.findLink(2)->acked == 2);
+    dispatcher.onCompleted(1, 50);
+
+    // ack latency: lowest rtt first.
+    dispatcher.setPolicy(DispatchPolicy::ACK_LATENCY);
+    QVERIFY(dispatcher.pick("token") == 1);
+
+    // draining links take no new messages.
+    dispatcher.setDraining(1, true);
+    QVERIFY(!dispatcher.isUsable(1));
+    QVERIFY(dispatcher.pick("token") == 2);
+    dispatcher.setDraining(1, false);
+
+    // blocked links keep what they have in flight but take no new messages.
+    std::int64_t free_slots = dispatcher.getFreeSlots();
+    dispatcher.setBlocked(1, true);
+    QVERIFY(!dispatcher.isUsable(1));
+    QVERIFY(dispatcher.isHealthy(1));
+    QVERIFY(dispatcher.pick("token") == 2);
+    QVERIFY(dispatcher.getFreeSlots() < free_slots);
+    dispatcher.setBlocked(1, false);
+    QVERIFY(dispatcher.getFreeSlots() == free_slots);
+
+    // token hash: a device sticks to one link while it has room.
+    dispatcher.setPolicy(DispatchPolicy::TOKEN_HASH);
+    dispatcher.resetInFlight(1);
+    dispatcher.resetInFlight(2);
+    int a = dispatcher.pick("device-a");
+    QVERIFY(a != NO_FCM_CONNECTION);
+    QVERIFY(dispatcher.pick("device-a") == a);
+    dispatcher.onSent(a);
+    dispatcher.onSent(a);
+    int other = dispatcher.pick("device-a");
+    QVERIFY(other != a && other != NO_FCM_CONNECTION);
+    QVERIFY(FcmDispatcher::hashToken("device-a") == FcmDispatcher::hashToken("device-a"));
+
+    dispatcher.removeLink(a);
+    QVERIFY(dispatcher.findLink(a) == nullptr);
+    QVERIFY(dispatcher.pick("device-a") == other);
+
+    // standbys are authenticated but take nothing until promoted.
+    FcmDispatcher pool(DispatchPolicy::FREE_WINDOW, 2);
+    pool.addLink(7);
+    pool.addLink(8);
+    pool.setAuthenticated(7, true);
+    pool.setAuthenticated(8, true);
+    pool.setStandby(8, true);
+    QVERIFY(pool.countActive() == 1 && pool.countStandby() == 1);
+    QVERIFY(pool.getFreeSlots() == 2);
+    QVERIFY(pool.findStandby() == 8);
+    pool.onSent(7);
+    pool.onSent(7);
+    QVERIFY(pool.pick("token") == NO_FCM_CONNECTION);
+    pool.setDraining(7, true);
+    QVERIFY(pool.countActive() == 0);
+    pool.setStandby(8, false);
+    QVERIFY(pool.pick("token") == 8);
+    QVERIFY(pool.findStandby() == NO_FCM_CONNECTION);
+
+    QVERIFY(FcmDispatcher::policyFromString("ack_latency") == DispatchPolicy::ACK_LATENCY);
+    bool thrown = false;
+    try
+    {
+        FcmDispatcher::policyFromString("round_robin");
+    }
+    catch (std::exception& err)
+    {
+        thrown = true;
+    }
+    QVERIFY(thrown);
+}
+
+
+void GimmmTest::testSpscQueue()
+{
+    SpscQueue<int> queue;
+    int value = -1;
+    QVERIFY(queue.empty());
+    QVERIFY(!queue.pop(value));
+
+    queue.push(1);
+    queue.push(2);
+    QVERIFY(queue.size() == 2);
+    QVERIFY(queue.pop(value) && value == 1);
+    QVERIFY(queue.pop(value) && value == 2);
+    QVERIFY(!queue.pop(value));
+    QVERIFY(queue.empty());
+
+    // one producer thread, one consumer thread; order must hold.
+    const int count = 100000;
+    std::thread producer([&queue, count]{
+        for (int i = 0; i < count; i++)
+            queue.push(i);
+    });
+    int expected = 0;
+    bool ordered = true;
+    while (expected < count)
+    {
+        if (queue.pop(value))
+        {
+            ordered = ordered && (value == expected);
+            expected++;
+        }
+    }
+    producer.join();
+    QVERIFY(ordered);
+    QVERIFY(queue.empty());
+
+    // elements still queued are freed with the queue.
+    SpscQueue<std::string> strings;
+    strings.push("left behind");
+}
+
+
+void GimmmTest::testStanzaScanner()
+{
+    StanzaScanner scanner;
+    StanzaSlice stanza;
+    auto text = [&stanza]{ return std::string(stanza.data, stanza.size);};
+
+    // handshake: stream level tags come out on their own, fast path is off.
+    std::string header = "<?xml version='1.0'?><stream:stream from=\"gcm.googleapis.com\" "
+                         "xmlns=\"jabber:client\" xmlns:stream=\"http://etherx.jabber.org/streams\">";
+    scanner.feed(header.data(), header.size());
+    QVERIFY(scanner.next(stanza) && text() == "<?xml version='1.0'?>");
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::XML);
+    QVERIFY(!scanner.next(stanza));
+
+    std::string gcm = "<message id=\"\"><gcm xmlns=\"google:mobile:data\">{\"a\":1}</gcm></message>";
+    scanner.feed(gcm.data(), gcm.size());
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::XML && text() == gcm);
+
+    // stream restart after SASL nests a new stream.
+    std::string restart = "<stream:stream id=\"2\"><stream:features><bind/></stream:features>";
+    scanner.feed(restart.data(), restart.size());
+    QVERIFY(scanner.next(stanza) && text() == "<stream:stream id=\"2\">");
+    QVERIFY(scanner.next(stanza) && text() == "<stream:features><bind/></stream:features>");
+    QVERIFY(!scanner.next(stanza));
+
+    // post handshake: split reads, keepalives, prefixes and entities.
+    scanner.setFastPath(true);
+    std::string data = " <message><data:gcm xmlns:data=\"google:mobile:data\">{\"b\":\"x&amp;y&#x41;\"}"
+                       "</data:gcm></message>\n" + gcm;
+    scanner.feed(data.data(), 20);
+    QVERIFY(!scanner.next(stanza));
+    scanner.feed(data.data() + 20, data.size() - 20);
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::GCM_JSON);
+    QVERIFY(text() == "{\"b\":\"x&yA\"}");
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::GCM_JSON && text() == "{\"a\":1}");
+    QVERIFY(!scanner.next(stanza));
+    QVERIFY(scanner.getBufferedSize() == 0);
+
+    // other shapes fall back to the generic parser.
+    std::string other = "<message><gcm xmlns=\"google:mobile:data\"><![CDATA[{}]]></gcm></message>"
+                        "<iq type=\"result\" note=\"a>b\"/>"
+                        "<message><gcm xmlns=\"google:mobile:data\">{\"c\":\"&bogus;\"}</gcm></message>"
+                        "</stream:stream>";
+    scanner.feed(other.data(), other.size());
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::XML);
+    QVERIFY(scanner.next(stanza) && text() == "<iq type=\"result\" note=\"a>b\"/>");
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::XML);
+    QVERIFY(scanner.next(stanza) && text() == "</stream:stream>");
+    QVERIFY(!scanner.next(stanza));
+
+    scanner.reset();
+    QVERIFY(scanner.getBufferedSize() == 0);
+
+    // reads go straight into the buffer; it is reused, not reallocated.
+    std::size_t capacity = scanner.getCapacity();
+    QVERIFY(capacity >= scanner.getPeakBufferedSize());
+    for (int i = 0; i < 100; i++)
+    {
+        char* dst = scanner.prepare(gcm.size());
+        memcpy(dst, gcm.data(), 30);
+        scanner.commit(30);
+        QVERIFY(!scanner.next(stanza));
+        dst = scanner.prepare(gcm.size());
+        memcpy(dst, gcm.data() + 30, gcm.size() - 30);
+        scanner.commit(gcm.size() - 30);
+        QVERIFY(scanner.next(stanza) && text() == "{\"a\":1}");
+        QVERIFY(!scanner.next(stanza));
+    }
+    QVERIFY(scanner.getCapacity() == capacity);
+
+    // stale bytes past the received ones are never scanned.
+    memcpy(scanner.prepare(gcm.size()), gcm.data(), gcm.size());
+    scanner.commit(gcm.size() - 1);
+    QVERIFY(!scanner.next(stanza));
+}
+
+
+void GimmmTest::testFcmEnvelope()
+{
+    QVERIFY(FcmEnvelope::typeFromString("ack") == FcmMessageType::ACK);
+    QVERIFY(FcmEnvelope::typeFromString("nack") == FcmMessageType::NACK);
+    QVERIFY(FcmEnvelope::typeFromString("receipt") == FcmMessageType::RECEIPT);
+    QVERIFY(FcmEnvelope::typeFromString("control") == FcmMessageType::CONTROL);
+    QVERIFY(FcmEnvelope::typeFromString("bogus") == FcmMessageType::UNKNOWN);
+
+    QByteArray nack("{\"message_type\":\"nack\",\"message_id\":\"m1\",\"from\":\"dev\","
+                    "\"error\":\"BAD_REGISTRATION\",\"error_description\":\"gone\"}");
+    FcmEnvelope envelope = FcmEnvelope::decode(QJsonDocument::fromJson(nack).object());
+    QVERIFY(envelope.type == FcmMessageType::NACK);
+    QVERIFY(envelope.messageId == "m1");
+    QVERIFY(envelope.from == "dev");
+    QVERIFY(envelope.error == "BAD_REGISTRATION");
+    QVERIFY(envelope.errorDescription == "gone");
+    QVERIFY(envelope.controlType.empty());
+    QVERIFY(envelope.toJson() == QJsonDocument::fromJson(nack).object());
+
+    // no 'message_type' means upstream.
+    QByteArray upstream("{\"message_id\":\"m2\",\"category\":\"app\",\"data\":{}}");
+    envelope = FcmEnvelope::decode(QJsonDocument::fromJson(upstream).object());
+    QVERIFY(envelope.type == FcmMessageType::UPSTREAM);
+    QVERIFY(envelope.category == "app");
+}
+
+
+void GimmmTest::testStanzaEncoder()
+{
+    std::string escaped;
+    StanzaEncoder::escape("a<b>c&d", 7, escaped);
+    QVERIFY(escaped == "a&lt;b&gt;c&amp;d");
+    escaped.clear();
+    StanzaEncoder::escape("{\"plain\":1}", 11, escaped);
+    QVERIFY(escaped == "{\"plain\":1}");
+
+    StanzaEncoder encoder;
+    QVERIFY(encoder.empty());
+    std::string json = "{\"to\":\"x\",\"data\":\"1<2\"}";
+    encoder.appendGcmMessage(json.data(), json.size());
+    encoder.appendGcmMessage("{}", 2);
+    QVERIFY(encoder.count() == 2);
+    std::string batch(encoder.data(), encoder.size());
+    QVERIFY(batch == "<message id=\"\"><gcm xmlns=\"google:mobile:data\">{\"to\":\"x\",\"data\":\"1&lt;2\"}</gcm></message>"
+                     "<message id=\"\"><gcm xmlns=\"google:mobile:data\">{}</gcm></message>");
+
+    // what the encoder writes, the scanner reads back.
+    StanzaScanner scanner;
+    StanzaSlice stanza;
+    scanner.setFastPath(true);
+    scanner.feed(encoder.data(), encoder.size());
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::GCM_JSON);
+    QVERIFY(std::string(stanza.data, stanza.size) == json);
+
+    encoder.clear();
+    QVERIFY(encoder.empty() && encoder.count() == 0);
+
+    // minimal acks, escaped for both JSON and XML.
+    escaped.clear();
+    StanzaEncoder::escapeJsonString("a\"b\\c<\n", escaped);
+    QVERIFY(escaped == "a\\\"b\\\\c&lt;\\u000a");
+    encoder.appendAck("dev1", "m-1");
+    QVERIFY(std::string(encoder.data(), encoder.size()) ==
+            "<message><gcm xmlns=\"google:mobile:data\">"
+            "{\"to\":\"dev1\",\"message_id\":\"m-1\",\"message_type\":\"ack\"}</gcm></message>");
+    encoder.appendAck("dev2", "m-2");
+    QVERIFY(encoder.count() == 2);
+
+    // handed over as one batch and appended whole on the other side.
+    std::string acks = encoder.take();
+    QVERIFY(encoder.empty() && encoder.count() == 0);
+    StanzaEncoder writer;
+    writer.appendRaw(acks.data(), acks.size(), 2);
+    QVERIFY(writer.count() == 2 && writer.size() == acks.size());
+    scanner.reset();
+    scanner.feed(writer.data(), writer.size());
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::GCM_JSON);
+    QVERIFY(std::string(stanza.data, stanza.size) ==
+            "{\"to\":\"dev1\",\"message_id\":\"m-1\",\"message_type\":\"ack\"}");
+    QVERIFY(scanner.next(stanza) && stanza.kind == StanzaKind::GCM_JSON);
+}
+
+
+void GimmmTest::testTlsSessionCache()
+{
+    TlsSessionCache cache;
+    std::string server = TlsSessionCache::serverKey("fcm-xmpp.googleapis.com", 5236);
+    QVERIFY(server == "fcm-xmpp.googleapis.com:5236");
+
+    // nothing to offer before the first full handshake.
+    QVERIFY(cache.find(server, 0).isEmpty());
+    QVERIFY(cache.getMisses() == 1);
+
+    // empty tickets aren't stored.
+    cache.store(server, QByteArray(), 100, 0);
+    QVERIFY(cache.size() == 0);
+
+    // a ticket stored by one connection is offered by any other.
+    cache.store(server, QByteArray("ticket1"), 100, 1000);
+    QVERIFY(cache.find(server, 1000).toStdString() == "ticket1");
+    QVERIFY(cache.find("localhost:5236", 1000).isEmpty());
+    QVERIFY(cache.getHits() == 1);
+
+    // the newest ticket wins.
+    cache.store(server, QByteArray("ticket2"), 100, 2000);
+    QVERIFY(cache.find(server, 2000).toStdString() == "ticket2");
+    QVERIFY(cache.size() == 1);
+
+    // expires with the server's lifetime hint.
+    QVERIFY(!cache.find(server, 101999).isEmpty());
+    QVERIFY(cache.find(server, 102000).isEmpty());
+    QVERIFY(cache.size() == 0);
+
+    // no hint, default lifetime.
+    cache.store(server, QByteArray("ticket3"), 0, 0);
+    QVERIFY(!cache.find(server, DEFAULT_TLS_TICKET_LIFETIME_SEC * 1000 - 1).isEmpty());
+
+    // a ticket the server wouldn't take is dropped.
+    cache.remove(server);
+    QVERIFY(cache.find(server, 0).isEmpty());
+    QVERIFY(cache.getStores() == 3);
+}
+
+
+void GimmmTest::testFcmConnection_tlsSession()
+{
+    TlsSessionCachePtr_t cache(new TlsSessionCache());
+    std::string server = TlsSessionCache::serverKey("fcm-xmpp.googleapis.com", 5236);
+
+    // resumption off: no tickets asked for, none kept.
+    QSslConfiguration config;
+    TlsSessionCachePtr_t nocache;
+    QVERIFY(!FcmConnection::applyTlsSession(config, nocache, server, 0));
+    QVERIFY(config.testSslOption(QSsl::SslOptionDisableSessionTickets));
+    QVERIFY(config.testSslOption(QSsl::SslOptionDisableSessionPersistence));
+    FcmConnection::saveTlsSession(config, nocache, server, 0);
+
+    // the first connection has nothing to offer but keeps its session.
+    QVERIFY(!FcmConnection::applyTlsSession(config, cache, server, 0));
+    QVERIFY(!config.testSslOption(QSsl::SslOptionDisableSessionTickets));
+    QVERIFY(!config.testSslOption(QSsl::SslOptionDisableSessionPersistence));
+    QVERIFY(config.sessionTicket().isEmpty());
+
+    // its handshake leaves the ticket to the pool ...
+    config.setSessionTicket(QByteArray("ticket1"));
+    FcmConnection::saveTlsSession(config, cache, server, 1000);
+    QVERIFY(cache->getStores() == 1);
+
+    // ... which the next connection offers.
+    QSslConfiguration next;
+    QVERIFY(FcmConnection::applyTlsSession(next, cache, server, 2000));
+    QVERIFY(next.sessionTicket() == QByteArray("ticket1"));
+    QVERIFY(cache->getHits() == 1);
+
+    // a ticket left over from an old session is replaced, not offered again.
+    cache->remove(server);
+    QVERIFY(!FcmConnection::applyTlsSession(next, cache, server, 3000));
+    QVERIFY(next.sessionTicket().isEmpty());
+}
+
+
+void GimmmTest::testKeepaliveTracker()
+{
+    KeepaliveTracker tracker(1000, 2500);
+    tracker.reset(10000);
+    QVERIFY(tracker.nextCheckAt() == 11000);
+    QVERIFY(tracker.check(10999) == KeepaliveAction::NONE);
+
+    // ping once per interval while nothing comes back.
+    QVERIFY(tracker.check(11000) == KeepaliveAction::PING);
+    tracker.onPingSent(11000);
+    QVERIFY(tracker.check(11500) == KeepaliveAction::NONE);
+    QVERIFY(tracker.nextCheckAt() == 12000);
+
+    // any traffic pushes both deadlines out.
+    tracker.onReceived(11800);
+    QVERIFY(tracker.getMaxGap() == 1800);
+    QVERIFY(tracker.check(12000) == KeepaliveAction::NONE);
+    QVERIFY(tracker.nextCheckAt() == 12800);
+
+    // nothing for the idle timeout; dead wins over a due ping.
+    tracker.onPingSent(12800);
+    tracker.onPingSent(13800);
+    QVERIFY(tracker.nextCheckAt() == 14300);
+    QVERIFY(tracker.check(14299) == KeepaliveAction::NONE);
+    QVERIFY(tracker.check(14300) == KeepaliveAction::DEAD);
+    QVERIFY(tracker.getIdle(14300) == 2500);
+
+    // a reconnect starts over.
+    tracker.reset(20000);
+    QVERIFY(tracker.check(20000) == KeepaliveAction::NONE);
+    QVERIFY(tracker.getMaxGap() == 1800);
+
+    // 0 turns either part off.
+    tracker.setIdleTimeout(0);
+    QVERIFY(tracker.check(30000) == KeepaliveAction::PING);
+    tracker.setPingInterval(0);
+    QVERIFY(tracker.check(30000) == KeepaliveAction::NONE);
+    QVERIFY(tracker.nextCheckAt() == -1);
+
+    QVERIFY(KeepaliveTracker::modeFromString("xmpp") == KeepaliveMode::XMPP_PING);
+    QVERIFY(KeepaliveTracker::modeFromString("whitespace") == KeepaliveMode::WHITESPACE);
+    bool thrown = false;
+    try
+    {
+        KeepaliveTracker::modeFromString("tcp");
+    }
+    catch (std::exception&)
+    {
+        thrown = true;
+    }
+    QVERIFY(thrown);
+}
+
+
+void GimmmTest::testCongestionWindow()
+{
+    CongestionWindow window(2, 8);
+    QVERIFY(window.size() == 2);
+
+    // slow start up to the cap, never past it.
+    for (int i = 0; i < 7; i++)
+        window.onAck(20);
+    QVERIFY(window.size() == 8);
+    QVERIFY(window.getMinRtt() == 20);
+
+    // a throttling nack halves it, once per window's worth of completions.
+    window.onThrottled();
+    QVERIFY(window.size() == 4);
+    window.onThrottled();
+    QVERIFY(window.size() == 4);
+    QVERIFY(window.getBackoffs() == 1);
+
+    // additive increase above the threshold.
+    for (int i = 0; i < 3; i++)
+        window.onAck(20);
+    QVERIFY(window.size() == 4);
+    window.onAck(200);
+    window.onAck(200);
+    QVERIFY(window.size() == 5);
+
+    // rising rtt shrinks it and holds it there.
+    window.onAck(200);
+    QVERIFY(window.isRttRising());
+    QVERIFY(window.getBackoffs() == 2);
+    QVERIFY(window.size() == 4);
+    window.onAck(200);
+    QVERIFY(window.size() == 4);
+
+    window.reset(3);
+    QVERIFY(window.size() == 3);
+    QVERIFY(window.getMinRtt() == 0);
+    QVERIFY(window.getBackoffs() == 0);
+
+    // at the minimum window a slower path becomes the new base rtt.
+    CongestionWindow slow(1, 8);
+    slow.onThrottled();
+    slow.onAck(10);
+    QVERIFY(slow.size() == 2);
+    slow.onAck(1000);
+    QVERIFY(slow.size() == 1);
+    slow.onAck(1000);
+    QVERIFY(slow.getMinRtt() > 200);
+    QVERIFY(!slow.isRttRising());
+    QVERIFY(slow.size() == 2);
+
+    // dispatcher side: the link window follows the controller.
+    FcmDispatcher dispatcher(DispatchPolicy::FREE_WINDOW, 8);
+    dispatcher.setCongestionControl(true, 2);
+    dispatcher.addLink(1);
+    dispatcher.setAuthenticated(1, true);
+    QVERIFY(dispatcher.getFreeSlots() == 2);
+    dispatcher.onSent(1);
+    dispatcher.onSent(1);
+    QVERIFY(dispatcher.pick("token") == NO_FCM_CONNECTION);
+    dispatcher.onCompleted(1, 20);
+    QVERIFY(dispatcher.findLink(1)->window == 3);
+    QVERIFY(dispatcher.getFreeSlots() == 2);
+    dispatcher.onThrottled(1);
+    QVERIFY(dispatcher.findLink(1)->window == 1);
+    QVERIFY(dispatcher.findLink(1)->throttled == 1);
+    QVERIFY(dispatcher.getFreeSlots() == 0);
+    // the throttled message gives its slot back without growing the window.
+    dispatcher.onCompleted(1);
+    QVERIFY(dispatcher.findLink(1)->window == 1);
+    QVERIFY(dispatcher.getFreeSlots() == 1);
+    dispatcher.resetInFlight(1);
+    QVERIFY(dispatcher.findLink(1)->window == 2);
+
+    // the cap comes from the config.
+    FcmDispatcher capped;
+    capped.setMaxWindow(4);
+    capped.setCongestionControl(true, 10);
+    QVERIFY(capped.getInitialWindow() == 4);
+    capped.addLink(1);
+    QVERIFY(capped.findLink(1)->congestion.getMaxWindow() == 4);
+
+    // off: the window stays at the cap.
+    FcmDispatcher fixed(DispatchPolicy::FREE_WINDOW, 8);
+    fixed.addLink(1);
+    fixed.onThrottled(1);
+    QVERIFY(fixed.findLink(1)->window == 8);
+    QVERIFY(fixed.findLink(1)->throttled == 1);
+}
+
+
+void GimmmTest::testTokenBucket()
+{
+    TokenBucket bucket(100, 2, 1000);
+    QVERIFY(bucket.isReady(1000));
+    bucket.take(1000);
+    bucket.take(1000);
+    QVERIFY(!bucket.isReady(1000));
+    QVERIFY(bucket.readyAt(1000) == 1100);
+    QVERIFY(bucket.readyAt(1050) == 1100);
+
+    // never saves up more than the burst.
+    QVERIFY(bucket.getTokens(5000) == 2);
+
+    // sends without a token put it in debt, at most a burst deep.
+    bucket.take(1100);
+    bucket.take(1100);
+    bucket.take(1100);
+    bucket.take(1100);
+    QVERIFY(bucket.getTokens(1100) == -2);
+    QVERIFY(bucket.readyAt(1100) == 1400);
+
+    bucket.drain(5000);
+    QVERIFY(bucket.getTokens(5000) == 0);
+    QVERIFY(bucket.readyAt(5000) == 5100);
+}
+
+
+void GimmmTest::testRecipientRateLimiter()
+{
+    RecipientRateLimiter limiter(2, 1000);
+    QVERIFY(limiter.readyAt("dev1", 0) == 0);
+    limiter.onSent("dev1", 0);
+    QVERIFY(limiter.size() == 0);
+
+    // learned from the nack; each further one doubles the interval.
+    limiter.onRateExceeded("dev1", 10000);
+    QVERIFY(limiter.findInterval("dev1") == 1000);
+    QVERIFY(limiter.readyAt("dev1", 10000) == 11000);
+    QVERIFY(limiter.readyAt("dev2", 10000) == 10000);
+    limiter.onRateExceeded("dev1", 10500);
+    QVERIFY(limiter.findInterval("dev1") == 2000);
+    QVERIFY(limiter.readyAt("dev1", 10500) == 12500);
+    QVERIFY(limiter.getRateExceeded() == 2);
+
+    // one message per interval.
+    limiter.onSent("dev1", 12500);
+    QVERIFY(limiter.readyAt("dev1", 12500) == 14500);
+
+    // deliveries relax it back to the initial interval, then forget it.
+    limiter.onDelivered("dev1");
+    QVERIFY(limiter.findInterval("dev1") == 1500);
+    limiter.onDelivered("dev1");
+    QVERIFY(limiter.findInterval("dev1") == 1125);
+    limiter.onDelivered("dev1");
+    QVERIFY(limiter.findInterval("dev1") == 1000);
+    for (int i = 0; i < RATE_LIMIT_FORGET_AFTER; i++)
+        limiter.onDelivered("dev1");
+    QVERIFY(limiter.findInterval("dev1") == -1);
+
+    // bounded; the least recently used goes.
+    limiter.onRateExceeded("dev1", 20000);
+    limiter.onRateExceeded("dev2", 20000);
+    limiter.onSent("dev1", 21000);
+    limiter.onRateExceeded("dev3", 22000);
+    QVERIFY(limiter.size() == 2);
+    QVERIFY(limiter.getEvictions() == 1);
+    QVERIFY(limiter.findInterval("dev2") == -1);
+    QVERIFY(limiter.findInterval("dev1") == 1000);
+
+    // 0 entries turns it off.
+    limiter.setCapacity(0);
+    QVERIFY(limiter.size() == 0);
+    limiter.onRateExceeded("dev4", 30000);
+    QVERIFY(limiter.readyAt("dev4", 30000) == 30000);
+}
+
+
+void GimmmTest::testDedupIndex()
+{
+    DedupIndex index(3, 1000);
+    QVERIFY(!index.isDuplicate("m1", 0));
+
+    // rebuilt from the store, oldest first.
+    index.insert("m1", -500);
+    index.insert("m2", 0);
+    QVERIFY(index.isDuplicate("m1", 100));
+    QVERIFY(index.getDuplicates() == 1);
+    QVERIFY(!index.isDuplicate("m3", 100));
+
+    // forgotten after the window; a duplicate started m1's over.
+    QVERIFY(index.isDuplicate("m2", 999));
+    QVERIFY(index.isDuplicate("m1", 1000));
+    QVERIFY(!index.isDuplicate("m2", 1999));
+    QVERIFY(index.size() == 1);
+
+    // bounded; the least recently seen goes.
+    index.insert("m4", 1100);
+    index.insert("m5", 1200);
+    index.insert("m6", 1300);
+    QVERIFY(index.size() == 3);
+    QVERIFY(index.getEvictions() == 1);
+    QVERIFY(!index.isDuplicate("m1", 1300));
+    QVERIFY(index.isDuplicate("m4", 1300));
+
+    // 0 entries turns it off.
+    index.setCapacity(0);
+    index.insert("m7", 1400);
+    QVERIFY(!index.isDuplicate("m7", 1400));
+    QVERIFY(index.size() == 0);
+
+    // ids are only unique per sender; the same id from another device or
+    // another project is a new message.
+    DedupIndex upstream;
+    std::string key = DedupIndex::upstreamKey("fcm", "device1", "m1");
+    upstream.insert(key, 0);
+    QVERIFY(upstream.isDuplicate(DedupIndex::upstreamKey("fcm", "device1", "m1"), 10));
+    QVERIFY(!upstream.isDuplicate(DedupIndex::upstreamKey("fcm", "device2", "m1"), 10));
+    QVERIFY(!upstream.isDuplicate(DedupIndex::upstreamKey("fcm.shop", "device1", "m1"), 10));
+    QVERIFY(DedupIndex::upstreamKey("fcm", "device1", "").empty());
+}
+
+
+void GimmmTest::testFcmProject()
+{
+    FcmProject news("news", "fcm.news");
+    FcmProject shop("shop", "fcm.shop");
+    QVERIFY(news.getName() == "news");
+    QVERIFY(news.getMessageManager().getSessionId() == "fcm.news");
+
+    // 100 pending per connection of the pool.
+    news.setPoolSize(3);
+    QVERIFY(news.getPoolSize() == 3);
+    QVERIFY(news.getMessageManager().getMaxPendingAllowed() == 3 * MAX_PENDING_MESSAGES);
+
+    // 0 = unlimited.
+    news.setSendRate(0, 5, 0);
+    QVERIFY(news.getSendRate().isReady(0));
+    news.setSendRate(10, 1, 0);
+    QVERIFY(news.getSendRatePerSec() == 10);
+    QVERIFY(news.getSendBurst() == 1);
+    news.getSendRate().take(0);
+    QVERIFY(!news.getSendRate().isReady(0));
+    QVERIFY(news.getSendRate().readyAt(0) == 100);
+
+    // nothing is shared between projects.
+    shop.setSendRate(10, 1, 0);
+    QVERIFY(shop.getSendRate().isReady(0));
+    news.getDispatcher().addLink(1);
+    news.getDispatcher().setAuthenticated(1, true);
+    QVERIFY(news.getDispatcher().getFreeSlots() > 0);
+    QVERIFY(shop.getDispatcher().getFreeSlots() == 0);
+    QVERIFY(shop.getDispatcher().pick("token") == NO_FCM_CONNECTION);
+    news.getRateLimiter().onRateExceeded("device", 0);
+    QVERIFY(news.getRateLimiter().readyAt("device", 0) > 0);
+    QVERIFY(shop.getRateLimiter().readyAt("device", 0) == 0);
+
+    QVERIFY(!news.admitSend(0));
+    QVERIFY(news.getSendRateWaits() == 1);
+    QVERIFY(shop.getSendRateWaits() == 0);
+}
+
+
+void GimmmTest::testFcmProject_admitSend()
+{
+    FcmProject project("news", "fcm.news");
+    project.setSendRate(10, 2, 0);
+
+    // unlimited never waits.
+    FcmProject open("open", "fcm.open");
+    open.setSendRate(0, 1, 0);
+    for (int i = 0; i < 10; i++)
+    {
+        QVERIFY(open.admitSend(0));
+        open.getSendRate().take(0);
+    }
+    QVERIFY(open.getSendRateWaits() == 0);
+
+    // a resend pass over 6 messages: the one in flight on a healthy
+    // connection is left alone, the burst goes out, and the pass stops at the
+    // first message without a token and counts one wait.
+    project.getDispatcher().addLink(1);
+    project.getDispatcher().setAuthenticated(1, true);
+    std::vector<MessagePtr_t> msgs;
+    for (int i = 1; i <= 6; i++)
+    {
+        PayloadPtr_t payload(new QJsonDocument());
+        MessagePtr_t msg( new Message(i,
+                                         MessageType::DOWNSTREAM,
+                                        "msgid" + std::to_string(i),
+                                        "",
+                                        "source_session_id",
+                                        "target_session_id",
+                                        payload));
+        msgs.push_back(msg);
+    }
+    msgs[0]->setState(MessageState::PENDING_ACK);
+    msgs[0]->setConnectionId(1);
+    std::vector<MessagePtr_t> sent;
+    MessagePtr_t waiting = project.resendPass(msgs, 0, [&](MessagePtr_t& msg)
+    {
+        project.getSendRate().take(0);
+        sent.push_back(msg);
+    });
+    QVERIFY(sent.size() == 2);
+    QVERIFY(sent[0] == msgs[1] && sent[1] == msgs[2]);
+    QVERIFY(waiting == msgs[3]);
+    QVERIFY(project.getSendRateWaits() == 1);
+
+    // the send rate timer fires when the next token is there.
+    std::int64_t at = project.getSendRate().readyAt(0);
+    QVERIFY(at == 100);
+    QVERIFY(!project.admitSend(at - 1));
+    QVERIFY(project.admitSend(at));
+    project.getSendRate().take(at);
+    QVERIFY(!project.admitSend(at));
+    QVERIFY(project.getSendRateWaits() == 3);
+
+    // a resend that went out without a token leaves the bucket in debt.
+    project.getSendRate().take(at);
+    QVERIFY(!project.admitSend(at + 100));
+    QVERIFY(project.admitSend(at + 200));
+}
+
+
+void GimmmTest::testFcmProject_routing()
+{
+    FcmProjectMap_t projects;
+    FcmProjectPtr_t defproject = std::make_shared<FcmProject>(DEFAULT_FCM_PROJECT, DEFAULT_FCM_SESSION_ID);
+    projects.emplace(DEFAULT_FCM_PROJECT, defproject);
+    projects.emplace("news", std::make_shared<FcmProject>("news", "fcm.news"));
+    projects.emplace("shop", std::make_shared<FcmProject>("shop", "fcm.shop"));
+    FcmProject& news = *projects["news"];
+    FcmProject& shop = *projects["shop"];
+    news.setPoolSize(1);
+    shop.setPoolSize(1);
+
+    // by the 'project' field; none is the default project.
+    QVERIFY(routeFcmProject(projects, defproject, "news").get() == &news);
+    QVERIFY(routeFcmProject(projects, defproject, "shop").get() == &shop);
+    QVERIFY(routeFcmProject(projects, defproject, "") == defproject);
+    QVERIFY(!routeFcmProject(projects, defproject, "other"));
+
+    // an unknown project is rejected back to the BAL session that sent it.
+    QJsonObject data;
+    data.insert(fcmfieldnames::TO, "device");
+    PayloadPtr_t rejected_payload(new QJsonDocument(data));
+    Message rejected(0, MessageType::DOWNSTREAM, "msgid0", "", "bal",
+                     DEFAULT_FCM_SESSION_ID, rejected_payload);
+    MessagePtr_t reject = Message::createDownstreamReject(42, "other", DEFAULT_FCM_SESSION_ID,
+                                                          rejected, "Unknown project[other].");
+    QVERIFY(reject->getType() == MessageType::DOWNSTREAM_REJECT);
+    QVERIFY(reject->getSequenceId() == 42);
+    QVERIFY(reject->getFcmMessageId() == "msgid0");
+    QVERIFY(reject->getSourceSessionId() == DEFAULT_FCM_SESSION_ID);
+    QVERIFY(reject->getTargetSessionId() == "bal");
+    QJsonObject root = reject->getPayload()->object();
+    QVERIFY(root.value(gimmmfieldnames::PROJECT).toString() == "other");
+    QVERIFY(root.value(gimmmfieldnames::ERROR_DESC).toString() == "Unknown project[other].");
+    QVERIFY(root.value(gimmmfieldnames::FCM_DATA).toObject() == data);
+
+    SequenceId_t seqid = 0;
+    auto route = [&](const std::string& name, const std::string& to) -> MessagePtr_t
+    {
+        MessageManager& msgmanager = routeFcmProject(projects, defproject, name)->getMessageManager();
+        PayloadPtr_t payload(new QJsonDocument());
+        seqid++;
+        MessagePtr_t msg( new Message(seqid,
+                                         MessageType::DOWNSTREAM,
+                                        "msgid" + std::to_string(seqid),
+                                        "",
+                                        "bal",
+                                        msgmanager.getSessionId(),
+                                        payload));
+        msg->setTo(to);
+        msgmanager.addMessage(seqid, msg);
+        return msg;
+    };
+
+    // news fills its pool.
+    for (int i = 0; i < MAX_PENDING_MESSAGES; i++)
+    {
+        MessagePtr_t msg = route("news", "device");
+        QVERIFY(news.getMessageManager().getNext() == msg);
+        news.getMessageManager().markPendingAck(msg, 1000);
+    }
+    MessagePtr_t waiting = route("news", "device");
+    QVERIFY(!news.getMessageManager().getNext());
+
+    // shop's queue is untouched and still sends.
+    MessagePtr_t shopmsg = route("shop", "device");
+    QVERIFY(shop.getMessageManager().getPendingAckCount() == 0);
+    QVERIFY(shop.getMessageManager().getNext() == shopmsg);
+    QVERIFY(shop.getMessageManager().getMessages().size() == 1);
+    QVERIFY(news.getMessageManager().getMessages().size() == MAX_PENDING_MESSAGES + 1);
+    QVERIFY(news.getMessageManager().getMessages().count(shopmsg->getSequenceId()) == 0);
+
+    // a held recipient of one project isn't held in the other.
+    MessagePtr_t held = route("shop", "device2");
+    QVERIFY(shop.getMessageManager().holdMessage(held));
+    QVERIFY(shop.getMessageManager().hasHeldMessages("device2"));
+    QVERIFY(!news.getMessageManager().hasHeldMessages("device2"));
+
+    // acks free the slot of their own project only.
+    news.getMessageManager().removeMessage(1);
+    QVERIFY(news.getMessageManager().getNext() == waiting);
+    QVERIFY(shop.getMessageManager().getNext() == shopmsg);
+}
@@ -20,6 +20,28 @@ class GimmmTest: public QObject
         void testMessageManager_findMessageWithFcmMsgId();
         void testMessageManager_removeMessageWithFcmMsgId();
         void testMessageManager_getNext();
+        void testMessageManager_ackDeadlines();
+        void testMessageManager_collectExpired();
+        void testMessageManager_collapseKey();
+        void testMessageManager_connectionIndex();
+        void testMessageManager_holdMessage();
+        void testRetryScheduler();
+        void testTimingWheel();
+        void testFcmDispatcher();
+        void testSpscQueue();
+        void testStanzaScanner();
+        void testFcmEnvelope();
+        void testStanzaEncoder();
+        void testTlsSessionCache();
+        void testFcmConnection_tlsSession();
+        void testKeepaliveTracker();
+        void testCongestionWindow();
+        void testTokenBucket();
+        void testRecipientRateLimiter();
+        void testDedupIndex();
+        void testFcmProject();
+        void testFcmProject_admitSend();
+        void testFcmProject_routing();
 };
 
 #endif // GIMMMTEST_H